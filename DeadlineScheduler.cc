@@ -0,0 +1,118 @@
+#include "DeadlineScheduler.hh"
+#include <algorithm>
+
+using namespace dooragent;
+using namespace std;
+
+DeadlineScheduler::DeadlineScheduler(shared_ptr<uvw::Loop> loop)
+    :loop(loop), armed_count(0), timer_running(false)
+{
+    heap.reserve(64);
+    if (loop)
+    {
+        loop_timer = loop->resource<uvw::TimerHandle>();
+        loop_timer->on<uvw::TimerEvent>([this](uvw::TimerEvent&, uvw::TimerHandle&)
+            {
+                timer_running = false;
+                RunExpired(chrono::steady_clock::now());
+            });
+    }
+}
+
+void DeadlineScheduler::Arm(Timer& timer, time_point when)
+{
+    if (timer.armed)
+        armed_count--;
+    timer.generation++;
+    timer.armed = true;
+    timer.deadline = when;
+    armed_count++;
+
+    heap.push_back(entry{when, &timer, timer.generation});
+    push_heap(heap.begin(), heap.end(), greater<entry>{});
+    Rearm();
+}
+
+void DeadlineScheduler::Cancel(Timer& timer)
+{
+    if (!timer.armed)
+        return;
+    // the heap entry stays behind and is dropped once it reaches the top
+    timer.generation++;
+    timer.armed = false;
+    armed_count--;
+}
+
+void DeadlineScheduler::Remove(Timer& timer)
+{
+    Cancel(timer);
+    // stale entries from earlier arms point at it too
+    auto end = remove_if(heap.begin(), heap.end(), [&timer](const entry& e)
+        {
+            return e.timer == &timer;
+        });
+    if (end == heap.end())
+        return;
+    heap.erase(end, heap.end());
+    make_heap(heap.begin(), heap.end(), greater<entry>{});
+    Rearm();
+}
+
+size_t DeadlineScheduler::RunExpired(time_point time_now)
+{
+    size_t fired = 0;
+    while (!heap.empty() && heap.front().when <= time_now)
+    {
+        pop_heap(heap.begin(), heap.end(), greater<entry>{});
+        entry e = heap.back();
+        heap.pop_back();
+
+        if (e.generation != e.timer->generation)
+            continue;
+
+        e.timer->armed = false;
+        armed_count--;
+        fired++;
+        // may arm or cancel timers, including this one
+        if (e.timer->callback)
+            e.timer->callback();
+    }
+    Rearm();
+    return fired;
+}
+
+void DeadlineScheduler::Rearm()
+{
+    while (!heap.empty() && heap.front().generation != heap.front().timer->generation)
+    {
+        pop_heap(heap.begin(), heap.end(), greater<entry>{});
+        heap.pop_back();
+    }
+
+    if (!loop_timer)
+        return;
+
+    if (heap.empty())
+    {
+        if (timer_running)
+        {
+            loop_timer->stop();
+            timer_running = false;
+        }
+        return;
+    }
+
+    auto next = heap.front().when;
+    if (timer_running && next == timer_deadline)
+        return;
+
+    // round up, the loop timer only has millisecond resolution and firing
+    // early would just mean another wakeup
+    auto delay = chrono::ceil<chrono::milliseconds>(next - chrono::steady_clock::now());
+    if (delay < 0ms)
+        delay = 0ms;
+    loop->update();
+    loop_timer->start(delay, 0ms);
+    timer_running = true;
+    timer_deadline = next;
+}
@@ -0,0 +1,62 @@
+#ifndef _DEADLINESCHEDULER_HH
+#define _DEADLINESCHEDULER_HH
+
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstdint>
+#include <uvw.hpp>
+
+namespace dooragent
+{
+    // Any number of deadlines multiplexed onto one loop timer, which is
+    // always set to the earliest one. Deadlines live in a binary min-heap;
+    // cancelling only bumps the timer's generation so stale heap entries
+    // are skipped when they come up.
+    class DeadlineScheduler
+    {
+    public:
+        using time_point = std::chrono::steady_clock::time_point;
+
+        struct Timer
+        {
+            std::function<void()> callback;
+            uint64_t generation = 0;
+            bool armed = false;
+            time_point deadline;
+        };
+
+        DeadlineScheduler(std::shared_ptr<uvw::Loop> loop);
+
+        void Arm(Timer& timer, time_point when);
+        void Cancel(Timer& timer);
+        // cancels and also drops the timer's heap entries, for a timer
+        // that is about to be destroyed
+        void Remove(Timer& timer);
+        size_t RunExpired(time_point time_now);
+
+        size_t GetArmedCount() const { return armed_count; }
+
+    protected:
+        struct entry
+        {
+            time_point when;
+            Timer *timer;
+            uint64_t generation;
+
+            bool operator>(const entry& other) const { return when > other.when; }
+        };
+
+        void Rearm();
+
+        std::shared_ptr<uvw::Loop> loop;
+        std::shared_ptr<uvw::TimerHandle> loop_timer;
+        std::vector<entry> heap;
+        size_t armed_count;
+        bool timer_running;
+        time_point timer_deadline;
+    };
+};
+
+#endif
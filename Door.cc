@@ -1,6 +1,8 @@
 #include "Door.hh"
 #include "Log.hh"
-#include <unistd.h>
+#include "PulseScheduler.hh"
+#include "GpioBackend.hh"
+#include <algorithm>
 
 using namespace dooragent;
 using namespace std;
@@ -27,79 +29,412 @@ string Door::StateStr(State state)
     return "Unknown";
 }
 
-Door::Door(int index)
-    :current_state(InitSensing), index(index), btn_pulse_time(300)
+namespace
 {
-    open_time = 10000;
-    close_time = 10000;
-    open_start_time = 4000;
-    last_state_time = chrono::steady_clock::now();
+    constexpr uint32_t state_bit(Door::State state)
+    {
+        return 1u << state;
+    }
+
+    // a chattering line can't keep the loop busy for longer than this
+    constexpr int max_edges_per_wakeup = 64;
+};
+
+Door::Door(int index, DoorBank& bank)
+    :index(index), bank(&bank), fault(false), btn_pulse_time(300),
+     pulse_scheduler(nullptr), deadline_scheduler(nullptr),
+     gpio_closed_sensor(-1), gpio_open_btn(-1), gpio_close_btn(-1),
+     gpio_open_sensor(-1), gpio_obstruction(-1)
+{
+    // which states the bank has to poll for and which debounced levels
+    // can cause a transition from them, see Evaluate(); the same for every
+    // door, so set once by the first one
+    static const bool masks_set = (DoorBank::SetStateMasks(
+        state_bit(InitSensing),
+        state_bit(OpenStart) | state_bit(Opening) | state_bit(OpeningSensed) | state_bit(Closing),
+        state_bit(InitSensing) | state_bit(Open) | state_bit(Opening) | state_bit(OpeningSensed) | state_bit(Closing),
+        state_bit(InitSensing) | state_bit(Closed) | state_bit(OpenStart)), true);
+    (void)masks_set;
+    slot = bank.Add(InitSensing);
+    bank.SetMovingPoll(slot, true);
+
+    open_time = cfg_open_time = 10000;
+    close_time = cfg_close_time = 10000;
+    open_start_time = cfg_open_start_time = 4000;
+    calibrate = false;
+    calibration_dirty = false;
+    cal_min_factor = 0.25;
+    cal_max_factor = 2.0;
+    late_travel = -1;
+    last_open_limit = last_obstruction = false;
+    intent = -1;
+    intent_expiry = 30000;
+    intent_timer.callback = [this]()
+        {
+            ExpireIntent(GpioBackend::Get().Now());
+        };
+
+    auto& metrics = Metrics::Get();
+    string labels = "door=\"" + to_string(index) + "\"";
+    commands_accepted = &metrics.AddCounter("door_commands_total", "Door commands by result", labels + ",result=\"accepted\"");
+    commands_rejected = &metrics.AddCounter("door_commands_total", "Door commands by result", labels + ",result=\"rejected\"");
+    commands_queued = &metrics.AddCounter("door_commands_total", "Door commands by result", labels + ",result=\"queued\"");
+    commands_expired = &metrics.AddCounter("door_commands_total", "Door commands by result", labels + ",result=\"expired\"");
+    chatter_faults = &metrics.AddCounter("door_sensor_faults_total", "Sensor faults by kind", labels + ",fault=\"chatter\"");
+    stuck_faults = &metrics.AddCounter("door_sensor_faults_total", "Sensor faults by kind", labels + ",fault=\"stuck\"");
+    open_start_hist = &metrics.AddHistogram("door_open_start_ms", "Time from an open command until the door leaves closed", labels);
+    open_travel_hist = &metrics.AddHistogram("door_open_travel_ms", "Time from leaving closed until the open limit is reached", labels);
+    close_travel_hist = &metrics.AddHistogram("door_close_travel_ms", "Time from a close command until the door is sensed closed", labels);
+    intent_wait_hist = &metrics.AddHistogram("door_intent_wait_ms", "Time a queued command waited until it ran", labels);
 }
 
-bool Door::SetClosedSensor(std::string chip, int line, bool level)
+bool Door::SetClosedSensor(std::string chip, int line, bool level, bool events)
 {
-    gpiod::chip io_chip(chip);
-    gpio_closed_sensor = io_chip.get_line(line);
-    gpiod::line_request req;
-    req.consumer = "door:" + to_string(index) + ".sensor";
-    req.request_type = gpiod::line_request::DIRECTION_INPUT;
-    req.flags = 0;
-    gpio_closed_sensor.request(req);
+    gpio_closed_sensor = GpioBackend::Get().AddInput(chip, line, events);
     gpio_closed_level = level;
+    return true;
 }
 
 bool Door::SetOpenBtn(std::string chip, int line, bool level)
 {
-    gpiod::chip io_chip(chip);
-    gpio_open_btn = io_chip.get_line(line);
-    gpiod::line_request req;
-    req.consumer = "door:" + to_string(index) + ".open";
-    req.request_type = gpiod::line_request::DIRECTION_OUTPUT;
-    req.flags = 0;
-    gpio_open_btn.request(req);
+    // on a reload, request the new line before releasing the old one so
+    // an unchanged line stays requested
+    auto& backend = GpioBackend::Get();
+    int old_btn = gpio_open_btn;
+    gpio_open_btn = backend.AddOutput(chip, line, level, "door:" + to_string(index) + ".open");
     gpio_open_level = level;
+    if (old_btn >= 0)
+        backend.ReleaseOutput(old_btn);
+    return true;
 }
 
 bool Door::SetCloseBtn(std::string chip, int line, bool level)
 {
+    auto& backend = GpioBackend::Get();
+    int old_btn = gpio_close_btn;
+    gpio_close_btn = backend.AddOutput(chip, line, level, "door:" + to_string(index) + ".close");
+    gpio_close_level = level;
+    if (old_btn >= 0)
+        backend.ReleaseOutput(old_btn);
+    return true;
+}
+
+void Door::ClearOpenBtn()
+{
+    if (gpio_open_btn >= 0)
+        ReleaseBtn(gpio_open_btn, gpio_open_level);
+    gpio_open_btn = -1;
+}
+
+void Door::ClearCloseBtn()
+{
+    if (gpio_close_btn >= 0)
+        ReleaseBtn(gpio_close_btn, gpio_close_level);
+    gpio_close_btn = -1;
+}
+
+// a pulse still running would drive the line after it is released
+void Door::ReleaseBtn(int output, bool level)
+{
+    if (pulse_scheduler)
+        pulse_scheduler->Cancel(output);
+    auto& backend = GpioBackend::Get();
+    backend.SetOutput(output, !level);
+    backend.ReleaseOutput(output);
+}
+
+bool Door::SetOpenSensor(std::string chip, int line, bool level)
+{
+    gpio_open_sensor = GpioBackend::Get().AddInput(chip, line, false);
+    gpio_open_sensor_level = level;
+    bank->EnableChannel(slot, DoorBank::ChOpenLimit);
+    bank->SetMovingPoll(slot, true);
+    return true;
+}
 
+bool Door::SetObstructionSensor(std::string chip, int line, bool level)
+{
+    gpio_obstruction = GpioBackend::Get().AddInput(chip, line, false);
+    gpio_obstruction_level = level;
+    bank->EnableChannel(slot, DoorBank::ChObstruction);
+    bank->SetMovingPoll(slot, true);
+    return true;
 }
 
 void Door::SetOpenTime(int t)
 {
-    open_time = t;
+    open_time = cfg_open_time = t;
+    UpdateTimeouts();
 }
 
 void Door::SetCloseTime(int t)
 {
-    close_time = t;
+    close_time = cfg_close_time = t;
+    UpdateTimeouts();
 }
 
 void Door::SetOpenStartTime(int t)
 {
-    open_start_time = t;
+    open_start_time = cfg_open_start_time = t;
+    UpdateTimeouts();
+}
+
+void Door::SetCalibration(bool enabled, double min_factor, double max_factor)
+{
+    calibrate = enabled;
+    cal_min_factor = min_factor;
+    cal_max_factor = max_factor;
+    UpdateTimeouts();
+}
+
+// The fault timeouts (open start, close) get a margin over what the door
+// really takes; Open is declared when the door has usually finished.
+// Without an open limit sensor there are no open samples, doors move
+// about as fast both ways. With one, the open time is a fault timeout too.
+void Door::UpdateTimeouts()
+{
+    if (!calibrate)
+        return;
+
+    auto lo = [this](int configured) { return int(configured * cal_min_factor); };
+    auto hi = [this](int configured) { return int(configured * cal_max_factor); };
+
+    open_start_time = estimators[TravelOpenStart].Timeout(cfg_open_start_time, lo(cfg_open_start_time), hi(cfg_open_start_time));
+    close_time = estimators[TravelClose].Timeout(cfg_close_time, lo(cfg_close_time), hi(cfg_close_time));
+    auto& open_est = estimators[TravelOpen].GetCount() >= TravelEstimator::min_samples ?
+        estimators[TravelOpen] : estimators[TravelClose];
+    if (gpio_open_sensor >= 0)
+        open_time = open_est.Timeout(cfg_open_time, lo(cfg_open_time), hi(cfg_open_time));
+    else
+        open_time = open_est.Typical(cfg_open_time, lo(cfg_open_time), hi(cfg_open_time));
+}
+
+void Door::Learn(Travel travel, int ms)
+{
+    if (!calibrate)
+        return;
+
+    static const char *names[] = {"open start", "open", "close"};
+    estimators[travel].Add(ms);
+    calibration_dirty = true;
+    UpdateTimeouts();
+    Log::Message("Door(", index, "): ", names[travel], " took ", ms, " ms, timeouts now open_start=",
+                 open_start_time, " open=", open_time, " close=", close_time);
+}
+
+void Door::SetPulseTime(int t)
+{
+    btn_pulse_time = t;
+}
+
+// Contact bounce is best handled where the edges are detected. Without
+// that, the glitch filter is widened to cover the bounce instead.
+void Door::SetDebounce(int debounce_ms, int stable_ms, int glitch_ms, DoorBank::Channel ch)
+{
+    int input = ch == DoorBank::ChOpenLimit ? gpio_open_sensor :
+        ch == DoorBank::ChObstruction ? gpio_obstruction : gpio_closed_sensor;
+    if (debounce_ms > 0 && (input < 0 || !GpioBackend::Get().SetInputDebounce(input, debounce_ms)))
+    {
+        Log::Message("Door(", index, "): no hardware debounce on input ", (int)ch, ", filtering glitches up to ", debounce_ms, " ms");
+        glitch_ms = max(glitch_ms, debounce_ms);
+    }
+    bank->SetDebounce(slot, stable_ms, glitch_ms, ch);
+}
+
+void Door::SetPulseScheduler(PulseScheduler *scheduler)
+{
+    pulse_scheduler = scheduler;
+}
+
+void Door::SetFaultHandler(fault_handler handler)
+{
+    on_fault = handler;
+}
+
+void Door::SetResultHandler(result_handler handler)
+{
+    on_result = handler;
+}
+
+// 0 turns queueing off, commands in the wrong state are rejected
+void Door::SetIntentExpiry(int t)
+{
+    intent_expiry = t;
+}
+
+void Door::SetHealthHandler(health_handler handler)
+{
+    on_health = handler;
+}
+
+void Door::SetHealthLimits(int chatter_changes, int stuck_after)
+{
+    health.SetLimits(max(chatter_changes, 0), max(stuck_after, 0));
+    if ((health.GetStatus() != SensorHealth::Ok) != fault)
+        HealthChanged(GpioBackend::Get().Now());
+}
+
+void Door::SetDeadlineScheduler(DeadlineScheduler *scheduler, function<void()> on_deadline)
+{
+    if (deadline_scheduler)
+    {
+        deadline_scheduler->Remove(deadline);
+        deadline_scheduler->Remove(settle);
+        deadline_scheduler->Remove(intent_timer);
+    }
+    deadline_scheduler = scheduler;
+    deadline.callback = on_deadline;
+    settle.callback = on_deadline;
+    bank->SetMovingPoll(slot, !deadline_scheduler || GetSensorFd() < 0 || HasPolledInputs());
+}
+
+void Door::Release()
+{
+    if (deadline_scheduler)
+    {
+        deadline_scheduler->Remove(deadline);
+        deadline_scheduler->Remove(settle);
+        deadline_scheduler->Remove(intent_timer);
+    }
+    intent = -1;
+    auto& backend = GpioBackend::Get();
+    if (gpio_closed_sensor >= 0)
+        backend.ReleaseInput(gpio_closed_sensor);
+    if (gpio_open_btn >= 0)
+        ReleaseBtn(gpio_open_btn, gpio_open_level);
+    if (gpio_close_btn >= 0)
+        ReleaseBtn(gpio_close_btn, gpio_close_level);
+    if (gpio_open_sensor >= 0)
+        backend.ReleaseInput(gpio_open_sensor);
+    if (gpio_obstruction >= 0)
+        backend.ReleaseInput(gpio_obstruction);
+    gpio_closed_sensor = gpio_open_btn = gpio_close_btn = gpio_open_sensor = gpio_obstruction = -1;
+    bank->Remove(slot);
+}
+
+void Door::SetHistory(unique_ptr<EventHistory> new_history)
+{
+    history = move(new_history);
+}
+
+int Door::GetSensorFd() const
+{
+    if (gpio_closed_sensor < 0)
+        return -1;
+    return GpioBackend::Get().GetInputFd(gpio_closed_sensor);
+}
+
+int Door::ReadInput(int input, bool level) const
+{
+    int value = GpioBackend::Get().GetInputValue(input);
+    return level ? value : !value;
 }
 
 bool Door::UpdateState()
 {
-    if (!gpio_closed_sensor)
+    if (gpio_closed_sensor < 0)
     {
         Log::Error("Door(" + to_string(index) + "): no closed sensor");
         return false;
     }
-    int closed_value = gpio_closed_sensor.get_value();
+
+    // the backend holds the value from the last bulk read or edge event
+    int closed_value = GpioBackend::Get().GetInputValue(gpio_closed_sensor);
+    if (!gpio_closed_level)
+        closed_value = !closed_value;
+
+    Log::Trace("Door(", index, "): sample, closed=", closed_value);
+    return ProcessSample(closed_value, GpioBackend::Get().Now());
+}
+
+// Every edge queued since the last wakeup goes through the debounce with
+// its own kernel timestamp, so a bounce that arrived in one batch is
+// filtered on its real timing instead of showing up as a single level.
+bool Door::HandleSensorEvent()
+{
+    if (gpio_closed_sensor < 0)
+        return false;
+
+    bool changed = false;
+    GpioBackend::edge event;
+    for (int n = 0; n < max_edges_per_wakeup && GpioBackend::Get().ReadInputEvent(gpio_closed_sensor, event); n++)
+    {
+        int closed_value = event.value ? 1 : 0;
+        if (!gpio_closed_level)
+            closed_value = !closed_value;
+
+        Log::Trace("Door(", index, "): sensor edge, closed=", closed_value);
+        recorder.Record(event.time, FlightRecorder::Edge, closed_value);
+
+        if (ProcessSample(closed_value, event.time))
+            changed = true;
+    }
+    return changed;
+}
+
+void Door::Sample(chrono::steady_clock::time_point time_now)
+{
+    if (gpio_closed_sensor < 0)
+        return;
+
+    int closed_value = GpioBackend::Get().GetInputValue(gpio_closed_sensor);
     if (!gpio_closed_level)
         closed_value = !closed_value;
 
-    Log::Message("Door(" + to_string(index) + "): closed=" + to_string(closed_value));
+    Log::Trace("Door(", index, "): sample, closed=", closed_value);
+    bank->SetSample(slot, closed_value);
+    if (gpio_open_sensor >= 0)
+        bank->SetSample(slot, ReadInput(gpio_open_sensor, gpio_open_sensor_level), DoorBank::ChOpenLimit);
+    if (gpio_obstruction >= 0)
+        bank->SetSample(slot, ReadInput(gpio_obstruction, gpio_obstruction_level), DoorBank::ChObstruction);
+    // without a deadline scheduler intents expire on the next poll
+    if (intent >= 0 && !deadline_scheduler && time_now >= intent_expires)
+        ExpireIntent(time_now);
+    recorder.Record(time_now, FlightRecorder::Sample, closed_value, 0, bank->GetHeld(slot, time_now));
+}
+
+bool Door::ProcessSample(int closed_value, chrono::steady_clock::time_point time_now)
+{
+    uint32_t held = bank->FilterOne(slot, closed_value, time_now);
+    recorder.Record(time_now, FlightRecorder::Sample, closed_value, 0, held);
+
+    // an edge doesn't come with a later sample to confirm it, wake up
+    // when the new level has held for the stable window
+    if (deadline_scheduler && !bank->Settled(slot))
+        deadline_scheduler->Arm(settle, bank->GetSettleTime(slot, time_now));
+
+    return Evaluate(time_now);
+}
 
-    closed_debounce_input = closed_debounce_input << 1 | (closed_value & 1);
-    bool closed_true = (closed_debounce_input & 0xF) == 0xF;
-    bool closed_false = (closed_debounce_input & 0xF) == 0;
+bool Door::Evaluate(chrono::steady_clock::time_point time_now)
+{
+    if (gpio_closed_sensor < 0)
+        return false;
 
-    auto time_now = chrono::steady_clock::now();
+    bool closed_true = bank->StableTrue(slot);
+    bool closed_false = bank->StableFalse(slot);
+    // the open limit says the door is all the way open, and leaving it
+    // says which way the door is going
+    bool has_limit = gpio_open_sensor >= 0;
+    bool open_limit = has_limit && bank->StableTrue(slot, DoorBank::ChOpenLimit) && !closed_true;
+    bool limit_reached = open_limit && !last_open_limit;
+    bool limit_left = has_limit && last_open_limit && bank->StableFalse(slot, DoorBank::ChOpenLimit);
+    bool obstructed = GetObstructed();
+    bool obstruction_cleared = last_obstruction && !obstructed;
+    last_open_limit = open_limit;
 
+    State current_state = GetState();
     State new_state = current_state;
+    int fault_kind = -1;
+
+    if (obstructed && !last_obstruction && current_state == Closing)
+    {
+        Log::Warning("Door(" + to_string(index) + "): obstructed while closing");
+        recorder.Record(time_now, FlightRecorder::Fault, FlightRecorder::FaultObstruction);
+        if (on_fault)
+            on_fault(*this, FlightRecorder::FaultObstruction);
+    }
+    last_obstruction = obstructed;
 
     switch (current_state)
     {
@@ -108,7 +443,7 @@ bool Door::UpdateState()
         {
             new_state = Closed;
         }
-        else if (closed_false)
+        else if (closed_false || open_limit)
         {
             new_state = Open;
         }
@@ -124,16 +459,19 @@ bool Door::UpdateState()
         {
             new_state = Closed;
         }
+        else if (limit_left)
+        {
+            new_state = Closing;
+        }
         break;
     case OpenStart:
-        if (closed_false)
+        if (open_limit)
         {
-            new_state = Opening;
+            new_state = Open;
         }
-        else if (time_now - last_state_time > open_start_time * 1ms)
+        else if (closed_false)
         {
-            Log::Warning("Door(" + to_string(index) + "): opening timed out");
-            new_state = Closed;
+            new_state = Opening;
         }
         break;
     case Opening:
@@ -142,7 +480,7 @@ bool Door::UpdateState()
         {
             new_state = Closed;
         }
-        else if (time_now - last_state_time > open_time * 1ms)
+        else if (open_limit)
         {
             new_state = Open;
         }
@@ -152,106 +490,414 @@ bool Door::UpdateState()
         {
             new_state = Closed;
         }
-        else if (time_now - last_state_time > close_time * 1ms)
+        else if (limit_reached)
         {
-            Log::Warning("Door(" + to_string(index) + "): closing timed out");
+            // reversed, by the opener or by hand
             new_state = Open;
         }
+        break;
     }
 
-    if (new_state != current_state)
-    {
-        SetState(new_state);
+    // with a deadline scheduler timeouts fire on their own, without one
+    // they are noticed on the next sample
+    if (new_state == current_state && !deadline_scheduler)
+        new_state = TimeoutState(time_now, fault_kind);
+
+    if (Transition(new_state, time_now, fault_kind))
         return true;
+    // a close waiting for the way to clear
+    return obstruction_cleared && RunIntent(time_now);
+}
+
+bool Door::HandleDeadline()
+{
+    int fault_kind = -1;
+    auto time_now = GpioBackend::Get().Now();
+    // either a level that is stable now or a state timeout
+    bank->Refresh(slot, time_now);
+    if (Evaluate(time_now))
+        return true;
+    return Transition(TimeoutState(time_now, fault_kind), time_now, fault_kind);
+}
+
+bool Door::CheckHealth()
+{
+    uint32_t changes, glitches;
+    bank->TakeCounts(slot, changes, glitches);
+    if (!health.AddCounts(changes, glitches))
+        return false;
+    HealthChanged(GpioBackend::Get().Now());
+    return true;
+}
+
+void Door::HealthChanged(chrono::steady_clock::time_point time_now)
+{
+    auto status = health.GetStatus();
+    fault = status != SensorHealth::Ok;
+    // a faulty sensor must not hold every door in fast polling, the slow
+    // samples still show when it has calmed down
+    bank->SetQuarantine(slot, fault);
+    if (fault)
+    {
+        auto type = status == SensorHealth::Chatter ? FlightRecorder::FaultChatter : FlightRecorder::FaultStuck;
+        Log::Warning("Door(", index, "): sensor fault: ", SensorHealth::StatusStr(status), ", ",
+                     health.GetChanges(), " changes and ", health.GetGlitches(), " glitches in the window");
+        (status == SensorHealth::Chatter ? chatter_faults : stuck_faults)->Add();
+        recorder.Record(time_now, FlightRecorder::Fault, type);
+        if (on_fault)
+            on_fault(*this, type);
+    }
+    else
+    {
+        Log::Message("Door(", index, "): sensor healthy again");
+    }
+    if (on_health)
+        on_health(*this);
+}
+
+Door::State Door::TimeoutState(chrono::steady_clock::time_point time_now, int& fault_kind) const
+{
+    auto last_state_time = bank->GetStateTime(slot);
+    switch (GetState())
+    {
+    case OpenStart:
+        if (time_now - last_state_time >= open_start_time * 1ms)
+        {
+            fault_kind = FlightRecorder::FaultOpenTimeout;
+            return Closed;
+        }
+        break;
+    case Opening:
+    case OpeningSensed:
+        if (time_now - last_state_time >= open_time * 1ms)
+        {
+            // the limit sensor should have seen it by now
+            if (gpio_open_sensor >= 0)
+                fault_kind = FlightRecorder::FaultOpenTimeout;
+            return Open;
+        }
+        break;
+    case Closing:
+        if (time_now - last_state_time >= close_time * 1ms)
+        {
+            fault_kind = FlightRecorder::FaultCloseTimeout;
+            return Open;
+        }
+        break;
+    }
+    return GetState();
+}
+
+bool Door::Transition(State new_state, chrono::steady_clock::time_point time_now, int fault_kind)
+{
+    if (new_state == GetState())
+        return false;
+
+    if (fault_kind == FlightRecorder::FaultOpenTimeout && new_state == Open)
+        Log::Warning("Door(" + to_string(index) + "): open limit not reached in time");
+    else if (fault_kind == FlightRecorder::FaultOpenTimeout)
+        Log::Warning("Door(" + to_string(index) + "): opening timed out");
+    else if (fault_kind == FlightRecorder::FaultCloseTimeout)
+        Log::Warning("Door(" + to_string(index) + "): closing timed out");
+
+    SetState(new_state, time_now);
+    if (fault_kind >= 0)
+    {
+        recorder.Record(time_now, FlightRecorder::Fault, fault_kind);
+        if (on_fault)
+            on_fault(*this, (FlightRecorder::FaultType)fault_kind);
+        // the door was told to move and the sensors didn't follow
+        if ((fault_kind == FlightRecorder::FaultOpenTimeout || fault_kind == FlightRecorder::FaultCloseTimeout) &&
+            health.CommandTimedOut())
+            HealthChanged(time_now);
+    }
+    RunIntent(time_now);
+    return true;
+}
+
+void Door::SetState(State new_state, chrono::steady_clock::time_point time_now)
+{
+    Log::Message("Door(" + to_string(index) + "): state changed " + StateStr(GetState()) + " -> " + StateStr(new_state));
+    recorder.Record(time_now, FlightRecorder::StateChange, GetState(), new_state);
+
+    // travel times measured from entering the previous state
+    State old_state = GetState();
+    auto in_state = chrono::duration_cast<chrono::milliseconds>(time_now - bank->GetStateTime(slot)).count();
+    auto late = chrono::duration_cast<chrono::milliseconds>(time_now - late_since).count();
+    if (history)
+        history->Append(old_state, new_state, in_state);
+    if (old_state == OpenStart && new_state == Opening)
+    {
+        open_start_hist->Add(in_state);
+        Learn(TravelOpenStart, in_state);
+    }
+    else if ((old_state == Opening || old_state == OpeningSensed) && new_state == Open &&
+             bank->StableTrue(slot, DoorBank::ChOpenLimit))
+    {
+        open_travel_hist->Add(in_state);
+        Learn(TravelOpen, in_state);
+    }
+    else if (old_state == Closing && new_state == Closed)
+    {
+        close_travel_hist->Add(in_state);
+        Learn(TravelClose, in_state);
+    }
+    else if (late_travel == TravelOpenStart && old_state == Closed && new_state == OpeningSensed &&
+             late <= cfg_open_start_time * cal_max_factor)
+    {
+        Learn(TravelOpenStart, late);
+    }
+    else if (late_travel == TravelClose && old_state == Open && new_state == Closed &&
+             late <= cfg_close_time * cal_max_factor)
+    {
+        Learn(TravelClose, late);
+    }
+
+    // the closed sensor changed level, so it isn't stuck
+    bool sensed = new_state == Opening || new_state == OpeningSensed ||
+        (new_state == Closed && old_state != OpenStart && old_state != InitSensing);
+    if (sensed && health.SensorMoved())
+        HealthChanged(time_now);
+
+    // a command that timed out but completes soon after is exactly the
+    // slow door the timeout has to learn about
+    late_travel = -1;
+    if ((old_state == OpenStart && new_state == Closed) || (old_state == Closing && new_state == Open))
+    {
+        late_travel = old_state == OpenStart ? TravelOpenStart : TravelClose;
+        late_since = bank->GetStateTime(slot);
+    }
+
+    bank->SetState(slot, new_state, time_now);
+
+    if (deadline_scheduler)
+    {
+        int timeout = -1;
+        switch (new_state)
+        {
+        case OpenStart:
+            timeout = open_start_time;
+            break;
+        case Opening:
+        case OpeningSensed:
+            timeout = open_time;
+            break;
+        case Closing:
+            timeout = close_time;
+            break;
+        }
+        if (timeout >= 0)
+            deadline_scheduler->Arm(deadline, time_now + timeout * 1ms);
+        else
+            deadline_scheduler->Cancel(deadline);
+    }
+}
+
+const char *Door::ResultStr(CommandResult result)
+{
+    switch (result)
+    {
+    case ResultDone:
+        return "done";
+    case ResultSatisfied:
+        return "satisfied";
+    case ResultQueued:
+        return "queued";
+    case ResultSuperseded:
+        return "superseded";
+    case ResultExpired:
+        return "expired";
+    case ResultRejected:
+        return "rejected";
+    }
+    return "unknown";
+}
+
+// the door is already where the command would take it, or on its way
+bool Door::IntentSatisfied(FlightRecorder::CommandType cmd) const
+{
+    State state = GetState();
+    if (cmd == FlightRecorder::CmdOpen)
+        return state == Open || state == OpenStart || state == Opening || state == OpeningSensed;
+    return state == Closed || state == Closing;
+}
+
+bool Door::IntentRunnable(FlightRecorder::CommandType cmd) const
+{
+    if (cmd == FlightRecorder::CmdClose && GetObstructed())
+        return false;
+    return GetState() == (cmd == FlightRecorder::CmdOpen ? Closed : Open);
+}
+
+void Door::Request(FlightRecorder::CommandType cmd)
+{
+    auto time_now = GpioBackend::Get().Now();
+    int waited = chrono::duration_cast<chrono::milliseconds>(time_now - intent_since).count();
+
+    if (IntentSatisfied(cmd) || IntentRunnable(cmd) || intent_expiry <= 0)
+    {
+        // whatever was waiting is overtaken by this one
+        if (intent >= 0 && intent != cmd)
+            Report((FlightRecorder::CommandType)intent, ResultSuperseded, waited);
+        ClearIntent();
+        if (IntentSatisfied(cmd))
+        {
+            recorder.Record(time_now, FlightRecorder::Command, cmd, 1);
+            commands_accepted->Add();
+            Report(cmd, ResultSatisfied, 0);
+            return;
+        }
+        bool done = cmd == FlightRecorder::CmdOpen ? DoOpen(time_now) : DoClose(time_now);
+        Report(cmd, done ? ResultDone : ResultRejected, 0);
+        return;
+    }
+
+    if (intent == cmd)
+    {
+        // a repeat only pushes the expiry out
+        Log::Message("Door(", index, "): ", cmd == FlightRecorder::CmdOpen ? "open" : "close", " already queued");
+    }
+    else
+    {
+        if (intent >= 0)
+            Report((FlightRecorder::CommandType)intent, ResultSuperseded, waited);
+        intent = cmd;
+        intent_since = time_now;
+        Log::Message("Door(", index, "): queued ", cmd == FlightRecorder::CmdOpen ? "open" : "close",
+                     " in ", StateStr(GetState()), " state");
+    }
+    intent_expires = time_now + intent_expiry * 1ms;
+    if (deadline_scheduler)
+        deadline_scheduler->Arm(intent_timer, intent_expires);
+    recorder.Record(time_now, FlightRecorder::Command, cmd, 2);
+    commands_queued->Add();
+    Report(cmd, ResultQueued, 0);
+}
+
+// after every transition, the new state may be the one an intent waits
+// for; true if the door was set moving
+bool Door::RunIntent(chrono::steady_clock::time_point time_now)
+{
+    if (intent < 0)
+        return false;
+
+    auto cmd = (FlightRecorder::CommandType)intent;
+    int waited = chrono::duration_cast<chrono::milliseconds>(time_now - intent_since).count();
+    if (IntentSatisfied(cmd))
+    {
+        ClearIntent();
+        Report(cmd, ResultSatisfied, waited);
+    }
+    else if (IntentRunnable(cmd))
+    {
+        ClearIntent();
+        Log::Message("Door(", index, "): running queued ", cmd == FlightRecorder::CmdOpen ? "open" : "close",
+                     " after ", waited, " ms");
+        intent_wait_hist->Add(waited);
+        bool done = cmd == FlightRecorder::CmdOpen ? DoOpen(time_now) : DoClose(time_now);
+        Report(cmd, done ? ResultDone : ResultRejected, waited);
+        return done;
     }
     return false;
 }
 
-void Door::SetState(State new_state)
+void Door::ExpireIntent(chrono::steady_clock::time_point time_now)
 {
-    Log::Message("Door(" + to_string(index) + "): state changed " + StateStr(current_state) + " -> " + StateStr(new_state));
-    current_state = new_state;
-    last_state_time = chrono::steady_clock::now();
+    if (intent < 0)
+        return;
+
+    auto cmd = (FlightRecorder::CommandType)intent;
+    int waited = chrono::duration_cast<chrono::milliseconds>(time_now - intent_since).count();
+    Log::Warning("Door(", index, "): queued ", cmd == FlightRecorder::CmdOpen ? "open" : "close",
+                 " expired in ", StateStr(GetState()), " state");
+    ClearIntent();
+    recorder.Record(time_now, FlightRecorder::Command, cmd, 3);
+    commands_expired->Add();
+    Report(cmd, ResultExpired, waited);
 }
 
-bool Door::DoOpen()
+void Door::ClearIntent()
 {
-    switch (current_state)
+    intent = -1;
+    if (deadline_scheduler)
+        deadline_scheduler->Cancel(intent_timer);
+}
+
+void Door::Report(FlightRecorder::CommandType cmd, CommandResult result, int waited_ms)
+{
+    if (on_result)
+        on_result(*this, cmd, result, waited_ms);
+}
+
+bool Door::DoOpen(chrono::steady_clock::time_point time_now)
+{
+    switch (GetState())
     {
     case Closed:
-        SendOpen();
-        SetState(OpenStart);
-        last_state_time = chrono::steady_clock::now();
+        recorder.Record(time_now, FlightRecorder::Command, FlightRecorder::CmdOpen, 1);
+        commands_accepted->Add();
+        SendOpen(time_now);
+        SetState(OpenStart, time_now);
         return true;
     }
-    Log::Error("Door(" + to_string(index) + "): can't open in " + StateStr(current_state) + " state");
+    recorder.Record(time_now, FlightRecorder::Command, FlightRecorder::CmdOpen, 0);
+    commands_rejected->Add();
+    Log::Error("Door(" + to_string(index) + "): can't open in " + StateStr(GetState()) + " state");
     return false;
 }
 
-bool Door::DoClose()
+bool Door::DoClose(chrono::steady_clock::time_point time_now)
 {
-    switch (current_state)
+    if (GetObstructed())
+    {
+        recorder.Record(time_now, FlightRecorder::Command, FlightRecorder::CmdClose, 0);
+        commands_rejected->Add();
+        Log::Error("Door(" + to_string(index) + "): can't close, obstructed");
+        return false;
+    }
+    switch (GetState())
     {
     case Open:
-        SendClose();
-        SetState(Closing);
-        last_state_time = chrono::steady_clock::now();
+        recorder.Record(time_now, FlightRecorder::Command, FlightRecorder::CmdClose, 1);
+        commands_accepted->Add();
+        SendClose(time_now);
+        SetState(Closing, time_now);
         return true;
     }
-    Log::Error("Door(" + to_string(index) + "): can't close in " + StateStr(current_state) + " state");
+    recorder.Record(time_now, FlightRecorder::Command, FlightRecorder::CmdClose, 0);
+    commands_rejected->Add();
+    Log::Error("Door(" + to_string(index) + "): can't close in " + StateStr(GetState()) + " state");
     return false;
 }
 
-void Door::SendOpen()
+void Door::SendOpen(chrono::steady_clock::time_point time_now)
 {
-    if (gpio_open_btn)
+    if (gpio_open_btn >= 0)
     {
-        gpio_open_btn.release();
-        gpiod::line_request req;
-        req.consumer = "door:" + to_string(index) + ".open";
-        req.request_type = gpiod::line_request::DIRECTION_OUTPUT;
-        req.flags = 0;
-        gpio_open_btn.request(req);
-        gpio_open_btn.set_value(gpio_open_level ? 1 : 0);
-        usleep(btn_pulse_time * 1000);
-        gpio_open_btn.set_value(gpio_open_level ? 0 : 1);
+        recorder.Record(time_now, FlightRecorder::Pulse, FlightRecorder::CmdOpen, 0, btn_pulse_time);
+        if (pulse_scheduler)
+            pulse_scheduler->Pulse(gpio_open_btn, gpio_open_level, btn_pulse_time, "door:" + to_string(index) + ".open");
+        else
+            Log::Error("Door(" + to_string(index) + "): no pulse scheduler");
     }
-    
 }
 
-void Door::SendClose()
+void Door::SendClose(chrono::steady_clock::time_point time_now)
 {
-    if (gpio_close_btn)
+    if (gpio_close_btn >= 0)
     {
-        gpio_close_btn.release();
-        gpiod::line_request req;
-        req.consumer = "door:" + to_string(index) + ".close";
-        req.request_type = gpiod::line_request::DIRECTION_OUTPUT;
-        req.flags = 0;
-        gpio_close_btn.request(req);
-        gpio_close_btn.set_value(gpio_close_level ? 1 : 0);
-        usleep(btn_pulse_time * 1000);
-        gpio_close_btn.set_value(gpio_close_level ? 0 : 1);
+        recorder.Record(time_now, FlightRecorder::Pulse, FlightRecorder::CmdClose, 0, btn_pulse_time);
+        if (pulse_scheduler)
+            pulse_scheduler->Pulse(gpio_close_btn, gpio_close_level, btn_pulse_time, "door:" + to_string(index) + ".close");
+        else
+            Log::Error("Door(" + to_string(index) + "): no pulse scheduler");
     } else
     {
-        SendOpen();
+        SendOpen(time_now);
     }
 }
 
 bool Door::NeedFastPoll() const
 {
-    switch (current_state)
-    {
-    case InitSensing:
-    case Opening:
-    case OpeningSensed:
-    case OpenStart:
-    case Closing:
-        return true;
-    }
-
-    if (((closed_debounce_input & 0xFF) == 0) || ((closed_debounce_input & 0xFF) == 0xFF))
-        return false;
-
-    return true;
+    return bank->NeedFastPoll(slot);
 }
@@ -3,10 +3,21 @@
 
 #include <chrono>
 #include <string>
-#include <gpiod.hpp>
+#include <functional>
+#include <array>
+#include <memory>
+#include "FlightRecorder.hh"
+#include "DeadlineScheduler.hh"
+#include "DoorBank.hh"
+#include "Metrics.hh"
+#include "TravelEstimator.hh"
+#include "EventHistory.hh"
+#include "SensorHealth.hh"
 
 namespace dooragent
 {
+    class PulseScheduler;
+
     class Door
     {
     public:
@@ -21,44 +32,159 @@ namespace dooragent
             Closing
         };
 
-        Door(int index);
+        enum Travel
+        {
+            TravelOpenStart,
+            TravelOpen,
+            TravelClose
+        };
+
+        // what became of a command, reported through the result handler
+        enum CommandResult
+        {
+            ResultDone,
+            ResultSatisfied,
+            ResultQueued,
+            ResultSuperseded,
+            ResultExpired,
+            ResultRejected
+        };
+
+        using fault_handler = std::function<void(Door&, FlightRecorder::FaultType)>;
+        using result_handler = std::function<void(Door&, FlightRecorder::CommandType, CommandResult, int waited_ms)>;
+        using health_handler = std::function<void(Door&)>;
 
-        bool SetClosedSensor(std::string chip, int line, bool level);
+        Door(int index, DoorBank& bank);
+
+        bool SetClosedSensor(std::string chip, int line, bool level, bool events = false);
         bool SetOpenBtn(std::string chip, int line, bool level);
         bool SetCloseBtn(std::string chip, int line, bool level);
+        // a reload that drops a button gives its line back
+        void ClearOpenBtn();
+        void ClearCloseBtn();
+        // optional, both polled; the open limit is active when the door is
+        // fully open, the obstruction input while something blocks it
+        bool SetOpenSensor(std::string chip, int line, bool level);
+        bool SetObstructionSensor(std::string chip, int line, bool level);
         void SetOpenTime(int t);
         void SetCloseTime(int t);
         void SetOpenStartTime(int t);
+        void SetPulseTime(int t);
+        void SetDebounce(int debounce_ms, int stable_ms, int glitch_ms, DoorBank::Channel ch = DoorBank::ChClosed);
+        void SetCalibration(bool enabled, double min_factor, double max_factor);
+        void SetPulseScheduler(PulseScheduler *scheduler);
+        void SetFaultHandler(fault_handler handler);
+        void SetResultHandler(result_handler handler);
+        void SetIntentExpiry(int t);
+        void SetHealthHandler(health_handler handler);
+        void SetHealthLimits(int chatter_changes, int stuck_after);
+        void SetDeadlineScheduler(DeadlineScheduler *scheduler, std::function<void()> on_deadline);
+        void SetHistory(std::unique_ptr<EventHistory> new_history);
+        // gives up the slot, timers and lines before the door is dropped
+        void Release();
 
         int GetIndex() const { return index; }
-        State GetState() const { return current_state; }
+        State GetState() const { return (State)bank->GetState(slot); }
+        size_t GetSlot() const { return slot; }
+        // a sensor fault, the door is kept out of fast polling meanwhile
         bool GetFault() const { return fault; }
+        const SensorHealth& GetHealth() const { return health; }
+        bool GetObstructed() const { return gpio_obstruction >= 0 && bank->StableTrue(slot, DoorBank::ChObstruction); }
+        // inputs that have to be polled even when the closed sensor has events
+        bool HasPolledInputs() const { return gpio_open_sensor >= 0 || gpio_obstruction >= 0; }
+        FlightRecorder& GetRecorder() { return recorder; }
+        EventHistory *GetHistory() { return history.get(); }
+        TravelEstimator& GetEstimator(Travel travel) { return estimators[travel]; }
+        bool TakeCalibrationDirty()
+            {
+                bool dirty = calibration_dirty;
+                calibration_dirty = false;
+                return dirty;
+            }
+        void UpdateTimeouts();
 
         bool UpdateState();
+        void Sample(std::chrono::steady_clock::time_point time_now);
+        bool Evaluate(std::chrono::steady_clock::time_point time_now);
+        bool HandleSensorEvent();
+        bool HandleDeadline();
+        // once per health interval, true if the health status changed
+        bool CheckHealth();
+        int GetSensorFd() const;
+        int GetSensorInput() const { return gpio_closed_sensor; }
 
-        bool DoOpen();
-        bool DoClose();
+        // runs the command now if the state allows it, otherwise keeps it
+        // as the door's intent until it can run or expires
+        void Request(FlightRecorder::CommandType cmd);
+        bool DoOpen(std::chrono::steady_clock::time_point time_now);
+        bool DoClose(std::chrono::steady_clock::time_point time_now);
 
         bool NeedFastPoll() const;
 
         static std::string StateStr(State state);
+        static const char *ResultStr(CommandResult result);
 
     protected:
         int index;
-        State current_state;
+        DoorBank *bank;
+        size_t slot;
         bool closed;
         bool fault;
-        unsigned int closed_debounce_input;
 
-        void SetState(State new_state);
+        int ReadInput(int input, bool level) const;
+        bool ProcessSample(int closed_value, std::chrono::steady_clock::time_point time_now);
+        State TimeoutState(std::chrono::steady_clock::time_point time_now, int& fault_kind) const;
+        bool Transition(State new_state, std::chrono::steady_clock::time_point time_now, int fault_kind);
+        void SetState(State new_state, std::chrono::steady_clock::time_point time_now);
+
+        void ReleaseBtn(int output, bool level);
+        void SendOpen(std::chrono::steady_clock::time_point time_now);
+        void SendClose(std::chrono::steady_clock::time_point time_now);
+        void Learn(Travel travel, int ms);
+
+        bool IntentSatisfied(FlightRecorder::CommandType cmd) const;
+        bool IntentRunnable(FlightRecorder::CommandType cmd) const;
+        bool RunIntent(std::chrono::steady_clock::time_point time_now);
+        void ExpireIntent(std::chrono::steady_clock::time_point time_now);
+        void ClearIntent();
+        void Report(FlightRecorder::CommandType cmd, CommandResult result, int waited_ms);
+        void HealthChanged(std::chrono::steady_clock::time_point time_now);
 
-        void SendOpen();
-        void SendClose();
+        PulseScheduler *pulse_scheduler;
+        FlightRecorder recorder;
+        std::unique_ptr<EventHistory> history;
+        fault_handler on_fault;
+        result_handler on_result;
+        health_handler on_health;
+        SensorHealth health;
+        DeadlineScheduler *deadline_scheduler;
+        DeadlineScheduler::Timer deadline, settle, intent_timer;
 
-        gpiod::line gpio_closed_sensor, gpio_open_btn, gpio_close_btn;
+        Metrics::Counter *commands_accepted, *commands_rejected, *commands_queued, *commands_expired;
+        Metrics::Counter *chatter_faults, *stuck_faults;
+        Histogram *open_start_hist, *open_travel_hist, *close_travel_hist, *intent_wait_hist;
+
+        // at most one waiting command, the latest one wins
+        int intent;
+        int intent_expiry;
+        std::chrono::steady_clock::time_point intent_since, intent_expires;
+
+        int gpio_closed_sensor, gpio_open_btn, gpio_close_btn;
         bool gpio_closed_level, gpio_open_level, gpio_close_level;
+        int gpio_open_sensor, gpio_obstruction;
+        bool gpio_open_sensor_level, gpio_obstruction_level;
+        // stable levels at the last evaluation, for edges
+        bool last_open_limit, last_obstruction;
         int btn_pulse_time, open_time, close_time, open_start_time;
-        std::chrono::steady_clock::time_point last_state_time;
+
+        // configured timeouts, the learned ones stay within factors of them
+        std::array<TravelEstimator, 3> estimators;
+        bool calibrate, calibration_dirty;
+        double cal_min_factor, cal_max_factor;
+        int cfg_open_time, cfg_close_time, cfg_open_start_time;
+        // a command that timed out, the door may still complete it late
+        int late_travel;
+        std::chrono::steady_clock::time_point late_since;
     };
 };
 
@@ -0,0 +1,265 @@
+#include "DoorBank.hh"
+#include <algorithm>
+#include <cstring>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    // GCC vector extensions, lowered to NEON or SSE/AVX depending on the
+    // target and to scalar code where neither is available
+    typedef uint32_t vec_u32 __attribute__((vector_size(DoorBank::lanes * sizeof(uint32_t))));
+
+    inline vec_u32 load(const uint32_t *p)
+    {
+        vec_u32 v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    inline void store(uint32_t *p, vec_u32 v)
+    {
+        memcpy(p, &v, sizeof(v));
+    }
+
+    inline vec_u32 splat(uint32_t x)
+    {
+        vec_u32 v;
+        for (size_t i = 0; i < DoorBank::lanes; i++)
+            v[i] = x;
+        return v;
+    }
+
+    inline vec_u32 select(vec_u32 mask, vec_u32 a, vec_u32 b)
+    {
+        return (mask & a) | (~mask & b);
+    }
+
+    // one debounce step for a vector of slots, same as FilterOne; returns
+    // the new stable levels
+    inline vec_u32 filter_step(uint32_t *samples, uint32_t *level, uint32_t *stable, uint32_t *since,
+                               uint32_t *prev_since, const uint32_t *window, const uint32_t *glitch,
+                               uint32_t *changes, uint32_t *glitches, vec_u32 now_v)
+    {
+        vec_u32 s = load(samples);
+        vec_u32 lvl = load(level);
+        vec_u32 start = load(since);
+        vec_u32 prev = load(prev_since);
+        vec_u32 change = s != lvl;
+        vec_u32 is_glitch = change & ((now_v - start) < load(glitch));
+        vec_u32 fresh = change & ~is_glitch;
+        // true lanes are all ones, subtracting counts them
+        store(changes, load(changes) - change);
+        store(glitches, load(glitches) - is_glitch);
+        store(prev_since, select(fresh, start, prev));
+        start = select(is_glitch, prev, select(fresh, now_v, start));
+        store(since, start);
+        store(level, s);
+
+        vec_u32 st = select((now_v - start) >= load(window), s, load(stable));
+        store(stable, st);
+        return st;
+    }
+};
+
+uint32_t DoorBank::init_mask = 0;
+uint32_t DoorBank::moving_mask = 0;
+uint32_t DoorBank::react_true_mask = 0;
+uint32_t DoorBank::react_false_mask = 0;
+
+void DoorBank::SetStateMasks(uint32_t init, uint32_t moving, uint32_t react_true, uint32_t react_false)
+{
+    init_mask = init;
+    moving_mask = moving;
+    react_true_mask = react_true;
+    react_false_mask = react_false;
+}
+
+size_t DoorBank::Add(uint32_t initial_state)
+{
+    size_t slot;
+    if (!free_slots.empty())
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    else
+    {
+        slot = count++;
+    }
+
+    // keep the arrays padded to whole vectors, padding lanes stay idle
+    size_t padded = (count + lanes - 1) / lanes * lanes;
+    if (padded > state.size())
+    {
+        for (auto& f: filters)
+        {
+            f.samples.resize(padded, 0);
+            f.level.resize(padded, 0);
+            f.stable.resize(padded, 0);
+            f.since.resize(padded, 0);
+            f.prev_since.resize(padded, 0);
+            f.window.resize(padded, 0);
+            f.glitch.resize(padded, 0);
+        }
+        state.resize(padded, 0);
+        moving_poll.resize(padded, 0);
+        used.resize(padded, 0);
+        quarantine.resize(padded, 0);
+        changes.resize(padded, 0);
+        glitches.resize(padded, 0);
+        state_time.resize(padded);
+        active.resize((padded + 63) / 64, 0);
+        changed.resize((padded + 63) / 64, 0);
+    }
+
+    for (auto& f: filters)
+    {
+        f.samples[slot] = 0;
+        f.level[slot] = 0;
+        f.stable[slot] = 0;
+        f.since[slot] = 0;
+        f.prev_since[slot] = 0;
+        f.window[slot] = 50;
+        f.glitch[slot] = 10;
+    }
+    // neither level is known yet, the first sample counts as a change and
+    // has to hold for the window like any other
+    EnableChannel(slot, ChClosed);
+    state[slot] = initial_state;
+    moving_poll[slot] = 0;
+    used[slot] = 1;
+    quarantine[slot] = 0;
+    changes[slot] = glitches[slot] = 0;
+    state_time[slot] = chrono::steady_clock::now();
+    return slot;
+}
+
+void DoorBank::Remove(size_t slot)
+{
+    // an unused slot is settled and idle, the vector code masks it off
+    // like a padding lane
+    used[slot] = 0;
+    for (auto& f: filters)
+    {
+        f.samples[slot] = 0;
+        f.level[slot] = 0;
+        f.stable[slot] = 0;
+    }
+    state[slot] = 0;
+    moving_poll[slot] = 0;
+    quarantine[slot] = 0;
+    free_slots.push_back(slot);
+}
+
+uint32_t DoorBank::FilterOne(size_t slot, int value, time_point time_now, Channel ch)
+{
+    auto& f = filters[ch];
+    uint32_t now = Ms(time_now);
+    uint32_t sample = value & 1;
+    if (sample != f.level[slot])
+    {
+        changes[slot]++;
+        if (now - f.since[slot] < f.glitch[slot])
+        {
+            glitches[slot]++;
+            f.since[slot] = f.prev_since[slot];
+        }
+        else
+        {
+            f.prev_since[slot] = f.since[slot];
+            f.since[slot] = now;
+        }
+        f.level[slot] = sample;
+    }
+    if (now - f.since[slot] >= f.window[slot])
+        f.stable[slot] = f.level[slot];
+    return now - f.since[slot];
+}
+
+void DoorBank::Filter(uint32_t now)
+{
+    vec_u32 react_true = splat(react_true_mask);
+    vec_u32 react_false = splat(react_false_mask);
+    vec_u32 moving = splat(moving_mask);
+    vec_u32 one = splat(1);
+    vec_u32 now_v = splat(now);
+
+    fill(active.begin(), active.end(), 0);
+
+    for (size_t base = 0; base < count; base += lanes)
+    {
+        auto& fc = filters[ChClosed];
+        vec_u32 st = filter_step(&fc.samples[base], &fc.level[base], &fc.stable[base], &fc.since[base],
+                                 &fc.prev_since[base], &fc.window[base], &fc.glitch[base],
+                                 &changes[base], &glitches[base], now_v);
+
+        vec_u32 stable_true = st == 1;
+        vec_u32 stable_false = st == 0;
+        vec_u32 bit = one << load(&state[base]);
+        vec_u32 act = (stable_true & ((bit & react_true) != 0)) | (stable_false & ((bit & react_false) != 0));
+        // moving doors that are polled also check their timeouts, which
+        // matters when there is no deadline scheduler (offline runs)
+        act |= ((bit & moving) != 0) & (load(&moving_poll[base]) != 0);
+
+        for (size_t ch = ChOpenLimit; ch < ChannelCount; ch++)
+        {
+            auto& f = filters[ch];
+            vec_u32 old_st = load(&f.stable[base]);
+            act |= filter_step(&f.samples[base], &f.level[base], &f.stable[base], &f.since[base],
+                               &f.prev_since[base], &f.window[base], &f.glitch[base],
+                               &changes[base], &glitches[base], now_v) != old_st;
+        }
+        // padding lanes and removed doors
+        act &= load(&used[base]) != 0;
+
+        uint64_t bits = 0;
+        for (size_t i = 0; i < lanes; i++)
+            bits |= uint64_t(act[i] & 1) << i;
+        active[base / 64] |= bits << (base % 64);
+    }
+}
+
+// polling is needed for initial sensing, moving without event support, or
+// a level that isn't stable yet; never for a quarantined slot
+bool DoorBank::NeedFastPoll(size_t slot) const
+{
+    if (quarantine[slot])
+        return false;
+    uint32_t bit = 1u << state[slot];
+    if (bit & init_mask)
+        return true;
+    if ((bit & moving_mask) && moving_poll[slot])
+        return true;
+    for (size_t ch = 0; ch < ChannelCount; ch++)
+    {
+        if (!Settled(slot, (Channel)ch))
+            return true;
+    }
+    return false;
+}
+
+bool DoorBank::AnyFastPoll() const
+{
+    vec_u32 init = splat(init_mask);
+    vec_u32 moving = splat(moving_mask);
+    vec_u32 one = splat(1);
+    vec_u32 any = splat(0);
+
+    for (size_t base = 0; base < count; base += lanes)
+    {
+        vec_u32 bit = one << load(&state[base]);
+        vec_u32 need = ((bit & init) != 0) | (((bit & moving) != 0) & (load(&moving_poll[base]) != 0));
+        for (auto& f: filters)
+            need |= load(&f.level[base]) != load(&f.stable[base]);
+        any |= need & (load(&used[base]) != 0) & (load(&quarantine[base]) == 0);
+    }
+
+    for (size_t i = 0; i < lanes; i++)
+    {
+        if (any[i])
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,159 @@
+#ifndef _DOORBANK_HH
+#define _DOORBANK_HH
+
+#include <vector>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace dooragent
+{
+    // Hot per-door state kept in contiguous arrays, one slot per door. The
+    // debounce filter and the fast-poll checks run over all slots at once
+    // with vector code; the state machine only runs for the slots where
+    // the debounced level could cause a transition.
+    //
+    // Debouncing is by time: a level becomes the stable one after it has
+    // held for the slot's stable window. A change that reverts within the
+    // glitch width is dropped, the level before it keeps its start time.
+    // Times are wrapping 32 bit milliseconds, only differences matter.
+    //
+    // Each slot has a filter channel per door input. The closed sensor
+    // drives the state masks; a change in the stable level of one of the
+    // other inputs always runs the state machine. Channels a door doesn't
+    // use sit at a settled 0 and never change.
+    //
+    // Raw level changes and dropped glitches are counted per slot for the
+    // sensor health checks. A quarantined slot never asks for fast polling.
+    class DoorBank
+    {
+    public:
+        using bitmask = std::vector<uint64_t>;
+        using time_point = std::chrono::steady_clock::time_point;
+
+        enum Channel : size_t
+        {
+            ChClosed,
+            ChOpenLimit,
+            ChObstruction,
+            ChannelCount
+        };
+
+        static constexpr size_t lanes = 4;
+
+        // slots of removed doors are handed out again, Size() is the
+        // highest slot in use so far
+        size_t Add(uint32_t initial_state);
+        void Remove(size_t slot);
+        size_t Size() const { return count; }
+        // the closed channel is always in use
+        void EnableChannel(size_t slot, Channel ch)
+            {
+                filters[ch].level[slot] = 2;
+                filters[ch].stable[slot] = 2;
+            }
+
+        uint32_t GetState(size_t slot) const { return state[slot]; }
+        void SetState(size_t slot, uint32_t new_state, time_point time_now)
+            {
+                state[slot] = new_state;
+                state_time[slot] = time_now;
+            }
+        time_point GetStateTime(size_t slot) const { return state_time[slot]; }
+
+        static uint32_t Ms(time_point time)
+            {
+                return std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+            }
+
+        void SetDebounce(size_t slot, uint32_t stable_ms, uint32_t glitch_ms, Channel ch = ChClosed)
+            {
+                filters[ch].window[slot] = stable_ms;
+                filters[ch].glitch[slot] = glitch_ms;
+            }
+        bool StableTrue(size_t slot, Channel ch = ChClosed) const { return filters[ch].stable[slot] == 1; }
+        bool StableFalse(size_t slot, Channel ch = ChClosed) const { return filters[ch].stable[slot] == 0; }
+        bool Settled(size_t slot, Channel ch = ChClosed) const { return filters[ch].stable[slot] == filters[ch].level[slot]; }
+        // how long the current raw level has held, and when it will be stable
+        uint32_t GetHeld(size_t slot, time_point time_now, Channel ch = ChClosed) const
+            {
+                return Ms(time_now) - filters[ch].since[slot];
+            }
+        time_point GetSettleTime(size_t slot, time_point time_now, Channel ch = ChClosed) const
+            {
+                return time_now + std::chrono::milliseconds(filters[ch].window[slot]) -
+                    std::chrono::milliseconds(GetHeld(slot, time_now, ch));
+            }
+
+        void SetSample(size_t slot, int value, Channel ch = ChClosed) { filters[ch].samples[slot] = value & 1; }
+        uint32_t FilterOne(size_t slot, int value, time_point time_now, Channel ch = ChClosed);
+        // re-check the current levels against the window without a new sample
+        void Refresh(size_t slot, time_point time_now)
+            {
+                for (size_t ch = 0; ch < ChannelCount; ch++)
+                {
+                    if (filters[ch].level[slot] <= 1)
+                        FilterOne(slot, filters[ch].level[slot], time_now, (Channel)ch);
+                }
+            }
+        void SetMovingPoll(size_t slot, bool poll) { moving_poll[slot] = poll ? 1 : 0; }
+        void SetQuarantine(size_t slot, bool q) { quarantine[slot] = q ? 1 : 0; }
+        bool GetQuarantine(size_t slot) const { return quarantine[slot] != 0; }
+        // counts since the last call, over all channels
+        void TakeCounts(size_t slot, uint32_t& slot_changes, uint32_t& slot_glitches)
+            {
+                slot_changes = changes[slot];
+                slot_glitches = glitches[slot];
+                changes[slot] = glitches[slot] = 0;
+            }
+
+        // Runs the pending samples of every slot through their debounce
+        // filters and calls evaluate(slot) for the slots with a relevant
+        // debounced level. Returns the slots where evaluate reported a
+        // state change.
+        template<typename F>
+        const bitmask& Update(time_point time_now, F&& evaluate)
+            {
+                Filter(Ms(time_now));
+                std::fill(changed.begin(), changed.end(), 0);
+                for (size_t word = 0; word < active.size(); word++)
+                {
+                    uint64_t bits = active[word];
+                    while (bits != 0)
+                    {
+                        size_t slot = word * 64 + __builtin_ctzll(bits);
+                        bits &= bits - 1;
+                        if (evaluate(slot))
+                            changed[word] |= uint64_t{1} << (slot % 64);
+                    }
+                }
+                return changed;
+            }
+
+        bool NeedFastPoll(size_t slot) const;
+        bool AnyFastPoll() const;
+
+        static void SetStateMasks(uint32_t init, uint32_t moving, uint32_t react_true, uint32_t react_false);
+
+    protected:
+        struct filter
+        {
+            std::vector<uint32_t> samples, level, stable, since, prev_since, window, glitch;
+        };
+
+        void Filter(uint32_t now);
+
+        size_t count = 0;
+        std::array<filter, ChannelCount> filters;
+        std::vector<uint32_t> state, moving_poll, used, quarantine;
+        std::vector<uint32_t> changes, glitches;
+        std::vector<time_point> state_time;
+        std::vector<size_t> free_slots;
+        bitmask active, changed;
+
+        static uint32_t init_mask, moving_mask, react_true_mask, react_false_mask;
+    };
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "EventHistory.hh"
+#include "Log.hh"
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    // records start on their own cache line
+    constexpr size_t header_size = 64;
+
+    void fnv(uint32_t& hash, const void *data, size_t len)
+    {
+        auto bytes = (const uint8_t*)data;
+        for (size_t i = 0; i < len; i++)
+        {
+            hash ^= bytes[i];
+            hash *= 16777619u;
+        }
+    }
+};
+
+EventHistory::EventHistory()
+    :base(nullptr), size(0), header(nullptr), records(nullptr), next_seq(1)
+{
+
+}
+
+EventHistory::~EventHistory()
+{
+    Close();
+}
+
+uint32_t EventHistory::Checksum(const record& r, uint64_t seq)
+{
+    uint32_t hash = 2166136261u;
+    fnv(hash, &r.time, sizeof(r.time));
+    fnv(hash, &r.duration, sizeof(r.duration));
+    fnv(hash, &r.from, sizeof(r.from));
+    fnv(hash, &r.to, sizeof(r.to));
+    fnv(hash, &seq, sizeof(seq));
+    return hash;
+}
+
+bool EventHistory::Map(int fd, size_t map_size, bool writable)
+{
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *addr = mmap(nullptr, map_size, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+        return false;
+    base = addr;
+    size = map_size;
+    header = (file_header*)base;
+    records = (record*)((char*)base + header_size);
+    return true;
+}
+
+bool EventHistory::Valid(const record& r) const
+{
+    return r.seq != 0 && Checksum(r, r.seq) == r.checksum;
+}
+
+// the seqlock read: a record being rewritten changes its seq meanwhile
+bool EventHistory::Read(uint64_t seq, record& r) const
+{
+    const record& slot = records[seq % header->capacity];
+    if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) != seq)
+        return false;
+    memcpy(&r, &slot, sizeof(r));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot.seq, __ATOMIC_RELAXED) != seq)
+        return false;
+    return Checksum(r, seq) == r.checksum;
+}
+
+uint64_t EventHistory::NewestSeq() const
+{
+    uint64_t newest = 0;
+    record r;
+    for (uint32_t i = 0; i < header->capacity; i++)
+    {
+        uint64_t seq = __atomic_load_n(&records[i].seq, __ATOMIC_ACQUIRE);
+        if (seq > newest && seq % header->capacity == i && Read(seq, r))
+            newest = seq;
+    }
+    return newest;
+}
+
+bool EventHistory::Open(const string& path, int door, uint32_t capacity)
+{
+    Close();
+    if (capacity == 0)
+        return false;
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        Log::Error("EventHistory: can't open ", path, ": ", strerror(errno));
+        return false;
+    }
+
+    size_t want = header_size + capacity * sizeof(record);
+    vector<record> keep;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > header_size && Map(fd, st.st_size, true))
+    {
+        bool valid = memcmp(header->magic, "DAEH", 4) == 0 && header->version == version &&
+            header->record_size == sizeof(record) && header->capacity > 0 &&
+            size >= header_size + header->capacity * sizeof(record);
+        if (valid && header->capacity == capacity && size == want)
+        {
+            header->door = door;
+            next_seq = NewestSeq() + 1;
+            close(fd);
+            Log::Message("EventHistory: ", path, " continues at record ", next_seq);
+            return true;
+        }
+        if (valid)
+        {
+            Log::Message("EventHistory: ", path, " resized from ", header->capacity, " to ", capacity, " records");
+            for (uint32_t i = 0; i < header->capacity; i++)
+            {
+                if (Valid(records[i]))
+                    keep.push_back(records[i]);
+            }
+            sort(keep.begin(), keep.end(), [](const record& a, const record& b) { return a.seq < b.seq; });
+            if (keep.size() > capacity)
+                keep.erase(keep.begin(), keep.end() - capacity);
+        }
+        else
+        {
+            Log::Warning("EventHistory: ", path, " is not a history file, starting over");
+        }
+        Close();
+    }
+
+    // the zeroed file has no valid records, the magic goes in last
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, want) != 0 || !Map(fd, want, true))
+    {
+        Log::Error("EventHistory: can't size ", path, ": ", strerror(errno));
+        close(fd);
+        Close();
+        return false;
+    }
+    close(fd);
+
+    header->version = version;
+    header->record_size = sizeof(record);
+    header->capacity = capacity;
+    header->door = door;
+    next_seq = 1;
+    for (auto& r: keep)
+    {
+        uint64_t seq = next_seq++;
+        auto& slot = records[seq % capacity];
+        slot = r;
+        slot.checksum = Checksum(slot, seq);
+        slot.seq = seq;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, "DAEH", 4);
+    return true;
+}
+
+bool EventHistory::OpenRead(const string& path)
+{
+    Close();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool mapped = fstat(fd, &st) == 0 && (size_t)st.st_size > header_size && Map(fd, st.st_size, false);
+    close(fd);
+    if (!mapped)
+        return false;
+
+    if (memcmp(header->magic, "DAEH", 4) != 0 || header->version != version || header->record_size != sizeof(record) ||
+        header->capacity == 0 || size < header_size + header->capacity * sizeof(record))
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void EventHistory::Sync()
+{
+    if (base != nullptr)
+        msync(base, size, MS_ASYNC);
+}
+
+void EventHistory::Close()
+{
+    if (base == nullptr)
+        return;
+    munmap(base, size);
+    base = nullptr;
+    header = nullptr;
+    records = nullptr;
+    size = 0;
+}
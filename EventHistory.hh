@@ -0,0 +1,134 @@
+#ifndef _EVENTHISTORY_HH
+#define _EVENTHISTORY_HH
+
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace dooragent
+{
+    // Persistent state change history of one door: an mmap'd file holding
+    // a header and a ring of fixed-size records. Appending is a handful of
+    // stores into the mapping, the kernel writes the pages back on its
+    // own. When the ring is full the oldest record is overwritten.
+    //
+    // A record's sequence number is cleared before and written after the
+    // other fields, and a checksum covers all of them, so a reader (or the
+    // next start after a crash) skips a record that is only half there.
+    // The newest record is found by sequence number, there is no head
+    // pointer to keep consistent.
+    class EventHistory
+    {
+    public:
+        struct file_header
+        {
+            char magic[4];
+            uint16_t version;
+            uint16_t record_size;
+            uint32_t capacity;
+            int32_t door;
+        };
+
+        struct record
+        {
+            // unix time in ms
+            uint64_t time;
+            // time spent in the previous state
+            uint32_t duration;
+            uint8_t from;
+            uint8_t to;
+            uint16_t reserved;
+            uint32_t checksum;
+            uint32_t padding;
+            uint64_t seq;
+        };
+
+        EventHistory();
+        ~EventHistory();
+        EventHistory(const EventHistory&) = delete;
+        EventHistory& operator=(const EventHistory&) = delete;
+
+        // opens for appending; an existing file with another capacity is
+        // rewritten keeping the newest records
+        bool Open(const std::string& path, int door, uint32_t capacity);
+        // opens read-only, e.g. for a query while another thread or
+        // process appends
+        bool OpenRead(const std::string& path);
+        void Close();
+
+        bool IsOpen() const { return base != nullptr; }
+        uint32_t GetCapacity() const { return header->capacity; }
+        int GetDoor() const { return header->door; }
+
+        void Append(uint8_t from, uint8_t to, uint32_t duration)
+            {
+                uint64_t seq = next_seq++;
+                auto& r = records[seq % header->capacity];
+                __atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+                __atomic_thread_fence(__ATOMIC_RELEASE);
+                r.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                r.duration = duration;
+                r.from = from;
+                r.to = to;
+                r.reserved = 0;
+                r.padding = 0;
+                r.checksum = Checksum(r, seq);
+                __atomic_store_n(&r.seq, seq, __ATOMIC_RELEASE);
+            }
+
+        // Calls visit(const record&) for the newest records with from <=
+        // time < to, at most limit of them, oldest first. Records are
+        // checked in place in the mapping and only the ones that pass are
+        // copied out for the visitor.
+        template<typename F>
+        size_t Query(uint64_t from, uint64_t to, size_t limit, F&& visit) const
+            {
+                uint64_t newest = NewestSeq();
+                uint64_t oldest = newest >= header->capacity ? newest - header->capacity + 1 : 1;
+                // walk back to find where the wanted range starts
+                uint64_t first = newest + 1;
+                size_t found = 0;
+                record r;
+                for (uint64_t seq = newest; seq >= oldest && seq > 0 && found < limit; seq--)
+                {
+                    if (!Read(seq, r) || r.time >= to)
+                        continue;
+                    if (r.time < from)
+                        break;
+                    first = seq;
+                    found++;
+                }
+                size_t visited = 0;
+                for (uint64_t seq = first; seq <= newest && visited < found; seq++)
+                {
+                    if (Read(seq, r) && r.time >= from && r.time < to)
+                    {
+                        visit(r);
+                        visited++;
+                    }
+                }
+                return visited;
+            }
+
+        void Sync();
+
+        static constexpr uint16_t version = 1;
+
+    protected:
+        static uint32_t Checksum(const record& r, uint64_t seq);
+        bool Map(int fd, size_t size, bool writable);
+        bool Valid(const record& r) const;
+        bool Read(uint64_t seq, record& r) const;
+        uint64_t NewestSeq() const;
+
+        void *base;
+        size_t size;
+        file_header *header;
+        record *records;
+        uint64_t next_seq;
+    };
+};
+
+#endif
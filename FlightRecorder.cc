@@ -0,0 +1,147 @@
+#include "FlightRecorder.hh"
+#include "Door.hh"
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+
+using namespace dooragent;
+using namespace std;
+
+FlightRecorder::FlightRecorder()
+    :head(0)
+{
+
+}
+
+string FlightRecorder::Serialize(chrono::steady_clock::time_point time, int door, uint16_t reason) const
+{
+    size_t count = min<uint64_t>(head, ring_size);
+
+    dump_header header;
+    memcpy(header.magic, "DAFR", 4);
+    header.version = 2;
+    header.reason = reason;
+    header.door = door;
+    header.count = count;
+    header.time = chrono::duration_cast<chrono::nanoseconds>(time.time_since_epoch()).count();
+
+    string data;
+    data.reserve(sizeof(header) + count * sizeof(event));
+    data.append((const char*)&header, sizeof(header));
+    // oldest record first
+    for (uint64_t i = head - count; i < head; i++)
+        data.append((const char*)&ring[i % ring_size], sizeof(event));
+
+    return data;
+}
+
+bool FlightRecorder::DumpFile(const string& path, chrono::steady_clock::time_point time, int door, uint16_t reason) const
+{
+    ofstream out{path, ios::binary | ios::trunc};
+    if (!out.good())
+        return false;
+    auto data = Serialize(time, door, reason);
+    out.write(data.data(), data.size());
+    return out.good();
+}
+
+string FlightRecorder::Describe(const event& ev, uint16_t version)
+{
+    ostringstream ss;
+    switch (ev.type)
+    {
+    case Sample:
+        // version 1 dumps carry the old shift register debounce
+        if (version == 1)
+            ss << "sample closed=" << (int)ev.arg1 << " debounce=0x" << hex << setw(8) << setfill('0') << ev.arg3;
+        else
+            ss << "sample closed=" << (int)ev.arg1 << " held=" << ev.arg3 << " ms";
+        break;
+    case Edge:
+        ss << "edge closed=" << (int)ev.arg1;
+        break;
+    case StateChange:
+        ss << "state " << Door::StateStr((Door::State)ev.arg1) << " -> " << Door::StateStr((Door::State)ev.arg2);
+        break;
+    case Pulse:
+        ss << "pulse " << (ev.arg1 == CmdClose ? "close" : "open") << " " << ev.arg3 << " ms";
+        break;
+    case Command:
+        switch (ev.arg1)
+        {
+        case CmdOpen:
+            ss << "command open";
+            break;
+        case CmdClose:
+            ss << "command close";
+            break;
+        case CmdDump:
+            ss << "command dump";
+            break;
+        default:
+            ss << "command unknown";
+        }
+        if (ev.arg1 == CmdOpen || ev.arg1 == CmdClose)
+        {
+            static const char *outcomes[] = {" rejected", " accepted", " queued", " expired"};
+            ss << (ev.arg2 < 4 ? outcomes[ev.arg2] : " ?");
+        }
+        break;
+    case Fault:
+        switch (ev.arg1)
+        {
+        case FaultOpenTimeout:
+            ss << "fault: opening timed out";
+            break;
+        case FaultCloseTimeout:
+            ss << "fault: closing timed out";
+            break;
+        case FaultRequested:
+            ss << "dump requested";
+            break;
+        case FaultObstruction:
+            ss << "fault: obstructed while closing";
+            break;
+        case FaultChatter:
+            ss << "fault: sensor chatter";
+            break;
+        case FaultStuck:
+            ss << "fault: sensor stuck";
+            break;
+        default:
+            ss << "fault " << (int)ev.arg1;
+        }
+        break;
+    default:
+        ss << "unknown event " << (int)ev.type;
+    }
+    return ss.str();
+}
+
+bool FlightRecorder::Decode(const string& data, ostream& out)
+{
+    dump_header header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, "DAFR", 4) != 0 || (header.version != 1 && header.version != 2) ||
+        data.size() < sizeof(header) + header.count * sizeof(event))
+        return false;
+
+    event reason_ev{0, Fault, (uint8_t)header.reason, 0, 0};
+    out << "door " << header.door << ": " << header.count << " events, dumped on " << Describe(reason_ev) << endl;
+
+    const char *records = data.data() + sizeof(header);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        event ev;
+        memcpy(&ev, records + i * sizeof(event), sizeof(event));
+        // times are relative to the dump, the monotonic clock means
+        // nothing outside the process that wrote it
+        double t = ((int64_t)ev.time - (int64_t)header.time) / 1e9;
+        out << fixed << setprecision(3) << setw(10) << t << " s  " << Describe(ev, header.version) << endl;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#ifndef _FLIGHTRECORDER_HH
+#define _FLIGHTRECORDER_HH
+
+#include <array>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <iosfwd>
+
+namespace dooragent
+{
+    // Fixed-size ring of compact binary event records. Recording is a
+    // store into a preallocated slot, formatting only happens when a
+    // dump is decoded.
+    class FlightRecorder
+    {
+    public:
+        enum EventType : uint8_t
+        {
+            Sample,
+            Edge,
+            StateChange,
+            Pulse,
+            Command,
+            Fault
+        };
+
+        enum CommandType : uint8_t
+        {
+            CmdOpen,
+            CmdClose,
+            CmdDump,
+            CmdUnknown
+        };
+
+        enum FaultType : uint8_t
+        {
+            FaultOpenTimeout,
+            FaultCloseTimeout,
+            FaultRequested,
+            FaultObstruction,
+            FaultChatter,
+            FaultStuck
+        };
+
+        struct event
+        {
+            uint64_t time;
+            uint8_t type;
+            uint8_t arg1;
+            uint16_t arg2;
+            uint32_t arg3;
+        };
+
+        struct dump_header
+        {
+            char magic[4];
+            uint16_t version;
+            uint16_t reason;
+            int32_t door;
+            uint32_t count;
+            uint64_t time;
+        };
+
+        static constexpr size_t ring_size = 512;
+
+        FlightRecorder();
+
+        // time is the backend's clock, so simulated and replayed runs
+        // record their own timeline
+        void Record(std::chrono::steady_clock::time_point time, EventType type,
+                    uint8_t arg1 = 0, uint16_t arg2 = 0, uint32_t arg3 = 0)
+            {
+                auto& ev = ring[head++ % ring_size];
+                ev.time = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+                ev.type = type;
+                ev.arg1 = arg1;
+                ev.arg2 = arg2;
+                ev.arg3 = arg3;
+            }
+
+        // time is taken from the same clock as the records
+        std::string Serialize(std::chrono::steady_clock::time_point time, int door, uint16_t reason) const;
+        bool DumpFile(const std::string& path, std::chrono::steady_clock::time_point time, int door, uint16_t reason) const;
+
+        static bool Decode(const std::string& data, std::ostream& out);
+        static std::string Describe(const event& ev, uint16_t version = 2);
+
+    protected:
+        std::array<event, ring_size> ring;
+        uint64_t head;
+    };
+};
+
+#endif
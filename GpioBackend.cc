@@ -0,0 +1,19 @@
+#include "GpioBackend.hh"
+#include "GpioRegistry.hh"
+
+using namespace dooragent;
+using namespace std;
+
+unique_ptr<GpioBackend> GpioBackend::current;
+
+GpioBackend& GpioBackend::Get()
+{
+    if (!current)
+        current = make_unique<GpioRegistry>();
+    return *current;
+}
+
+void GpioBackend::Set(unique_ptr<GpioBackend> backend)
+{
+    current = move(backend);
+}
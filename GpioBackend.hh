@@ -0,0 +1,69 @@
+#ifndef _GPIOBACKEND_HH
+#define _GPIOBACKEND_HH
+
+#include <string>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+namespace dooragent
+{
+    // Everything the door logic needs from GPIO: numbered inputs (polled
+    // or with edge events), numbered outputs and a clock. The default
+    // backend is libgpiod (GpioRegistry); the simulated and trace replay
+    // backends run on a virtual clock and can be stepped offline, faster
+    // than real time.
+    class GpioBackend
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        struct edge
+        {
+            bool value;
+            clock::time_point time;
+        };
+
+        // the next thing that happens in an offline run
+        struct step
+        {
+            enum Kind : uint8_t
+            {
+                Tick,
+                Edge
+            };
+
+            Kind kind;
+            int input;
+            clock::time_point time;
+        };
+
+        static GpioBackend& Get();
+        static void Set(std::unique_ptr<GpioBackend> backend);
+
+        virtual ~GpioBackend() = default;
+
+        virtual int AddInput(const std::string& chip, int line, bool events) = 0;
+        virtual int AddOutput(const std::string& chip, int line, bool level, const std::string& consumer) = 0;
+        virtual void RequestInputs() = 0;
+        virtual void ReadInputs(bool with_events = true) = 0;
+        virtual int GetInputValue(int input) const = 0;
+        virtual int GetInputFd(int input) const = 0;
+        virtual bool ReadInputEvent(int input, edge& event) = 0;
+        virtual void SetOutput(int output, bool value) = 0;
+        // give a line back, used when a config reload drops or moves it
+        virtual void ReleaseInput(int) {}
+        virtual void ReleaseOutput(int) {}
+        // debounce in the kernel or the chip, false where there is none
+        virtual bool SetInputDebounce(int, int) { return false; }
+
+        virtual clock::time_point Now() const { return clock::now(); }
+        // only offline backends have steps, live ones are driven by the loop
+        virtual bool NextStep(step&) { return false; }
+
+    protected:
+        static std::unique_ptr<GpioBackend> current;
+    };
+};
+
+#endif
@@ -0,0 +1,272 @@
+#include "GpioRegistry.hh"
+#include "Log.hh"
+#include "Metrics.hh"
+#include <algorithm>
+
+using namespace dooragent;
+using namespace std;
+
+GpioRegistry::GpioRegistry()
+    :read_time(Metrics::Get().AddHistogram("gpio_read_us", "Duration of one bulk get_values() call"))
+{
+
+}
+
+gpiod::chip& GpioRegistry::GetChip(const string& name)
+{
+    auto chip_iter = chips.find(name);
+    if (chip_iter == chips.end())
+    {
+        Log::Message("GPIO: opening chip " + name);
+        chip_iter = chips.emplace(name, gpiod::chip{name}).first;
+    }
+    return chip_iter->second;
+}
+
+int GpioRegistry::AddOutput(const string& chip, int line, bool level, const string& consumer)
+{
+    auto key = make_pair(chip, line);
+    auto out_iter = output_ids.find(key);
+    if (out_iter != output_ids.end())
+    {
+        outputs[out_iter->second].refs++;
+        return out_iter->second;
+    }
+
+    auto out_line = GetChip(chip).get_line(line);
+    gpiod::line_request req;
+    req.consumer = consumer;
+    req.request_type = gpiod::line_request::DIRECTION_OUTPUT;
+    req.flags = 0;
+    // start released, the line is only driven active by a pulse
+    out_line.request(req, level ? 0 : 1);
+    int id = outputs.size();
+    outputs.push_back(output{out_line, 1});
+    output_ids[key] = id;
+    Log::Message("GPIO: requested output " + chip + ":" + to_string(line) + " for " + consumer);
+
+    return id;
+}
+
+void GpioRegistry::SetOutput(int output, bool value)
+{
+    // a pulse can still be running on a line a reload released
+    if (outputs[output].line.is_requested())
+        outputs[output].line.set_value(value ? 1 : 0);
+}
+
+void GpioRegistry::ReleaseOutput(int output)
+{
+    auto& out = outputs[output];
+    if (--out.refs > 0 || !out.line.is_requested())
+        return;
+
+    Log::Message("GPIO: releasing output " + out.line.get_chip().name() + ":" + to_string(out.line.offset()));
+    out.line.release();
+    // the id stays reserved, a later request of the same line gets a new one
+    for (auto iter = output_ids.begin(); iter != output_ids.end(); iter++)
+    {
+        if (iter->second == output)
+        {
+            output_ids.erase(iter);
+            break;
+        }
+    }
+}
+
+int GpioRegistry::AddInput(const string& chip, int line, bool events)
+{
+    // a line released on a reload may still be held by its group
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        auto& old = inputs[i];
+        if (old.used || !old.line.is_requested() || old.line.get_chip().name() != GetChip(chip).name() ||
+            (int)old.line.offset() != line)
+            continue;
+        if (old.events == events)
+        {
+            Log::Message("GPIO: reusing input " + chip + ":" + to_string(line));
+            old.used = true;
+            return i;
+        }
+        // requested the other way, it has to go first
+        DropInput(i);
+    }
+
+    int id = inputs.size();
+    auto& in = inputs.emplace_back();
+    in.line = GetChip(chip).get_line(line);
+    in.events = events;
+    in.used = true;
+    in.value = 0;
+
+    // group by chip and request type, a bulk can hold at most MAX_LINES
+    input_group *group = nullptr;
+    for (auto& g: groups)
+    {
+        if (!g.requested && g.chip == chip && g.events == events && g.lines.size() < gpiod::line_bulk::MAX_LINES)
+        {
+            group = &g;
+            break;
+        }
+    }
+    if (group == nullptr)
+    {
+        group = &groups.emplace_back();
+        group->chip = chip;
+        group->events = events;
+        group->requested = false;
+    }
+    group->lines.append(in.line);
+    group->inputs.push_back(id);
+
+    return id;
+}
+
+void GpioRegistry::RequestInputs()
+{
+    for (auto& group: groups)
+    {
+        if (group.requested || group.inputs.empty())
+            continue;
+
+        gpiod::line_request req;
+        req.consumer = "door-agent.sensors";
+        req.request_type = group.events ? gpiod::line_request::EVENT_BOTH_EDGES : gpiod::line_request::DIRECTION_INPUT;
+        req.flags = 0;
+        group.lines.request(req);
+        group.requested = true;
+        Log::Message("GPIO: requested " + to_string(group.lines.size()) + " inputs on " + group.chip +
+                     (group.events ? " with edge events" : ""));
+    }
+
+    // seed the cached values, in event mode only edges update them later
+    ReadInputs();
+}
+
+void GpioRegistry::ReadInputs(bool with_events)
+{
+    for (auto& group: groups)
+    {
+        if (!group.requested || (group.events && !with_events) || group.inputs.empty())
+            continue;
+
+        auto start = chrono::steady_clock::now();
+        auto values = group.lines.get_values();
+        read_time.Add(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count());
+        for (size_t i = 0; i < values.size(); i++)
+        {
+            auto& in = inputs[group.inputs[i]];
+            if (in.used)
+                in.value = values[i];
+        }
+    }
+}
+
+// A polled line stays in its group, see the class comment; once nothing in
+// the group is used any more, the whole bulk is released.
+void GpioRegistry::ReleaseInput(int input)
+{
+    auto& in = inputs[input];
+    if (!in.used)
+        return;
+    in.used = false;
+    in.value = 0;
+
+    for (auto& group: groups)
+    {
+        if (find(group.inputs.begin(), group.inputs.end(), input) == group.inputs.end())
+            continue;
+        if (group.events)
+        {
+            DropInput(input);
+            break;
+        }
+        bool idle = none_of(group.inputs.begin(), group.inputs.end(), [this](int id)
+            {
+                return inputs[id].used;
+            });
+        if (idle)
+        {
+            if (group.requested)
+            {
+                Log::Message("GPIO: releasing " + to_string(group.lines.size()) + " inputs on " + group.chip);
+                group.lines.release();
+            }
+            group.lines = gpiod::line_bulk();
+            group.inputs.clear();
+            group.requested = false;
+        }
+        break;
+    }
+}
+
+// Really gives up an unused line. An event line can go alone; a polled
+// group is released and requested again without it, in the same order.
+void GpioRegistry::DropInput(int input)
+{
+    auto& in = inputs[input];
+    for (auto& group: groups)
+    {
+        auto pos = find(group.inputs.begin(), group.inputs.end(), input);
+        if (pos == group.inputs.end())
+            continue;
+
+        group.inputs.erase(pos);
+        if (group.requested && group.events)
+            in.line.release();
+        else if (group.requested)
+            group.lines.release();
+
+        gpiod::line_bulk lines;
+        for (int id: group.inputs)
+            lines.append(inputs[id].line);
+        group.lines = lines;
+
+        if (group.requested && !group.events && !group.inputs.empty())
+        {
+            gpiod::line_request req;
+            req.consumer = "door-agent.sensors";
+            req.request_type = gpiod::line_request::DIRECTION_INPUT;
+            req.flags = 0;
+            group.lines.request(req);
+        }
+        if (group.inputs.empty())
+            group.requested = false;
+        break;
+    }
+    Log::Message("GPIO: released input " + in.line.get_chip().name() + ":" + to_string(in.line.offset()));
+    in.line = gpiod::line();
+    in.events = false;
+}
+
+int GpioRegistry::GetInputFd(int input) const
+{
+    auto& in = inputs[input];
+    if (in.used && in.events && in.line.is_requested())
+        return in.line.event_get_fd();
+    return -1;
+}
+
+bool GpioRegistry::ReadInputEvent(int input, edge& event)
+{
+    auto& in = inputs[input];
+    if (!in.used || !in.events || !in.line.is_requested())
+        return false;
+    // callers read until there is nothing left, event_read() would block
+    if (!in.line.event_wait(chrono::nanoseconds(0)))
+        return false;
+
+    auto line_event = in.line.event_read();
+    in.value = (line_event.event_type == gpiod::line_event::RISING_EDGE) ? 1 : 0;
+    event.value = in.value;
+
+    // the kernel stamps edges with CLOCK_MONOTONIC (since 5.7), which is
+    // what steady_clock uses; older kernels use the realtime clock, so
+    // fall back to the current time if the stamp is clearly off
+    auto time_now = clock::now();
+    event.time = clock::time_point{chrono::duration_cast<clock::duration>(line_event.timestamp)};
+    if (event.time > time_now || time_now - event.time > 1s)
+        event.time = time_now;
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef _GPIOREGISTRY_HH
+#define _GPIOREGISTRY_HH
+
+#include <string>
+#include <vector>
+#include <map>
+#include <gpiod.hpp>
+#include "GpioBackend.hh"
+#include "Histogram.hh"
+
+namespace dooragent
+{
+    // libgpiod backend and owner of GPIO chips and lines. Each chip is
+    // opened once, outputs stay requested until the last door using them
+    // releases them and the inputs on a chip are requested as one bulk so
+    // a poll reads all of them with a single call. Inputs added later (on
+    // a config reload) go into new groups, the requested ones are left
+    // alone.
+    //
+    // The lines of a polled group share one handle and get_values() answers
+    // in request order, so a released polled input keeps its place in the
+    // bulk, unused, until the whole group is idle; asking for the same line
+    // again picks it up where it is. Event lines have a handle each and are
+    // released right away.
+    class GpioRegistry : public GpioBackend
+    {
+    public:
+        GpioRegistry();
+
+        gpiod::chip& GetChip(const std::string& name);
+
+        int AddInput(const std::string& chip, int line, bool events) override;
+        int AddOutput(const std::string& chip, int line, bool level, const std::string& consumer) override;
+        void RequestInputs() override;
+        void ReadInputs(bool with_events = true) override;
+
+        int GetInputValue(int input) const override { return inputs[input].value; }
+        int GetInputFd(int input) const override;
+        bool ReadInputEvent(int input, edge& event) override;
+        void SetOutput(int output, bool value) override;
+        void ReleaseInput(int input) override;
+        void ReleaseOutput(int output) override;
+        // libgpiod v1 can't set a debounce period, that needs the v2 uAPI
+        // (gpiod_line_settings_set_debounce_period_us); the inherited
+        // SetInputDebounce reports it as unsupported
+
+    protected:
+        struct input
+        {
+            gpiod::line line;
+            bool events;
+            bool used;
+            int value;
+        };
+
+        struct input_group
+        {
+            std::string chip;
+            gpiod::line_bulk lines;
+            std::vector<int> inputs;
+            bool events;
+            bool requested;
+        };
+
+        void DropInput(int input);
+
+        std::map<std::string, gpiod::chip> chips;
+        struct output
+        {
+            gpiod::line line;
+            int refs;
+        };
+
+        std::map<std::pair<std::string, int>, int> output_ids;
+        std::vector<output> outputs;
+        std::vector<input> inputs;
+        std::vector<input_group> groups;
+        Histogram& read_time;
+    };
+};
+
+#endif
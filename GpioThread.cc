@@ -0,0 +1,145 @@
+#include "GpioThread.hh"
+#include "Log.hh"
+#include <pthread.h>
+#include <sched.h>
+#include <cstring>
+
+using namespace dooragent;
+using namespace std;
+
+GpioThread::GpioThread(shared_ptr<uvw::Loop> main_loop, shared_ptr<uvw::Loop> gpio_loop)
+    :main_loop(main_loop), gpio_loop(gpio_loop), stopping(false), dropped_events(0), overflow(false), priority(0), cpu(-1)
+{
+    // both handles are created before the GPIO loop runs, after that
+    // each loop only touches its own
+    main_async = main_loop->resource<uvw::AsyncHandle>();
+    main_async->on<uvw::AsyncEvent>([this](uvw::AsyncEvent&, uvw::AsyncHandle&)
+        {
+            event ev;
+            while (events.Pop(ev))
+            {
+                if (on_event)
+                    on_event(ev);
+                else
+                    delete ev.dump;
+            }
+            // the queue has room again
+            if (overflow.exchange(false) && on_overflow)
+                on_overflow();
+        });
+
+    gpio_async = gpio_loop->resource<uvw::AsyncHandle>();
+    gpio_async->on<uvw::AsyncEvent>([this](uvw::AsyncEvent&, uvw::AsyncHandle&)
+        {
+            if (stopping.load())
+            {
+                this->gpio_loop->stop();
+                return;
+            }
+            command cmd;
+            while (commands.Pop(cmd))
+            {
+                if (on_command)
+                    on_command(cmd);
+            }
+        });
+}
+
+GpioThread::~GpioThread()
+{
+    Stop();
+}
+
+void GpioThread::SetPriority(int priority)
+{
+    this->priority = priority;
+}
+
+void GpioThread::SetCpu(int cpu)
+{
+    this->cpu = cpu;
+}
+
+void GpioThread::SetCommandHandler(command_handler handler)
+{
+    on_command = handler;
+}
+
+void GpioThread::SetEventHandler(event_handler handler)
+{
+    on_event = handler;
+}
+
+void GpioThread::SetOverflowHandler(overflow_handler handler)
+{
+    on_overflow = handler;
+}
+
+bool GpioThread::PostCommand(const command& cmd)
+{
+    if (!commands.Push(cmd))
+    {
+        Log::Error("GPIO thread: command queue full, can't post command for door ", cmd.index);
+        return false;
+    }
+    gpio_async->send();
+    return true;
+}
+
+bool GpioThread::PostEvent(const event& ev)
+{
+    if (!events.Push(ev))
+    {
+        dropped_events.fetch_add(1, memory_order_relaxed);
+        delete ev.dump;
+        overflow.store(true);
+        main_async->send();
+        return false;
+    }
+    main_async->send();
+    return true;
+}
+
+void GpioThread::Start()
+{
+    stopping.store(false);
+    thread = std::thread{&GpioThread::Run, this};
+}
+
+void GpioThread::Stop()
+{
+    if (!thread.joinable())
+        return;
+    stopping.store(true);
+    gpio_async->send();
+    thread.join();
+}
+
+void GpioThread::Run()
+{
+    if (priority > 0)
+    {
+        sched_param param{};
+        param.sched_priority = priority;
+        int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0)
+            Log::Warning("GPIO thread: can't set SCHED_FIFO priority ", priority, ": ", strerror(ret));
+        else
+            Log::Message("GPIO thread: running with SCHED_FIFO priority ", priority);
+    }
+
+    if (cpu >= 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret != 0)
+            Log::Warning("GPIO thread: can't pin to CPU ", cpu, ": ", strerror(ret));
+        else
+            Log::Message("GPIO thread: pinned to CPU ", cpu);
+    }
+
+    gpio_loop->run();
+    Log::Message("GPIO thread: stopped");
+}
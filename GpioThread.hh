@@ -0,0 +1,90 @@
+#ifndef _GPIOTHREAD_HH
+#define _GPIOTHREAD_HH
+
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <functional>
+#include <cstdint>
+#include <uvw.hpp>
+#include "SpscQueue.hh"
+
+namespace dooragent
+{
+    // Runs the GPIO side (sampling, state machines, pulses) on its own
+    // loop and thread, optionally real-time and pinned to a CPU. Commands
+    // go in and state events come out through lock-free SPSC queues, with
+    // an async handle on each loop for wakeups. An event that doesn't fit
+    // in the queue is dropped and flagged, the overflow handler then runs
+    // on the main loop once the queue is drained, to ask for a resync.
+    class GpioThread
+    {
+    public:
+        struct command
+        {
+            int index;
+            uint8_t action;
+        };
+
+        struct event
+        {
+            enum Kind : uint8_t
+            {
+                StateChange,
+                Dump,
+                Calibration,
+                CommandResult,
+                Health
+            };
+
+            int index;
+            Kind kind;
+            uint8_t state;
+            uint8_t reason;
+            // owned by the receiver, set for dumps, calibration and
+            // command results
+            std::string *dump;
+        };
+
+        using command_handler = std::function<void(const command&)>;
+        using event_handler = std::function<void(event&)>;
+        using overflow_handler = std::function<void()>;
+
+        GpioThread(std::shared_ptr<uvw::Loop> main_loop, std::shared_ptr<uvw::Loop> gpio_loop);
+        ~GpioThread();
+
+        void SetPriority(int priority);
+        void SetCpu(int cpu);
+        void SetCommandHandler(command_handler handler);
+        void SetEventHandler(event_handler handler);
+        void SetOverflowHandler(overflow_handler handler);
+
+        bool PostCommand(const command& cmd);
+        bool PostEvent(const event& ev);
+
+        void Start();
+        void Stop();
+
+        unsigned long GetDroppedEvents() const { return dropped_events.load(std::memory_order_relaxed); }
+
+    protected:
+        void Run();
+
+        std::shared_ptr<uvw::Loop> main_loop, gpio_loop;
+        std::shared_ptr<uvw::AsyncHandle> main_async, gpio_async;
+        SpscQueue<command, 256> commands;
+        SpscQueue<event, 1024> events;
+        command_handler on_command;
+        event_handler on_event;
+        overflow_handler on_overflow;
+
+        std::thread thread;
+        std::atomic<bool> stopping;
+        std::atomic<unsigned long> dropped_events;
+        std::atomic<bool> overflow;
+        int priority, cpu;
+    };
+};
+
+#endif
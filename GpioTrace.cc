@@ -0,0 +1,283 @@
+#include "GpioTrace.hh"
+#include "Log.hh"
+#include <cstring>
+#include <iterator>
+
+using namespace dooragent;
+using namespace dooragent::GpioTrace;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    // signed deltas, edges can be stamped before the tick that read them
+    uint64_t zigzag(int64_t value)
+    {
+        return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+    }
+
+    int64_t unzigzag(uint64_t value)
+    {
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+};
+
+GpioTraceRecorder::GpioTraceRecorder(unique_ptr<GpioBackend> live, const string& path)
+    :live(move(live)), out(path, ios::binary | ios::trunc), started(false), traced(0)
+{
+
+}
+
+GpioTraceRecorder::~GpioTraceRecorder()
+{
+    Flush();
+}
+
+int GpioTraceRecorder::AddInput(const string& chip, int line, bool events)
+{
+    int id = live->AddInput(chip, line, events);
+    if (started)
+        Log::Warning("GPIO trace: ", chip, ":", line, " was added after the header, it is not recorded");
+    if (table.size() <= (size_t)id)
+    {
+        table.resize(id + 1);
+        last_values.resize(id + 1, -1);
+    }
+    auto& entry = table[id];
+    strncpy(entry.chip, chip.c_str(), sizeof(entry.chip) - 1);
+    entry.line = line;
+    entry.events = events;
+    return id;
+}
+
+int GpioTraceRecorder::AddOutput(const string& chip, int line, bool level, const string& consumer)
+{
+    return live->AddOutput(chip, line, level, consumer);
+}
+
+void GpioTraceRecorder::RequestInputs()
+{
+    live->RequestInputs();
+
+    // the input table is complete now, the header can go out
+    if (!started)
+    {
+        last_time = live->Now();
+        trace_header header;
+        memcpy(header.magic, "DAGT", 4);
+        header.version = 1;
+        header.inputs = table.size();
+        header.start = duration_cast<microseconds>(last_time.time_since_epoch()).count();
+        buffer.append((const char*)&header, sizeof(header));
+        for (auto& entry: table)
+            buffer.append((const char*)&entry, sizeof(entry));
+        started = true;
+        traced = table.size();
+        Log::Message("GPIO trace: recording ", table.size(), " inputs");
+    }
+}
+
+void GpioTraceRecorder::ReadInputs(bool with_events)
+{
+    live->ReadInputs(with_events);
+    if (!started)
+        return;
+
+    buffer += (char)Tick;
+    PutTime(live->Now());
+    for (size_t i = 0; i < traced; i++)
+    {
+        int value = live->GetInputValue(i);
+        if (value != last_values[i])
+        {
+            buffer += (char)(Value | (value ? 0x80 : 0));
+            PutVarint(i);
+            last_values[i] = value;
+        }
+    }
+
+    if (buffer.size() >= 4096)
+        Flush();
+}
+
+bool GpioTraceRecorder::ReadInputEvent(int input, edge& event)
+{
+    if (!live->ReadInputEvent(input, event))
+        return false;
+
+    if (started && (size_t)input < traced)
+    {
+        buffer += (char)(Edge | (event.value ? 0x80 : 0));
+        PutVarint(input);
+        PutTime(event.time);
+        last_values[input] = event.value;
+    }
+    return true;
+}
+
+void GpioTraceRecorder::PutVarint(uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer += (char)(value | 0x80);
+        value >>= 7;
+    }
+    buffer += (char)value;
+}
+
+void GpioTraceRecorder::PutTime(clock::time_point time)
+{
+    PutVarint(zigzag(duration_cast<microseconds>(time - last_time).count()));
+    last_time = time;
+}
+
+void GpioTraceRecorder::Flush()
+{
+    if (buffer.empty())
+        return;
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    buffer.clear();
+}
+
+bool GpioTraceReplay::Load(const string& path)
+{
+    ifstream in{path, ios::binary};
+    if (!in.good())
+        return false;
+    data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+
+    trace_header header;
+    if (data.size() < sizeof(header))
+        return false;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, "DAGT", 4) != 0 || header.version != 1)
+        return false;
+
+    pos = sizeof(header);
+    if (data.size() < pos + header.inputs * sizeof(trace_input))
+        return false;
+    table.resize(header.inputs);
+    memcpy(table.data(), data.data() + pos, header.inputs * sizeof(trace_input));
+    pos += header.inputs * sizeof(trace_input);
+
+    values.assign(table.size(), 0);
+    edges.assign(table.size(), pending_edge{false, false, {}});
+    now_time = last_time = clock::time_point{microseconds(header.start)};
+
+    Log::Message("GPIO trace: replaying ", table.size(), " inputs, ", data.size(), " bytes from ", path);
+    return true;
+}
+
+int GpioTraceReplay::AddInput(const string& chip, int line, bool)
+{
+    int id = inputs.size();
+    int trace_input = -1;
+    for (size_t i = 0; i < table.size(); i++)
+    {
+        if (chip.compare(0, sizeof(table[i].chip), table[i].chip) == 0 && table[i].line == line)
+            trace_input = i;
+    }
+    if (trace_input < 0)
+        Log::Warning("GPIO trace: input " + chip + ":" + to_string(line) + " is not in the trace");
+    inputs.push_back(trace_input);
+    return id;
+}
+
+int GpioTraceReplay::AddOutput(const string&, int, bool, const string&)
+{
+    // outputs go nowhere, there is no hardware to drive
+    return 0;
+}
+
+int GpioTraceReplay::GetInputValue(int input) const
+{
+    int trace_input = inputs[input];
+    return trace_input < 0 ? 0 : values[trace_input];
+}
+
+bool GpioTraceReplay::ReadInputEvent(int input, edge& event)
+{
+    int trace_input = inputs[input];
+    if (trace_input < 0 || !edges[trace_input].pending)
+        return false;
+
+    auto& e = edges[trace_input];
+    e.pending = false;
+    values[trace_input] = e.value;
+    event.value = e.value;
+    event.time = e.time;
+    return true;
+}
+
+bool GpioTraceReplay::GetVarint(uint64_t& value)
+{
+    value = 0;
+    for (int shift = 0; pos < data.size() && shift < 64; shift += 7)
+    {
+        uint8_t byte = data[pos++];
+        value |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+    return false;
+}
+
+bool GpioTraceReplay::GetTime(clock::time_point& time)
+{
+    uint64_t delta;
+    if (!GetVarint(delta))
+        return false;
+    time = last_time + microseconds(unzigzag(delta));
+    last_time = time;
+    return true;
+}
+
+bool GpioTraceReplay::NextStep(step& next)
+{
+    while (pos < data.size())
+    {
+        uint8_t tag = data[pos++];
+        bool value = tag & 0x80;
+        uint64_t input;
+
+        switch (tag & 0x7f)
+        {
+        case Tick:
+            if (!GetTime(next.time))
+                return false;
+            // the values read on this tick follow it
+            while (pos < data.size() && (data[pos] & 0x7f) == Value)
+            {
+                bool tick_value = data[pos++] & 0x80;
+                if (!GetVarint(input) || input >= values.size())
+                    return false;
+                values[input] = tick_value;
+            }
+            next.kind = step::Tick;
+            next.input = -1;
+            now_time = max(now_time, next.time);
+            return true;
+        case Edge:
+            if (!GetVarint(input) || input >= edges.size() || !GetTime(next.time))
+                return false;
+            edges[input] = pending_edge{true, value, next.time};
+            // hand out the backend id of the door input, if any
+            next.kind = step::Edge;
+            next.input = -1;
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                if (inputs[i] == (int)input)
+                    next.input = i;
+            }
+            now_time = max(now_time, next.time);
+            if (next.input < 0)
+                continue;
+            return true;
+        default:
+            Log::Error("GPIO trace: bad record type ", tag & 0x7f, " at offset ", pos - 1);
+            return false;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,126 @@
+#ifndef _GPIOTRACE_HH
+#define _GPIOTRACE_HH
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include "GpioBackend.hh"
+
+namespace dooragent
+{
+    // Compact binary trace of the input streams: a header with the input
+    // table, then one record per poll tick, per input value that changed
+    // since the previous tick and per edge event. Times are stored as
+    // varint deltas in microseconds, an idle tick takes four bytes.
+    namespace GpioTrace
+    {
+        struct trace_header
+        {
+            char magic[4];
+            uint16_t version;
+            uint16_t inputs;
+            uint64_t start;
+        };
+
+        struct trace_input
+        {
+            char chip[32];
+            uint16_t line;
+            uint8_t events;
+            uint8_t reserved;
+        };
+
+        enum RecordType : uint8_t
+        {
+            Tick,
+            Value,
+            Edge
+        };
+    };
+
+    // Passes everything through to the live backend and writes the input
+    // side of it to a trace file.
+    class GpioTraceRecorder : public GpioBackend
+    {
+    public:
+        GpioTraceRecorder(std::unique_ptr<GpioBackend> live, const std::string& path);
+        ~GpioTraceRecorder();
+
+        bool IsOpen() const { return out.good(); }
+
+        int AddInput(const std::string& chip, int line, bool events) override;
+        int AddOutput(const std::string& chip, int line, bool level, const std::string& consumer) override;
+        void RequestInputs() override;
+        void ReadInputs(bool with_events = true) override;
+
+        int GetInputValue(int input) const override { return live->GetInputValue(input); }
+        int GetInputFd(int input) const override { return live->GetInputFd(input); }
+        bool ReadInputEvent(int input, edge& event) override;
+        void SetOutput(int output, bool value) override { live->SetOutput(output, value); }
+        void ReleaseInput(int input) override { live->ReleaseInput(input); }
+        void ReleaseOutput(int output) override { live->ReleaseOutput(output); }
+
+        clock::time_point Now() const override { return live->Now(); }
+        bool NextStep(step& next) override { return live->NextStep(next); }
+
+    protected:
+        void PutVarint(uint64_t value);
+        void PutTime(clock::time_point time);
+        void Flush();
+
+        std::unique_ptr<GpioBackend> live;
+        std::ofstream out;
+        std::string buffer;
+        std::vector<GpioTrace::trace_input> table;
+        std::vector<int> last_values;
+        clock::time_point last_time;
+        bool started;
+        size_t traced;
+    };
+
+    // Plays a trace back as offline steps on a virtual clock. Inputs are
+    // matched to the trace by chip and line, so the door configuration can
+    // differ from the one that recorded it.
+    class GpioTraceReplay : public GpioBackend
+    {
+    public:
+        bool Load(const std::string& path);
+
+        int AddInput(const std::string& chip, int line, bool events) override;
+        int AddOutput(const std::string& chip, int line, bool level, const std::string& consumer) override;
+        void RequestInputs() override {}
+        void ReadInputs(bool = true) override {}
+
+        int GetInputValue(int input) const override;
+        int GetInputFd(int) const override { return -1; }
+        bool ReadInputEvent(int input, edge& event) override;
+        void SetOutput(int, bool) override {}
+
+        clock::time_point Now() const override { return now_time; }
+        bool NextStep(step& next) override;
+
+    protected:
+        bool GetVarint(uint64_t& value);
+        bool GetTime(clock::time_point& time);
+
+        struct pending_edge
+        {
+            bool pending;
+            bool value;
+            clock::time_point time;
+        };
+
+        std::string data;
+        size_t pos;
+        std::vector<GpioTrace::trace_input> table;
+        std::vector<int> values;
+        std::vector<pending_edge> edges;
+        // backend input id -> trace input, -1 when not in the trace
+        std::vector<int> inputs;
+        clock::time_point now_time, last_time;
+    };
+};
+
+#endif
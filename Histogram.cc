@@ -0,0 +1,32 @@
+#include "Histogram.hh"
+
+using namespace dooragent;
+using namespace std;
+
+// Upper bound of the bucket holding the p-th percentile, good to a
+// factor of two which is all a log2 histogram can tell.
+uint64_t Histogram::Percentile(double p) const
+{
+    uint64_t total = GetCount();
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = total * p;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        seen += GetBucket(i);
+        if (seen > rank)
+            return BucketLimit(i);
+    }
+    return GetMax();
+}
+
+string Histogram::Summary() const
+{
+    uint64_t n = GetCount();
+    if (n == 0)
+        return "n=0";
+    return "n=" + to_string(n) + " mean=" + to_string(GetSum() / n) + " p50<=" + to_string(Percentile(0.5)) +
+        " p99<=" + to_string(Percentile(0.99)) + " max=" + to_string(GetMax());
+}
@@ -0,0 +1,46 @@
+#ifndef _HISTOGRAM_HH
+#define _HISTOGRAM_HH
+
+#include <array>
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+namespace dooragent
+{
+    // Log2-bucketed histogram of non-negative values (usually
+    // microseconds). Adding a value is a couple of relaxed atomic
+    // increments, so one thread can record while another reads.
+    class Histogram
+    {
+    public:
+        static constexpr size_t bucket_count = 32;
+
+        void Add(uint64_t value)
+            {
+                size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+                if (bucket >= bucket_count)
+                    bucket = bucket_count - 1;
+                buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+                count.fetch_add(1, std::memory_order_relaxed);
+                sum.fetch_add(value, std::memory_order_relaxed);
+                uint64_t old_max = max.load(std::memory_order_relaxed);
+                while (value > old_max && !max.compare_exchange_weak(old_max, value, std::memory_order_relaxed));
+            }
+
+        uint64_t GetCount() const { return count.load(std::memory_order_relaxed); }
+        uint64_t GetSum() const { return sum.load(std::memory_order_relaxed); }
+        uint64_t GetMax() const { return max.load(std::memory_order_relaxed); }
+        uint64_t GetBucket(size_t bucket) const { return buckets[bucket].load(std::memory_order_relaxed); }
+        static uint64_t BucketLimit(size_t bucket) { return bucket == 0 ? 0 : (uint64_t{1} << bucket) - 1; }
+
+        uint64_t Percentile(double p) const;
+        std::string Summary() const;
+
+    protected:
+        std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+        std::atomic<uint64_t> count{0}, sum{0}, max{0};
+    };
+};
+
+#endif
@@ -1,39 +1,348 @@
 #include "Log.hh"
 
 #include <iostream>
-#include <sstream>
 #include <chrono>
-#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <syslog.h>
 
 using namespace dooragent;
 using namespace std;
 
-void Log::Add(LogLevel level, string text)
+namespace
 {
-    stringstream line;
+    // must be a power of two
+    constexpr size_t ring_size = 1024;
 
-    auto now = chrono::system_clock::now();
-    auto now_time_t = chrono::system_clock::to_time_t(now);
+    Log::record ring[ring_size];
+    atomic<size_t> enqueue_pos{0};
+    size_t dequeue_pos = 0;
+    atomic<bool> ring_init{false};
 
-    line << put_time(localtime(&now_time_t), "%T") << " ";
+    thread writer;
+    mutex writer_mutex;
+    condition_variable writer_cv;
+    atomic<bool> writer_running{false};
+    atomic<bool> writer_waiting{false};
+    atomic<bool> writer_stop{false};
 
-    switch (level)
+    atomic<bool> out_stdout{true};
+    // only touched by whoever drains the ring, SetFile and SetSyslog leave
+    // their changes here for the writer under writer_mutex
+    bool out_syslog = false;
+    FILE *out_file = nullptr;
+    bool pending_file = false;
+    FILE *pending_file_ptr = nullptr;
+    bool pending_syslog = false;
+    bool pending_syslog_enable = false;
+
+    // with writer_mutex held
+    void apply_pending()
+    {
+        if (pending_file)
+        {
+            if (out_file != nullptr)
+                fclose(out_file);
+            out_file = pending_file_ptr;
+            pending_file = false;
+            pending_file_ptr = nullptr;
+        }
+        if (pending_syslog)
+        {
+            if (pending_syslog_enable && !out_syslog)
+                openlog("door-agent", LOG_PID, LOG_DAEMON);
+            else if (!pending_syslog_enable && out_syslog)
+                closelog();
+            out_syslog = pending_syslog_enable;
+            pending_syslog = false;
+        }
+    }
+
+    void init_ring()
+    {
+        for (size_t i = 0; i < ring_size; i++)
+            ring[i].sequence.store(i, memory_order_relaxed);
+        ring_init.store(true, memory_order_release);
+    }
+
+    // localtime_r is only called once per second of log output
+    time_t last_second = 0;
+    char last_stamp[16];
+
+    void format_record(const Log::record& rec, string& out)
+    {
+        time_t second = rec.time / 1000000000;
+        if (second != last_second)
+        {
+            struct tm tm_local;
+            localtime_r(&second, &tm_local);
+            strftime(last_stamp, sizeof(last_stamp), "%T", &tm_local);
+            last_second = second;
+        }
+        out += last_stamp;
+
+        switch (rec.level)
+        {
+        case LogLevel::Trace:
+            out += " [TT] ";
+            break;
+        case LogLevel::Message:
+            out += " [MM] ";
+            break;
+        case LogLevel::Warning:
+            out += " [WW] ";
+            break;
+        case LogLevel::Error:
+            out += " [EE] ";
+            break;
+        }
+
+        out.append(rec.text, rec.length);
+        out += '\n';
+    }
+
+    void write_syslog(const Log::record& rec)
+    {
+        int priority = LOG_INFO;
+        switch (rec.level)
+        {
+        case LogLevel::Trace:
+            priority = LOG_DEBUG;
+            break;
+        case LogLevel::Message:
+            priority = LOG_INFO;
+            break;
+        case LogLevel::Warning:
+            priority = LOG_WARNING;
+            break;
+        case LogLevel::Error:
+            priority = LOG_ERR;
+            break;
+        }
+        syslog(priority, "%.*s", (int)rec.length, rec.text);
+    }
+
+    void write_batch(const string& batch)
+    {
+        if (batch.empty())
+            return;
+        if (out_stdout)
+        {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+        if (out_file != nullptr)
+        {
+            fwrite(batch.data(), 1, batch.size(), out_file);
+            fflush(out_file);
+        }
+    }
+
+    // consumer side of the ring, only ever run by one thread at a time
+    bool drain(string& batch)
+    {
+        bool any = false;
+        while (true)
+        {
+            auto& rec = ring[dequeue_pos & (ring_size - 1)];
+            if (rec.sequence.load(memory_order_acquire) != dequeue_pos + 1)
+                break;
+
+            format_record(rec, batch);
+            if (out_syslog)
+                write_syslog(rec);
+
+            rec.sequence.store(dequeue_pos + ring_size, memory_order_release);
+            dequeue_pos++;
+            any = true;
+        }
+        return any;
+    }
+
+    void writer_main()
+    {
+        string batch;
+        unsigned long dropped_reported = 0;
+
+        while (true)
+        {
+            batch.clear();
+            drain(batch);
+
+            unsigned long dropped = Log::GetDropped();
+            if (dropped != dropped_reported)
+            {
+                batch += string{last_stamp} + " [WW] Log: " + to_string(dropped - dropped_reported) + " records dropped\n";
+                dropped_reported = dropped;
+            }
+            write_batch(batch);
+
+            unique_lock<mutex> lock(writer_mutex);
+            apply_pending();
+            writer_waiting.store(true);
+            auto& next = ring[dequeue_pos & (ring_size - 1)];
+            if (next.sequence.load() == dequeue_pos + 1)
+            {
+                writer_waiting.store(false);
+                continue;
+            }
+            if (writer_stop.load())
+                break;
+            if (pending_file || pending_syslog)
+            {
+                writer_waiting.store(false);
+                continue;
+            }
+            writer_cv.wait_for(lock, 1s);
+            writer_waiting.store(false);
+        }
+    }
+};
+
+atomic<LogLevel> Log::min_level{LogLevel::Trace};
+atomic<unsigned long> Log::dropped{0};
+
+Log::record *Log::Reserve(size_t& pos)
+{
+    if (!ring_init.load(memory_order_acquire))
+        init_ring();
+
+    pos = enqueue_pos.load(memory_order_relaxed);
+    while (true)
     {
-    case LogLevel::Trace:
-        line << "[TT]";
-        break;
-    case LogLevel::Message:
-        line << "[MM]";
-        break;
-    case LogLevel::Warning:
-        line << "[WW]";
-        break;
-    case LogLevel::Error:
-        line << "[EE]";
-        break;
+        auto& rec = ring[pos & (ring_size - 1)];
+        size_t seq = rec.sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+            {
+                rec.time = chrono::duration_cast<chrono::nanoseconds>(
+                    chrono::system_clock::now().time_since_epoch()).count();
+                return &rec;
+            }
+        }
+        else if (diff < 0)
+        {
+            // ring full, the writer can't keep up
+            dropped.fetch_add(1, memory_order_relaxed);
+            return nullptr;
+        }
+        else
+        {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
     }
+}
+
+void Log::Commit(record *rec, size_t pos)
+{
+    rec->sequence.store(pos + 1);
+
+    if (writer_running.load(memory_order_relaxed))
+    {
+        // only the first record after the writer went idle takes the lock
+        if (writer_waiting.load())
+        {
+            lock_guard<mutex> lock(writer_mutex);
+            writer_cv.notify_one();
+        }
+    }
+    else
+    {
+        // no writer thread (yet), write synchronously
+        string batch;
+        drain(batch);
+        write_batch(batch);
+    }
+}
 
-    line << " " << text;
+void Log::SetLevel(LogLevel level)
+{
+    min_level.store(level, memory_order_relaxed);
+}
+
+bool Log::SetLevel(const string& name)
+{
+    if (name == "trace")
+        SetLevel(LogLevel::Trace);
+    else if (name == "message")
+        SetLevel(LogLevel::Message);
+    else if (name == "warning")
+        SetLevel(LogLevel::Warning);
+    else if (name == "error")
+        SetLevel(LogLevel::Error);
+    else
+        return false;
+    return true;
+}
+
+void Log::SetStdout(bool enable)
+{
+    out_stdout = enable;
+}
+
+// The writer may be in the middle of a batch, so the new file or syslog
+// setting is handed over and applied between batches.
+bool Log::SetFile(const string& path)
+{
+    FILE *file = fopen(path.c_str(), "a");
+    if (file == nullptr)
+        return false;
+
+    lock_guard<mutex> lock(writer_mutex);
+    if (pending_file_ptr != nullptr)
+        fclose(pending_file_ptr);
+    pending_file = true;
+    pending_file_ptr = file;
+    if (writer_running.load())
+        writer_cv.notify_one();
+    else
+        apply_pending();
+    return true;
+}
+
+void Log::SetSyslog(bool enable)
+{
+    lock_guard<mutex> lock(writer_mutex);
+    pending_syslog = true;
+    pending_syslog_enable = enable;
+    if (writer_running.load())
+        writer_cv.notify_one();
+    else
+        apply_pending();
+}
+
+void Log::Start()
+{
+    if (writer_running.load())
+        return;
+    writer_stop.store(false);
+    writer_running.store(true);
+    writer = thread{writer_main};
+}
+
+void Log::Stop()
+{
+    if (!writer_running.load())
+        return;
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        writer_stop.store(true);
+        writer_cv.notify_one();
+    }
+    writer.join();
+    writer_running.store(false);
+    {
+        lock_guard<mutex> lock(writer_mutex);
+        apply_pending();
+    }
 
-    cout << line.str() << endl;
+    // anything committed while the writer was shutting down
+    string batch;
+    drain(batch);
+    write_batch(batch);
 }
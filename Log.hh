@@ -2,6 +2,12 @@
 #define _LOG_HH
 
 #include <string>
+#include <string_view>
+#include <atomic>
+#include <charconv>
+#include <type_traits>
+#include <cstdint>
+#include <algorithm>
 
 namespace dooragent
 {
@@ -13,31 +19,119 @@ namespace dooragent
         Error
     };
 
+    // Log calls take any number of strings and numbers. The level is
+    // checked before anything is formatted, and the pieces are copied
+    // straight into a slot of a lock-free ring buffer. A background
+    // thread drains the ring, adds timestamps and does batched writes
+    // to stdout, a file and/or syslog.
     class Log
     {
     public:
-        static void Trace(std::string text)
+        template<typename... Args>
+        static void Trace(const Args&... args)
             {
-                Add(LogLevel::Trace, text);
+                if (Enabled(LogLevel::Trace))
+                    Add(LogLevel::Trace, args...);
             }
 
-        static void Message(std::string text)
+        template<typename... Args>
+        static void Message(const Args&... args)
             {
-                Add(LogLevel::Message, text);
+                if (Enabled(LogLevel::Message))
+                    Add(LogLevel::Message, args...);
             }
 
-        static void Warning(std::string text)
+        template<typename... Args>
+        static void Warning(const Args&... args)
             {
-                Add(LogLevel::Warning, text);
+                if (Enabled(LogLevel::Warning))
+                    Add(LogLevel::Warning, args...);
             }
 
-        static void Error(std::string text)
+        template<typename... Args>
+        static void Error(const Args&... args)
             {
-                Add(LogLevel::Error, text);
+                if (Enabled(LogLevel::Error))
+                    Add(LogLevel::Error, args...);
             }
 
+        static bool Enabled(LogLevel level)
+            {
+                return level >= min_level.load(std::memory_order_relaxed);
+            }
+
+        static void SetLevel(LogLevel level);
+        static bool SetLevel(const std::string& name);
+        static void SetStdout(bool enable);
+        static bool SetFile(const std::string& path);
+        static void SetSyslog(bool enable);
+
+        static void Start();
+        static void Stop();
+
+        static unsigned long GetDropped() { return dropped.load(std::memory_order_relaxed); }
+
+        static constexpr size_t text_size = 232;
+
+        struct record
+        {
+            std::atomic<size_t> sequence;
+            int64_t time;
+            LogLevel level;
+            uint16_t length;
+            char text[text_size];
+        };
+
     protected:
-        static void Add(LogLevel level, std::string text);
+        template<typename... Args>
+        static void Add(LogLevel level, const Args&... args)
+            {
+                size_t pos;
+                record *rec = Reserve(pos);
+                if (rec == nullptr)
+                    return;
+                rec->level = level;
+                size_t length = 0;
+                (Append(rec->text, length, args), ...);
+                rec->length = length;
+                Commit(rec, pos);
+            }
+
+        static void Append(char *text, size_t& length, std::string_view part)
+            {
+                size_t n = std::min(part.size(), text_size - length);
+                part.copy(text + length, n);
+                length += n;
+            }
+
+        static void Append(char *text, size_t& length, const char *part)
+            {
+                Append(text, length, std::string_view{part});
+            }
+
+        static void Append(char *text, size_t& length, const std::string& part)
+            {
+                Append(text, length, std::string_view{part});
+            }
+
+        static void Append(char *text, size_t& length, bool value)
+            {
+                Append(text, length, value ? "1" : "0");
+            }
+
+        template<typename T>
+        static std::enable_if_t<std::is_arithmetic_v<T> && !std::is_same_v<T, bool>> Append(char *text, size_t& length, T value)
+            {
+                auto result = std::to_chars(text + length, text + text_size, value);
+                if (result.ec == std::errc{})
+                    length = result.ptr - text;
+            }
+
+        static record *Reserve(size_t& pos);
+        static void Commit(record *rec, size_t pos);
+
+        static std::atomic<LogLevel> min_level;
+        static std::atomic<unsigned long> dropped;
     };
 };
 
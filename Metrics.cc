@@ -0,0 +1,133 @@
+#include "Metrics.hh"
+#include <sstream>
+#include <json/json.h>
+
+using namespace dooragent;
+using namespace std;
+
+Metrics& Metrics::Get()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::series& Metrics::Find(const string& name, const string& help, const string& labels, bool histogram)
+{
+    auto& fam = families[name];
+    if (fam.members.empty())
+    {
+        fam.help = help;
+        fam.histogram = histogram;
+    }
+    for (auto& s: fam.members)
+    {
+        if (s.labels == labels)
+            return s;
+    }
+
+    auto& s = fam.members.emplace_back();
+    s.labels = labels;
+    s.counter = nullptr;
+    s.histogram = nullptr;
+    if (histogram)
+        s.histogram = &histograms.emplace_back();
+    else
+        s.counter = &counters.emplace_back();
+    return s;
+}
+
+Metrics::Counter& Metrics::AddCounter(const string& name, const string& help, const string& labels)
+{
+    lock_guard<mutex> guard{lock};
+    return *Find(name, help, labels, false).counter;
+}
+
+Histogram& Metrics::AddHistogram(const string& name, const string& help, const string& labels)
+{
+    lock_guard<mutex> guard{lock};
+    return *Find(name, help, labels, true).histogram;
+}
+
+// Text exposition format 0.0.4. Histogram buckets are the log2 buckets,
+// cumulative, up to the highest one that has anything in it.
+string Metrics::Prometheus() const
+{
+    lock_guard<mutex> guard{lock};
+    ostringstream out;
+
+    for (auto& [name, fam]: families)
+    {
+        string full_name = "dooragent_" + name;
+        out << "# HELP " << full_name << " " << fam.help << "\n";
+        out << "# TYPE " << full_name << (fam.histogram ? " histogram\n" : " counter\n");
+
+        for (auto& s: fam.members)
+        {
+            string sep = s.labels.empty() ? "" : ",";
+            if (!fam.histogram)
+            {
+                out << full_name;
+                if (!s.labels.empty())
+                    out << "{" << s.labels << "}";
+                out << " " << s.counter->Get() << "\n";
+                continue;
+            }
+
+            auto& hist = *s.histogram;
+            size_t top = 0;
+            for (size_t i = 0; i < Histogram::bucket_count; i++)
+            {
+                if (hist.GetBucket(i) > 0)
+                    top = i;
+            }
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i <= top; i++)
+            {
+                cumulative += hist.GetBucket(i);
+                out << full_name << "_bucket{" << s.labels << sep << "le=\"" << Histogram::BucketLimit(i) << "\"} " << cumulative << "\n";
+            }
+            out << full_name << "_bucket{" << s.labels << sep << "le=\"+Inf\"} " << hist.GetCount() << "\n";
+            out << full_name << "_sum" << (s.labels.empty() ? "" : "{" + s.labels + "}") << " " << hist.GetSum() << "\n";
+            out << full_name << "_count" << (s.labels.empty() ? "" : "{" + s.labels + "}") << " " << hist.GetCount() << "\n";
+        }
+    }
+    return out.str();
+}
+
+// Compact form for MQTT: counters as numbers, histograms as summaries,
+// labelled series keyed by their label string.
+string Metrics::Json() const
+{
+    lock_guard<mutex> guard{lock};
+    Json::Value root(Json::objectValue);
+
+    for (auto& [name, fam]: families)
+    {
+        for (auto& s: fam.members)
+        {
+            Json::Value value;
+            if (fam.histogram)
+            {
+                auto& hist = *s.histogram;
+                value["count"] = Json::UInt64(hist.GetCount());
+                value["sum"] = Json::UInt64(hist.GetSum());
+                value["max"] = Json::UInt64(hist.GetMax());
+                value["p50"] = Json::UInt64(hist.Percentile(0.5));
+                value["p99"] = Json::UInt64(hist.Percentile(0.99));
+            }
+            else
+            {
+                value = Json::UInt64(s.counter->Get());
+            }
+
+            if (s.labels.empty())
+                root[name] = value;
+            else
+                root[name][s.labels] = value;
+        }
+    }
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, root);
+}
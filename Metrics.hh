@@ -0,0 +1,65 @@
+#ifndef _METRICS_HH
+#define _METRICS_HH
+
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include "Histogram.hh"
+
+namespace dooragent
+{
+    // Process-wide set of counters and histograms. Registering allocates
+    // and should happen at setup; the returned objects stay put, and
+    // updating them is just relaxed atomics, from any thread.
+    class Metrics
+    {
+    public:
+        struct Counter
+        {
+            std::atomic<uint64_t> value{0};
+
+            void Add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+            uint64_t Get() const { return value.load(std::memory_order_relaxed); }
+        };
+
+        static Metrics& Get();
+
+        // labels are preformatted, e.g. door="1",result="accepted";
+        // registering the same name and labels again returns the same object
+        Counter& AddCounter(const std::string& name, const std::string& help, const std::string& labels = "");
+        Histogram& AddHistogram(const std::string& name, const std::string& help, const std::string& labels = "");
+
+        std::string Prometheus() const;
+        std::string Json() const;
+
+    protected:
+        Metrics() = default;
+
+        struct series
+        {
+            std::string labels;
+            Counter *counter;
+            Histogram *histogram;
+        };
+
+        struct family
+        {
+            std::string help;
+            bool histogram;
+            std::vector<series> members;
+        };
+
+        series& Find(const std::string& name, const std::string& help, const std::string& labels, bool histogram);
+
+        mutable std::mutex lock;
+        std::map<std::string, family> families;
+        std::deque<Counter> counters;
+        std::deque<Histogram> histograms;
+    };
+};
+
+#endif
@@ -0,0 +1,67 @@
+#include "MetricsServer.hh"
+#include "Metrics.hh"
+#include "Log.hh"
+#include <cstring>
+
+using namespace dooragent;
+using namespace std;
+
+MetricsServer::MetricsServer(shared_ptr<uvw::Loop> loop)
+    :loop(loop)
+{
+
+}
+
+bool MetricsServer::Listen(const string& address, int port)
+{
+    server = loop->resource<uvw::TCPHandle>();
+    if (!server)
+        return false;
+
+    server->on<uvw::ErrorEvent>([](uvw::ErrorEvent& event, uvw::TCPHandle& handle)
+        {
+            Log::Error("Metrics: ", event.what());
+            handle.close();
+        });
+
+    server->on<uvw::ListenEvent>([this](uvw::ListenEvent&, uvw::TCPHandle& srv)
+        {
+            auto client = loop->resource<uvw::TCPHandle>();
+            client->on<uvw::ErrorEvent>([](uvw::ErrorEvent&, uvw::TCPHandle& handle)
+                {
+                    handle.close();
+                });
+            client->on<uvw::EndEvent>([](uvw::EndEvent&, uvw::TCPHandle& handle)
+                {
+                    handle.close();
+                });
+            // whatever the request was, one response and done
+            client->once<uvw::DataEvent>([this](uvw::DataEvent&, uvw::TCPHandle& handle)
+                {
+                    Respond(handle);
+                });
+            client->once<uvw::WriteEvent>([](uvw::WriteEvent&, uvw::TCPHandle& handle)
+                {
+                    handle.close();
+                });
+            srv.accept(*client);
+            client->read();
+        });
+
+    server->bind(address, port);
+    server->listen();
+    Log::Message("Metrics: listening on ", address, ":", port);
+    return true;
+}
+
+void MetricsServer::Respond(uvw::TCPHandle& client)
+{
+    string body = Metrics::Get().Prometheus();
+    string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+        to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+
+    auto data = make_unique<char[]>(response.size());
+    memcpy(data.get(), response.data(), response.size());
+    client.stop();
+    client.write(move(data), response.size());
+}
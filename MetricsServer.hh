@@ -0,0 +1,28 @@
+#ifndef _METRICSSERVER_HH
+#define _METRICSSERVER_HH
+
+#include <string>
+#include <memory>
+#include <uvw.hpp>
+
+namespace dooragent
+{
+    // Minimal HTTP endpoint for Prometheus scrapes, served from the loop:
+    // every request gets the current metrics text and the connection is
+    // closed once it's written.
+    class MetricsServer
+    {
+    public:
+        MetricsServer(std::shared_ptr<uvw::Loop> loop);
+
+        bool Listen(const std::string& address, int port);
+
+    protected:
+        void Respond(uvw::TCPHandle& client);
+
+        std::shared_ptr<uvw::Loop> loop;
+        std::shared_ptr<uvw::TCPHandle> server;
+    };
+};
+
+#endif
@@ -6,54 +6,416 @@ using namespace dooragent;
 using namespace std;
 using namespace std::chrono;
 
-MqttClient::MqttClient()
+MqttClient::MqttClient(const string& metric_labels)
+    :broker_port(1883), keepalive(10),
+     current(0), connected_broker(0), standby_index(0), failback(true), failing_back(false),
+     failback_delay(30s), connect_timeout(5s), poll_writable(false),
+     connected(false), reconnect_pending(false), stopping(false), reconnect_attempt(0),
+     reconnect_delay_min(1s), reconnect_delay_max(60s), reconnect_rng(random_device{}()),
+     will_retain(false), last_reconnect_time(0), connect_count(0), failover_count(0), max_inflight(8),
+     poll_time(Metrics::Get().AddHistogram("mqtt_poll_us", "Duration of MqttClient::Poll()", metric_labels)),
+     dispatch_time(Metrics::Get().AddHistogram("mqtt_dispatch_us", "Time spent in message handlers per message", metric_labels)),
+     ack_latency(Metrics::Get().AddHistogram("mqtt_ack_ms", "Time from publish to PUBACK", metric_labels)),
+     queue_wait(Metrics::Get().AddHistogram("mqtt_queue_ms", "Time a message waited in the outbound queue", metric_labels)),
+     failover_time(Metrics::Get().AddHistogram("mqtt_failover_ms", "Time from losing a broker until connected to another one", metric_labels)),
+     published(Metrics::Get().AddCounter("mqtt_published_total", "Messages published", metric_labels)),
+     received(Metrics::Get().AddCounter("mqtt_received_total", "Messages received", metric_labels)),
+     failovers(Metrics::Get().AddCounter("mqtt_failovers_total", "Connections that came up on a different broker", metric_labels))
 {
 
 }
 
 MqttClient::~MqttClient()
 {
+    stopping = true;
+    if (connected && !will_topic.empty())
+        publish(nullptr, will_topic.c_str(), will_payload.size(), will_payload.c_str(), 1, will_retain);
     disconnect();
-    Poll();
+    loop_write();
 }
 
+bool MqttClient::Attach(shared_ptr<uvw::Loop> loop)
+{
+    this->loop = loop;
+
+    // loop_misc() only sends a PINGREQ once a full keepalive has passed
+    // since the last packet out, run once per keepalive the ping could go
+    // out almost a keepalive late and the broker drops us at 1.5x
+    misc_timer = loop->resource<uvw::TimerHandle>();
+    misc_timer->on<uvw::TimerEvent>([this](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            if (socket_poll)
+            {
+                loop_misc();
+                if (socket() < 0)
+                    ConnectionLost();
+                else if (!CheckInbound())
+                    return;
+                else
+                    UpdateInterest();
+            }
+            CheckFailback();
+        });
+    misc_timer->start(1s, 1s);
+
+    reconnect_timer = loop->resource<uvw::TimerHandle>();
+    reconnect_timer->on<uvw::TimerEvent>([this](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            reconnect_pending = false;
+            StartConnect();
+        });
+
+    // a broker that takes the TCP connection but never answers
+    connect_timer = loop->resource<uvw::TimerHandle>();
+    connect_timer->on<uvw::TimerEvent>([this](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            if (connected || reconnect_pending)
+                return;
+            Log::Warning("MQTT: no answer from ", broker_host, " within ", connect_timeout.count(), " s");
+            if (socket_poll)
+            {
+                socket_poll->close();
+                socket_poll.reset();
+            }
+            if (!stopping)
+                ScheduleReconnect();
+        });
+
+    return true;
+}
+
+// Starts a non-blocking connection, the session is up once on_connect
+// reports the CONNACK. Failures are retried with backoff from the loop.
 bool MqttClient::Connect(std::string host, int port)
 {
-    Log::Message("MQTT: connecting to " + host);
-    int result = connect(host.c_str(), port, 10);
+    brokers = {{host, port}};
+    SelectBroker(0);
+    disconnected_at = steady_clock::now();
+    return StartConnect();
+}
+
+bool MqttClient::Connect(const vector<string>& hosts)
+{
+    brokers.clear();
+    for (auto& host: hosts)
+    {
+        auto colon = host.rfind(':');
+        if (colon != string::npos && colon + 1 < host.size() &&
+            host.find_first_not_of("0123456789", colon + 1) == string::npos)
+            brokers.push_back({host.substr(0, colon), stoi(host.substr(colon + 1))});
+        else
+            brokers.push_back({host, 1883});
+    }
+    if (brokers.empty())
+    {
+        Log::Error("MQTT: no broker configured");
+        return false;
+    }
+    SelectBroker(0);
+    connected_broker = 0;
+    disconnected_at = steady_clock::now();
+    UpdateStandby();
+    return StartConnect();
+}
+
+void MqttClient::SetFailback(bool enabled, seconds delay)
+{
+    failback = enabled;
+    failback_delay = delay;
+}
+
+void MqttClient::SelectBroker(size_t index)
+{
+    current = index;
+    broker_host = brokers[index].host;
+    broker_port = brokers[index].port;
+}
+
+// the one the standby session says is up, otherwise the next in order;
+// failing back always means the primary
+size_t MqttClient::NextBroker() const
+{
+    if (failing_back)
+        return 0;
+    if (standby && standby->IsConnected() && standby_index != current)
+        return standby_index;
+    return (current + 1) % brokers.size();
+}
+
+// The standby watches the primary while we are elsewhere, otherwise the
+// first broker after it.
+void MqttClient::UpdateStandby()
+{
+    if (brokers.size() < 2 || !loop)
+        return;
+
+    size_t want = current != 0 ? 0 : 1;
+    if (!standby)
+    {
+        standby = make_unique<MqttClient>("role=\"standby\"");
+        standby->Attach(loop);
+    }
+    else if (want == standby_index)
+    {
+        // it keeps retrying on its own
+        return;
+    }
+    standby_index = want;
+    Log::Message("MQTT: standby session to ", brokers[want].host);
+    standby->Connect(brokers[want].host, brokers[want].port);
+}
+
+// A broker that went away without closing the connection (power loss,
+// a cable pulled) would only be noticed when TCP gives up, minutes later.
+// There is a ping at least every keepalive, so without a single inbound
+// packet for 1.5 keepalives the broker is declared dead, which bounds
+// failover to the next broker to 1.5 keepalives plus a timer tick.
+bool MqttClient::CheckInbound()
+{
+    if (!connected)
+        return true;
+    auto silent = steady_clock::now() - last_inbound;
+    if (silent < keepalive * 1500ms)
+        return true;
+
+    Log::Warning("MQTT: nothing from ", broker_host, " for ", duration_cast<milliseconds>(silent).count(),
+                 " ms, giving up on it");
+    // the next connect_async() closes the old socket
+    ConnectionLost();
+    return false;
+}
+
+void MqttClient::CheckFailback()
+{
+    if (!standby || !failback || !connected || current == 0 || standby_index != 0)
+        return;
+    if (!standby->IsConnected() || steady_clock::now() - standby->GetConnectedSince() < failback_delay)
+        return;
+
+    Log::Message("MQTT: primary ", brokers[0].host, " up for ",
+                 duration_cast<seconds>(steady_clock::now() - standby->GetConnectedSince()).count(), " s, failing back");
+    failing_back = true;
+    // on_disconnect picks the primary and reconnects right away
+    disconnect();
+}
+
+bool MqttClient::StartConnect()
+{
+    Log::Message("MQTT: connecting to " + broker_host);
+    int result = connect_async(broker_host.c_str(), broker_port, keepalive);
 
     if (result == MOSQ_ERR_SUCCESS)
     {
-        for (auto& sub: subscriptions)
-        {
-            auto& topic = sub.first;
-            Log::Trace("MQTT: (re)subscribing to " + topic);
-            subscribe(nullptr, topic.c_str(), 1);
-        }
+        AttachSocket();
+        if (connect_timer)
+            connect_timer->start(connect_timeout, 0ms);
+        return true;
     }
-    else if (result == MOSQ_ERR_INVAL)
+
+    if (result == MOSQ_ERR_INVAL)
         Log::Error("MQTT: invalid connection parameters");
     else if (result == MOSQ_ERR_ERRNO)
         Log::Error("MQTT: system error: " + string{strerror(errno)});
+    else
+        Log::Error("MQTT: connect failed: " + string{mosqpp::strerror(result)});
+
+    ScheduleReconnect();
+    return false;
+}
+
+// The socket changes with every connection attempt, the poll handle has
+// to follow it.
+void MqttClient::AttachSocket()
+{
+    if (socket_poll)
+    {
+        socket_poll->close();
+        socket_poll.reset();
+    }
+
+    int s = socket();
+    if (s < 0 || !loop)
+        return;
 
-    return (result == MOSQ_ERR_SUCCESS);
+    socket_poll = loop->resource<uvw::PollHandle>(s);
+    socket_poll->on<uvw::PollEvent>([this](uvw::PollEvent& event, uvw::PollHandle&)
+        {
+            HandlePollEvent(event);
+        });
+    UpdateInterest(true);
+    Log::Message("MQTT: polling socket " + to_string(s));
+}
+
+void MqttClient::ConnectionLost()
+{
+    if (socket_poll)
+    {
+        socket_poll->close();
+        socket_poll.reset();
+    }
+
+    if (connected)
+    {
+        connected = false;
+        disconnected_at = steady_clock::now();
+        if (failing_back)
+            Log::Message("MQTT: disconnected from ", broker_host, " to fail back");
+        else
+            Log::Error("MQTT: connection lost!");
+    }
+
+    if (!stopping && !reconnect_pending)
+        ScheduleReconnect();
+}
+
+void MqttClient::ScheduleReconnect()
+{
+    if (!reconnect_timer)
+        return;
+
+    // the other brokers are tried right away, backoff starts once all of
+    // them have failed in a row
+    int attempt = reconnect_attempt - int(brokers.size()) + 1;
+    if (brokers.size() > 1)
+        SelectBroker(NextBroker());
+    failing_back = false;
+
+    milliseconds wait{0};
+    if (attempt >= 0)
+    {
+        auto delay = min(reconnect_delay_min * (1 << min(attempt, 10)), reconnect_delay_max);
+        // half fixed, half random, so a site full of agents doesn't retry in lockstep
+        uniform_int_distribution<milliseconds::rep> jitter(0, delay.count() / 2);
+        wait = delay / 2 + milliseconds(jitter(reconnect_rng));
+    }
+    reconnect_attempt++;
+    reconnect_pending = true;
+    reconnect_timer->start(wait, 0ms);
+
+    Log::Message("MQTT: reconnecting to " + broker_host + " in " + to_string(wait.count()) + " ms (attempt " + to_string(reconnect_attempt) + ")");
+}
+
+void MqttClient::SetConnectHandler(connect_handler handler)
+{
+    on_connected = handler;
+}
+
+void MqttClient::on_connect(int rc)
+{
+    if (rc != 0)
+    {
+        Log::Error("MQTT: connection refused: " + string{mosqpp::connack_string(rc)});
+        return;
+    }
+
+    connected = true;
+    reconnect_attempt = 0;
+    connect_count++;
+    connected_at = steady_clock::now();
+    last_inbound = connected_at;
+    if (connect_timer)
+        connect_timer->stop();
+    last_reconnect_time = duration_cast<milliseconds>(connected_at - disconnected_at);
+    Log::Message("MQTT: connected to " + broker_host + " after " + to_string(last_reconnect_time.count()) + " ms");
+    if (current != connected_broker)
+    {
+        failover_count++;
+        failovers.Add();
+        failover_time.Add(last_reconnect_time.count());
+        Log::Message("MQTT: moved from ", brokers[connected_broker].host, " to ", broker_host,
+                     " in ", last_reconnect_time.count(), " ms");
+        connected_broker = current;
+    }
+    UpdateStandby();
+    // mosquitto resends what was still unacknowledged by itself, those
+    // don't count against the new session's window
+    inflight_publishes.clear();
+
+    for (auto& sub: subscriptions)
+    {
+        auto& topic = sub.first;
+        Log::Trace("MQTT: (re)subscribing to " + topic);
+        subscribe(nullptr, topic.c_str(), 1);
+    }
+
+    if (on_connected)
+        on_connected();
+
+    Drain();
+    UpdateInterest();
+}
+
+void MqttClient::on_disconnect(int rc)
+{
+    if (rc != 0)
+        Log::Warning("MQTT: disconnected: " + string{mosqpp::strerror(rc)});
+    ConnectionLost();
 }
 
 bool MqttClient::Poll()
 {
     Log::Trace("MQTT: polling");
-    int ret = loop_read();
-    if (ret == MOSQ_ERR_CONN_LOST || ret == MOSQ_ERR_NO_CONN)
+    auto start = steady_clock::now();
+    loop_read();
+    if (want_write())
+        loop_write();
+    // publishes from inside callbacks only get queued, one at a time
+    if (socket() >= 0)
+        Drain();
+    poll_time.Add(duration_cast<microseconds>(steady_clock::now() - start).count());
+    // mosquitto closes the socket on any read/write error
+    if (socket() < 0)
     {
-        Log::Error("MQTT: connection lost!");
+        ConnectionLost();
         return false;
     }
-    if (want_write())
-        loop_write();
-    loop_misc();
+    UpdateInterest();
     return true;
 }
 
+void MqttClient::HandlePollEvent(uvw::PollEvent& event)
+{
+    if (event.flags & uvw::PollHandle::Event::READABLE)
+    {
+        last_inbound = steady_clock::now();
+        if (!Poll())
+            return;
+    }
+    if (event.flags & uvw::PollHandle::Event::WRITABLE)
+    {
+        loop_write();
+        if (socket() < 0)
+        {
+            ConnectionLost();
+            return;
+        }
+        Drain();
+        UpdateInterest();
+    }
+    if (event.flags & uvw::PollHandle::Event::DISCONNECT)
+    {
+        Log::Message("MQTT: disconnect event");
+    }
+}
+
+// Packets queued from inside a callback (or that didn't fit in the socket
+// buffer) are left for later, watch for writability only while they wait.
+void MqttClient::UpdateInterest(bool force)
+{
+    if (!socket_poll)
+        return;
+
+    bool writable = want_write();
+    if (!force && writable == poll_writable)
+        return;
+
+    auto flags = uvw::Flags(uvw::PollHandle::Event::READABLE) | uvw::Flags(uvw::PollHandle::Event::DISCONNECT);
+    if (writable)
+        flags = flags | uvw::PollHandle::Event::WRITABLE;
+    socket_poll->start(flags);
+    poll_writable = writable;
+}
+
 int MqttClient::GetSocket()
 {
     return socket();
@@ -61,23 +423,73 @@ int MqttClient::GetSocket()
 
 void MqttClient::SubscribeTopic(std::string topic)
 {
-    subscribe(nullptr, topic.c_str(), 1);
+    // otherwise on_connect subscribes once the session is up
+    if (connected)
+        subscribe(nullptr, topic.c_str(), 1);
+    UpdateInterest();
     subscriptions[topic].topic = topic;
     Log::Message("MQTT: subscribed to " + topic);
 }
 
 void MqttClient::SubscribeTopic(std::string topic, topic_handler handler)
 {
-    subscribe(nullptr, topic.c_str(), 1);
+    if (connected)
+        subscribe(nullptr, topic.c_str(), 1);
+    UpdateInterest();
     subscriptions[topic].topic = topic;
     subscriptions[topic].handler = handler;
+    router.Add(topic, handler);
     Log::Message("MQTT: subscribed to " + topic + " with handler function");
 }
 
-void MqttClient::PublishTopic(std::string topic, std::string payload, bool retain)
+void MqttClient::SetWill(std::string topic, std::string payload, bool retain)
 {
-    publish(nullptr, topic.c_str(), payload.size(), payload.c_str(), 1, retain);
-    Log::Trace("MQTT: published " + topic + "=" + payload + (retain ? "[r]" : ""));
+    will_topic = topic;
+    will_payload = payload;
+    will_retain = retain;
+    if (will_set(will_topic.c_str(), will_payload.size(), will_payload.c_str(), 1, retain) != MOSQ_ERR_SUCCESS)
+        Log::Error("MQTT: can't set last will on " + will_topic);
+}
+
+void MqttClient::PublishTopic(const std::string& topic, std::string_view payload, bool retain, OutboundQueue::Class cls)
+{
+    queue.Push(cls, topic, payload, retain);
+    Log::Trace("MQTT: queued ", topic, "=", payload, retain ? "[r]" : "");
+    Drain();
+    UpdateInterest();
+}
+
+// A stalled broker shows up as unacknowledged publishes or a socket that
+// doesn't take more data; either way the rest stays in our bounded queue
+// instead of piling up in mosquitto's.
+void MqttClient::Drain()
+{
+    OutboundQueue::message msg;
+    while (connected && inflight_publishes.size() < max_inflight && !want_write() && queue.Pop(msg))
+    {
+        int mid;
+        int qos = queue.GetQos(msg.cls);
+        int result = publish(&mid, msg.topic.c_str(), msg.payload.size(), msg.payload.data(), qos, msg.retain);
+        if (result == MOSQ_ERR_NO_CONN || result == MOSQ_ERR_NOMEM)
+        {
+            // nothing else will go through either, try again on the next drain
+            Log::Warning("MQTT: publishing ", msg.topic, " failed: ", mosqpp::strerror(result));
+            queue.Requeue(move(msg));
+            break;
+        }
+        if (result != MOSQ_ERR_SUCCESS)
+        {
+            // this message itself is bad, retrying won't help
+            Log::Warning("MQTT: dropping ", msg.topic, ", publish failed: ", mosqpp::strerror(result));
+            continue;
+        }
+        auto now = steady_clock::now();
+        if (qos > 0)
+            inflight_publishes[mid] = now;
+        queue_wait.Add(duration_cast<milliseconds>(now - msg.queued).count());
+        published.Add();
+        Log::Trace("MQTT: published ", msg.topic, " qos ", qos);
+    }
 }
 
 std::optional<std::string> MqttClient::GetTopicValue(std::string topic) const
@@ -99,22 +511,36 @@ void MqttClient::on_message(const struct mosquitto_message *message)
 {
     if (message->topic != nullptr && message->payload != nullptr)
     {
-        std::string topic{message->topic};
-        std::string payload{(const char*)message->payload, (size_t)message->payloadlen};
-        Log::Trace("MQTT: message: " + topic + "=" + payload);
-        auto sub_iter = subscriptions.find(topic);
+        string_view topic{message->topic};
+        string_view payload{(const char*)message->payload, (size_t)message->payloadlen};
+        Log::Trace("MQTT: message: ", topic, "=", payload);
 
-        if (sub_iter != subscriptions.end())
+        // plain subscriptions without a handler keep the last value around
+        // for GetTopicValue
+        auto sub_iter = subscriptions.find(topic);
+        if (sub_iter != subscriptions.end() && !sub_iter->second.handler)
         {
             auto& sub = sub_iter->second;
-            sub.value = payload;
+            sub.value = string{payload};
             sub.received = steady_clock::now();
-
-            if (sub.handler)
-            {
-                Log::Trace("MQTT: Calling handler");
-                sub.handler(topic, payload);
-            }
         }
+
+        received.Add();
+        auto start = steady_clock::now();
+        size_t handled = router.Dispatch(topic, payload);
+        dispatch_time.Add(duration_cast<microseconds>(steady_clock::now() - start).count());
+        if (handled > 0)
+            Log::Trace("MQTT: called ", handled, " handlers");
     }
 }
+
+// QoS 0 publishes report here too, once written, but were never inflight
+void MqttClient::on_publish(int mid)
+{
+    auto iter = inflight_publishes.find(mid);
+    if (iter == inflight_publishes.end())
+        return;
+    ack_latency.Add(duration_cast<milliseconds>(steady_clock::now() - iter->second).count());
+    inflight_publishes.erase(iter);
+    Drain();
+}
@@ -3,31 +3,72 @@
 
 #include <mosquittopp.h>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <map>
 #include <functional>
 #include <chrono>
+#include <memory>
+#include <random>
+#include <array>
+#include <vector>
+#include <uvw.hpp>
+#include "TopicRouter.hh"
+#include "Metrics.hh"
+#include "OutboundQueue.hh"
 
 namespace dooragent
 {
+    // With more than one broker, a lost connection (or one that doesn't
+    // come up within the connect timeout) moves on to the next broker right
+    // away; backoff only starts once every broker has failed in a row. A
+    // second, probe-only client keeps a session with the broker we would
+    // go to next, the primary while running on another one, so failover
+    // prefers a broker known to be up and failback waits until the primary
+    // has been stable for a while. A broker counts as gone after 1.5
+    // keepalives without any inbound packet, on both clients.
     class MqttClient : public mosqpp::mosquittopp
     {
-        using topic_handler = std::function<void(std::string,std::string)>;
+        using topic_handler = TopicRouter::handler;
+        using connect_handler = std::function<void()>;
 
     public:
-        MqttClient();
+        MqttClient(const std::string& metric_labels = "");
         ~MqttClient();
 
+        bool Attach(std::shared_ptr<uvw::Loop> loop);
         bool Connect(std::string host, int port = 1883);
+        // "host" or "host:port", in order of preference
+        bool Connect(const std::vector<std::string>& hosts);
+        void SetFailback(bool enabled, std::chrono::seconds delay);
+        void SetConnectTimeout(std::chrono::seconds timeout) { connect_timeout = timeout; }
         bool Poll();
         int GetSocket();
+        bool IsConnected() const { return connected; }
+
+        void SetConnectHandler(connect_handler handler);
+        // last will, before Connect; also sent on a clean disconnect
+        void SetWill(std::string topic, std::string payload, bool retain = true);
+        std::chrono::milliseconds GetLastReconnectTime() const { return last_reconnect_time; }
+        unsigned long GetConnectCount() const { return connect_count; }
+        const std::string& GetBrokerHost() const { return broker_host; }
+        unsigned long GetFailoverCount() const { return failover_count; }
+        std::chrono::steady_clock::time_point GetConnectedSince() const { return connected_at; }
 
         void SubscribeTopic(std::string topic);
         void SubscribeTopic(std::string topic, topic_handler);
-        void PublishTopic(std::string topic, std::string payload, bool retain = false);
+        // queued, and handed to mosquitto while the socket keeps up and
+        // fewer than the inflight limit wait for their acknowledgement
+        void PublishTopic(const std::string& topic, std::string_view payload, bool retain = false,
+                          OutboundQueue::Class cls = OutboundQueue::ClassEvent);
+        OutboundQueue& GetQueue() { return queue; }
+        void SetMaxInflight(size_t n) { max_inflight = n; }
         std::optional<std::string> GetTopicValue(std::string topic) const;
 
+        void on_connect(int rc);
+        void on_disconnect(int rc);
         void on_message(const struct mosquitto_message *message);
+        void on_publish(int mid);
 
         struct subscription
         {
@@ -38,8 +79,60 @@ namespace dooragent
         };
 
     protected:
-        std::map<std::string, subscription> subscriptions;
+        bool StartConnect();
+        void AttachSocket();
+        void ConnectionLost();
+        void ScheduleReconnect();
+        void HandlePollEvent(uvw::PollEvent& event);
+        void UpdateInterest(bool force = false);
+        void Drain();
+        void SelectBroker(size_t index);
+        size_t NextBroker() const;
+        void UpdateStandby();
+        bool CheckInbound();
+        void CheckFailback();
+
+        std::map<std::string, subscription, std::less<>> subscriptions;
+        TopicRouter router;
+        std::string broker_host;
+        int broker_port;
+        int keepalive;
+
+        struct broker
+        {
+            std::string host;
+            int port;
+        };
+        std::vector<broker> brokers;
+        size_t current, connected_broker, standby_index;
+        std::unique_ptr<MqttClient> standby;
+        bool failback, failing_back;
+        std::chrono::seconds failback_delay, connect_timeout;
+
+        std::shared_ptr<uvw::Loop> loop;
+        std::shared_ptr<uvw::PollHandle> socket_poll;
+        std::shared_ptr<uvw::TimerHandle> misc_timer, reconnect_timer, connect_timer;
+        bool poll_writable;
+
+        bool connected, reconnect_pending, stopping;
+        int reconnect_attempt;
+        std::chrono::milliseconds reconnect_delay_min, reconnect_delay_max;
+        std::minstd_rand reconnect_rng;
+        connect_handler on_connected;
+        std::string will_topic, will_payload;
+        bool will_retain;
+
+        std::chrono::steady_clock::time_point disconnected_at, connected_at, last_inbound;
+        std::chrono::milliseconds last_reconnect_time;
+        unsigned long connect_count, failover_count;
+
+        OutboundQueue queue;
+        // QoS 1 and 2 publishes waiting for their acknowledgement, by mid
+        std::map<int, std::chrono::steady_clock::time_point> inflight_publishes;
+        size_t max_inflight;
 
+        Histogram &poll_time, &dispatch_time, &ack_latency, &queue_wait, &failover_time;
+        Metrics::Counter &published, &received, &failovers;
     };
 
 };
@@ -0,0 +1,141 @@
+#include "OutboundQueue.hh"
+#include "Log.hh"
+
+using namespace dooragent;
+using namespace std;
+
+OutboundQueue::OutboundQueue()
+    :max_bytes(256 * 1024), bytes(0), count(0)
+{
+    // only the latest state, discovery and metrics matter, events and
+    // flight recorder dumps are each their own message
+    SetClass(ClassState, 1, 256, true);
+    SetClass(ClassDiscovery, 1, 256, true);
+    SetClass(ClassEvent, 1, 64, false);
+    SetClass(ClassMetrics, 0, 8, true);
+    SetClass(ClassLog, 0, 4, false);
+
+    auto& metrics = Metrics::Get();
+    for (size_t cls = 0; cls < ClassCount; cls++)
+    {
+        string labels = string{"class=\""} + ClassStr((Class)cls) + "\"";
+        classes[cls].dropped = &metrics.AddCounter("mqtt_dropped_total", "Outgoing messages dropped from a full queue", labels);
+        classes[cls].replaced = &metrics.AddCounter("mqtt_replaced_total", "Queued messages replaced by a newer one on the same topic", labels);
+    }
+}
+
+void OutboundQueue::SetClass(Class cls, int qos, size_t max_messages, bool replace)
+{
+    auto& q = classes[cls];
+    q.qos = qos;
+    q.max_messages = max_messages;
+    q.replace = replace;
+}
+
+const char *OutboundQueue::ClassStr(Class cls)
+{
+    switch (cls)
+    {
+    case ClassState:
+        return "state";
+    case ClassDiscovery:
+        return "discovery";
+    case ClassEvent:
+        return "event";
+    case ClassMetrics:
+        return "metrics";
+    case ClassLog:
+        return "log";
+    default:
+        break;
+    }
+    return "unknown";
+}
+
+void OutboundQueue::DropOldest(queue& q)
+{
+    auto& oldest = q.messages.front();
+    if (q.replace)
+        q.by_topic.erase(oldest.topic);
+    bytes -= oldest.payload.size();
+    count--;
+    q.dropped->Add();
+    q.messages.pop_front();
+}
+
+void OutboundQueue::Push(Class cls, const string& topic, string_view payload, bool retain)
+{
+    auto& q = classes[cls];
+
+    if (q.replace)
+    {
+        auto iter = q.by_topic.find(topic);
+        if (iter != q.by_topic.end())
+        {
+            auto& msg = *iter->second;
+            bytes += payload.size() - msg.payload.size();
+            msg.payload.assign(payload);
+            msg.retain = retain;
+            q.replaced->Add();
+            return;
+        }
+    }
+
+    if (payload.size() > max_bytes || q.max_messages == 0)
+    {
+        Log::Warning("MQTT: dropping ", topic, ", ", payload.size(), " bytes don't fit the queue");
+        q.dropped->Add();
+        return;
+    }
+    if (q.messages.size() >= q.max_messages)
+        DropOldest(q);
+    while (bytes + payload.size() > max_bytes)
+    {
+        size_t lowest = ClassCount;
+        while (lowest > 0 && classes[lowest - 1].messages.empty())
+            lowest--;
+        // everything queued is more important than this one
+        if (lowest == 0 || lowest - 1 < cls)
+        {
+            q.dropped->Add();
+            return;
+        }
+        DropOldest(classes[lowest - 1]);
+    }
+
+    q.messages.push_back({topic, string{payload}, retain, cls, chrono::steady_clock::now()});
+    if (q.replace)
+        q.by_topic[topic] = prev(q.messages.end());
+    bytes += payload.size();
+    count++;
+}
+
+bool OutboundQueue::Pop(message& msg)
+{
+    for (auto& q: classes)
+    {
+        if (q.messages.empty())
+            continue;
+        msg = move(q.messages.front());
+        if (q.replace)
+            q.by_topic.erase(msg.topic);
+        q.messages.pop_front();
+        bytes -= msg.payload.size();
+        count--;
+        return true;
+    }
+    return false;
+}
+
+void OutboundQueue::Requeue(message&& msg)
+{
+    auto& q = classes[msg.cls];
+    if (q.replace && q.by_topic.count(msg.topic) > 0)
+        return;
+
+    bytes += msg.payload.size();
+    count++;
+    q.messages.push_front(move(msg));
+    if (q.replace)
+        q.by_topic[q.messages.front().topic] = q.messages.begin();
+}
@@ -0,0 +1,82 @@
+#ifndef _OUTBOUNDQUEUE_HH
+#define _OUTBOUNDQUEUE_HH
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <map>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include "Metrics.hh"
+
+namespace dooragent
+{
+    // Bounded store for outgoing MQTT messages, one queue per topic class
+    // in priority order. A class with replace set keeps one message per
+    // topic, a newer payload takes the place of the queued one. When a
+    // class is over its message limit its oldest message goes; when the
+    // whole queue is over its byte limit, the oldest message of the lowest
+    // class goes, but never for a message of a lower class than that.
+    class OutboundQueue
+    {
+    public:
+        enum Class : uint8_t
+        {
+            ClassState,
+            ClassDiscovery,
+            ClassEvent,
+            ClassMetrics,
+            ClassLog,
+            ClassCount
+        };
+
+        struct message
+        {
+            std::string topic, payload;
+            bool retain;
+            Class cls;
+            std::chrono::steady_clock::time_point queued;
+        };
+
+        OutboundQueue();
+
+        void SetClass(Class cls, int qos, size_t max_messages, bool replace);
+        void SetMaxBytes(size_t bytes) { max_bytes = bytes; }
+        int GetQos(Class cls) const { return classes[cls].qos; }
+        size_t GetLimit(Class cls) const { return classes[cls].max_messages; }
+        bool GetReplace(Class cls) const { return classes[cls].replace; }
+
+        void Push(Class cls, const std::string& topic, std::string_view payload, bool retain);
+        // highest class first, oldest first within a class
+        bool Pop(message& msg);
+        // puts a popped message back at the head of its class, unless a
+        // newer one for its topic was queued in the meantime
+        void Requeue(message&& msg);
+
+        bool Empty() const { return count == 0; }
+        size_t Size() const { return count; }
+        size_t GetBytes() const { return bytes; }
+
+        static const char *ClassStr(Class cls);
+
+    protected:
+        struct queue
+        {
+            std::list<message> messages;
+            std::map<std::string, std::list<message>::iterator, std::less<>> by_topic;
+            int qos;
+            size_t max_messages;
+            bool replace;
+            Metrics::Counter *dropped, *replaced;
+        };
+
+        void DropOldest(queue& q);
+
+        std::array<queue, ClassCount> classes;
+        size_t max_bytes, bytes, count;
+    };
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "PulseScheduler.hh"
+#include "Log.hh"
+#include "GpioBackend.hh"
+#include "Metrics.hh"
+
+using namespace dooragent;
+using namespace std;
+
+PulseScheduler::PulseScheduler(shared_ptr<uvw::Loop> loop)
+    :loop(loop), pulse_count(0), total_error(0), max_error(0),
+     error_hist(Metrics::Get().AddHistogram("pulse_error_us", "Difference between requested and actual output pulse width"))
+{
+
+}
+
+PulseScheduler::~PulseScheduler()
+{
+    // never leave an output asserted behind
+    for (auto& p: active)
+    {
+        GpioBackend::Get().SetOutput(p.output, !p.level);
+        p.timer->close();
+    }
+}
+
+void PulseScheduler::Pulse(int output, bool level, int width, const string& name)
+{
+    for (auto p = active.begin(); p != active.end(); ++p)
+    {
+        if (p->output == output)
+        {
+            // already held, extend the pulse instead of toggling it
+            Log::Trace("Pulse: ", name, " already active, extending");
+            loop->update();
+            p->deadline = chrono::steady_clock::now() + width * 1ms;
+            p->timer->start(chrono::milliseconds(width), 0ms);
+            return;
+        }
+    }
+
+    auto& p = active.emplace_back();
+    p.output = output;
+    p.level = level;
+    p.name = name;
+    p.timer = loop->resource<uvw::TimerHandle>();
+
+    auto iter = prev(active.end());
+    p.timer->once<uvw::TimerEvent>([this, iter](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            Release(iter);
+        });
+
+    // the loop time is cached per iteration, refresh it so the timeout
+    // counts from the moment the line is asserted
+    loop->update();
+    GpioBackend::Get().SetOutput(output, level);
+    p.start = chrono::steady_clock::now();
+    p.deadline = p.start + width * 1ms;
+    p.timer->start(chrono::milliseconds(width), 0ms);
+
+    Log::Trace("Pulse: ", name, " asserted for ", width, " ms");
+}
+
+void PulseScheduler::Cancel(int output)
+{
+    for (auto p = active.begin(); p != active.end(); ++p)
+    {
+        if (p->output == output)
+        {
+            GpioBackend::Get().SetOutput(p->output, !p->level);
+            Log::Trace("Pulse: ", p->name, " cancelled");
+            p->timer->close();
+            active.erase(p);
+            return;
+        }
+    }
+}
+
+void PulseScheduler::Release(list<pulse>::iterator p)
+{
+    GpioBackend::Get().SetOutput(p->output, !p->level);
+
+    auto time_now = chrono::steady_clock::now();
+    auto held = chrono::duration_cast<chrono::microseconds>(time_now - p->start);
+    auto error = chrono::duration_cast<chrono::microseconds>(time_now - p->deadline);
+    auto abs_error = error < 0us ? -error : error;
+
+    pulse_count++;
+    total_error += abs_error;
+    if (abs_error > max_error)
+        max_error = abs_error;
+    error_hist.Add(abs_error.count());
+
+    Log::Trace("Pulse: ", p->name, " released after ", held.count(), " us (error ", error.count(), " us)");
+
+    p->timer->close();
+    active.erase(p);
+}
+
+chrono::microseconds PulseScheduler::GetMeanError() const
+{
+    if (pulse_count == 0)
+        return 0us;
+    return total_error / pulse_count;
+}
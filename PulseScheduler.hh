@@ -0,0 +1,53 @@
+#ifndef _PULSESCHEDULER_HH
+#define _PULSESCHEDULER_HH
+
+#include <chrono>
+#include <string>
+#include <list>
+#include <memory>
+#include <uvw.hpp>
+#include "Histogram.hh"
+
+namespace dooragent
+{
+    // Drives output pulses from loop timers: the line is asserted right
+    // away and released by a timer, so a button press never blocks the
+    // event loop and pulses on different lines overlap freely.
+    class PulseScheduler
+    {
+    public:
+        PulseScheduler(std::shared_ptr<uvw::Loop> loop);
+        ~PulseScheduler();
+
+        void Pulse(int output, bool level, int width, const std::string& name);
+        // drops a pulse on the output early, driving it inactive
+        void Cancel(int output);
+
+        int GetActiveCount() const { return active.size(); }
+        unsigned long GetPulseCount() const { return pulse_count; }
+        std::chrono::microseconds GetMeanError() const;
+        std::chrono::microseconds GetMaxError() const { return max_error; }
+        const Histogram& GetErrorHistogram() const { return error_hist; }
+
+    protected:
+        struct pulse
+        {
+            int output;
+            bool level;
+            std::string name;
+            std::chrono::steady_clock::time_point start, deadline;
+            std::shared_ptr<uvw::TimerHandle> timer;
+        };
+
+        void Release(std::list<pulse>::iterator p);
+
+        std::shared_ptr<uvw::Loop> loop;
+        std::list<pulse> active;
+
+        unsigned long pulse_count;
+        std::chrono::microseconds total_error, max_error;
+        Histogram& error_hist;
+    };
+};
+
+#endif
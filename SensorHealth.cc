@@ -0,0 +1,72 @@
+#include "SensorHealth.hh"
+
+using namespace dooragent;
+using namespace std;
+
+SensorHealth::SensorHealth()
+    :head(0), total_changes(0), total_glitches(0), chatter_limit(20), stuck_after(2),
+     timeouts(0), chatter(false), stuck(false)
+{
+    changes.fill(0);
+    glitches.fill(0);
+}
+
+void SensorHealth::SetLimits(uint32_t chatter_changes, unsigned stuck_timeouts)
+{
+    chatter_limit = chatter_changes;
+    stuck_after = stuck_timeouts;
+    if (chatter_limit == 0)
+        chatter = false;
+    if (stuck_after == 0)
+        stuck = false;
+}
+
+bool SensorHealth::AddCounts(uint32_t new_changes, uint32_t new_glitches)
+{
+    Status old_status = GetStatus();
+
+    // the oldest bucket drops out of the window
+    head = (head + 1) % buckets;
+    total_changes += new_changes - changes[head];
+    total_glitches += new_glitches - glitches[head];
+    changes[head] = new_changes;
+    glitches[head] = new_glitches;
+
+    if (chatter_limit > 0 && total_changes > chatter_limit)
+        chatter = true;
+    else if (total_changes <= quiet_changes && total_glitches == 0)
+        chatter = false;
+
+    return GetStatus() != old_status;
+}
+
+bool SensorHealth::CommandTimedOut()
+{
+    Status old_status = GetStatus();
+    timeouts++;
+    if (stuck_after > 0 && timeouts >= stuck_after)
+        stuck = true;
+    return GetStatus() != old_status;
+}
+
+bool SensorHealth::SensorMoved()
+{
+    Status old_status = GetStatus();
+    timeouts = 0;
+    stuck = false;
+    return GetStatus() != old_status;
+}
+
+const char *SensorHealth::StatusStr(Status status)
+{
+    switch (status)
+    {
+    case Ok:
+        return "ok";
+    case Chatter:
+        return "chatter";
+    case Stuck:
+        return "stuck";
+    }
+    return "unknown";
+}
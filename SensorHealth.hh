@@ -0,0 +1,58 @@
+#ifndef _SENSORHEALTH_HH
+#define _SENSORHEALTH_HH
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace dooragent
+{
+    // Health of one door's sensors, from the raw level changes and glitches
+    // counted over a sliding window of check intervals, and from commands
+    // that timed out without the sensors following them.
+    //
+    // Chatter is set when the window holds more changes than the limit and
+    // clears once a whole window is quiet again. A stuck sensor is set after
+    // a number of command timeouts in a row and clears on the next sensed
+    // move.
+    class SensorHealth
+    {
+    public:
+        enum Status
+        {
+            Ok,
+            Chatter,
+            Stuck
+        };
+
+        static constexpr size_t buckets = 12;
+        // a real open or close cycle is about this many changes
+        static constexpr uint32_t quiet_changes = 2;
+
+        SensorHealth();
+
+        // 0 turns a check off
+        void SetLimits(uint32_t chatter_changes, unsigned stuck_timeouts);
+
+        // each of these returns true if the status changed
+        bool AddCounts(uint32_t changes, uint32_t glitches);
+        bool CommandTimedOut();
+        bool SensorMoved();
+
+        Status GetStatus() const { return chatter ? Chatter : stuck ? Stuck : Ok; }
+        uint32_t GetChanges() const { return total_changes; }
+        uint32_t GetGlitches() const { return total_glitches; }
+
+        static const char *StatusStr(Status status);
+
+    protected:
+        std::array<uint32_t, buckets> changes, glitches;
+        size_t head;
+        uint32_t total_changes, total_glitches;
+        uint32_t chatter_limit;
+        unsigned stuck_after, timeouts;
+        bool chatter, stuck;
+    };
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include "SimBackend.hh"
+#include "Log.hh"
+#include <fstream>
+#include <algorithm>
+#include <json/json.h>
+
+using namespace dooragent;
+using namespace std;
+using namespace std::chrono;
+
+SimBackend::SimBackend(bool offline)
+    :offline(offline), tick(250)
+{
+    // offline runs start at an arbitrary but fixed time, so the same
+    // script always gives the same output
+    start = offline ? clock::time_point{24h} : clock::now();
+    now_time = start;
+    next_tick = start;
+    end_time = start + 1h;
+}
+
+bool SimBackend::LoadScript(const string& path)
+{
+    ifstream script_stream{path};
+    if (!script_stream.good())
+        return false;
+
+    Json::Value script;
+    script_stream >> script;
+
+    tick = milliseconds(script.get("tick", 250).asInt());
+    end_time = start + milliseconds(script.get("duration", 3600000).asInt64());
+
+    for (auto& conf_input: script["inputs"])
+    {
+        auto& wave = waveforms.emplace_back();
+        wave.chip = conf_input["chip"].asString();
+        wave.line = conf_input["line"].asInt();
+        wave.initial = conf_input["initial"].asInt();
+        wave.repeat = conf_input.get("repeat", 0).asInt();
+        for (auto& point: conf_input["waveform"])
+            wave.points.emplace_back(point[0].asInt(), point[1].asInt());
+        sort(wave.points.begin(), wave.points.end());
+    }
+
+    Log::Message("Sim: loaded ", waveforms.size(), " waveforms from ", path);
+    return true;
+}
+
+int SimBackend::AddInput(const string& chip, int line, bool events)
+{
+    int id = inputs.size();
+    auto& in = inputs.emplace_back();
+    in.wave = nullptr;
+    // there are no event fds, live inputs are always polled
+    in.events = events && offline;
+    in.value = 0;
+
+    for (auto& wave: waveforms)
+    {
+        if (wave.chip == chip && wave.line == line)
+            in.wave = &wave;
+    }
+    if (in.wave == nullptr)
+        Log::Warning("Sim: no waveform for input " + chip + ":" + to_string(line) + ", it stays low");
+
+    return id;
+}
+
+int SimBackend::AddOutput(const string& chip, int line, bool, const string& consumer)
+{
+    int id = outputs.size();
+    outputs.push_back(chip + ":" + to_string(line) + " (" + consumer + ")");
+    return id;
+}
+
+void SimBackend::RequestInputs()
+{
+    now_time = start;
+    for (auto& in: inputs)
+    {
+        in.value = ValueAt(in.wave, 0s);
+        if (in.events)
+            FindNextEdge(in, start);
+    }
+}
+
+void SimBackend::ReadInputs(bool with_events)
+{
+    auto offset = Now() - start;
+    for (auto& in: inputs)
+    {
+        if (!in.events || with_events)
+            in.value = ValueAt(in.wave, offset);
+    }
+}
+
+bool SimBackend::ReadInputEvent(int input, edge& event)
+{
+    auto& in = inputs[input];
+    if (!in.events || in.next_edge != now_time)
+        return false;
+
+    in.value = in.next_value;
+    event.value = in.value;
+    event.time = now_time;
+    FindNextEdge(in, now_time);
+    return true;
+}
+
+void SimBackend::SetOutput(int output, bool value)
+{
+    Log::Message("Sim: output ", outputs[output], " set to ", value);
+}
+
+GpioBackend::clock::time_point SimBackend::Now() const
+{
+    return offline ? now_time : clock::now();
+}
+
+int SimBackend::ValueAt(const waveform *wave, clock::duration offset) const
+{
+    if (wave == nullptr)
+        return 0;
+
+    auto ms = duration_cast<milliseconds>(offset).count();
+    if (wave->repeat > 0)
+        ms %= wave->repeat;
+
+    int value = wave->initial;
+    for (auto& [time, point_value]: wave->points)
+    {
+        if (time > ms)
+            break;
+        value = point_value;
+    }
+    return value;
+}
+
+// Jumps straight to the next point that changes the value, stepping a
+// day long script a millisecond at a time would take 86M steps.
+void SimBackend::FindNextEdge(input& in, clock::time_point after) const
+{
+    in.next_edge = clock::time_point::max();
+    if (in.wave == nullptr || in.wave->points.empty())
+        return;
+
+    int value = in.value;
+    auto offset = duration_cast<milliseconds>(after - start).count();
+    long base = 0;
+    if (in.wave->repeat > 0)
+        base = offset - offset % in.wave->repeat;
+
+    // look through this period and the next one for a change of value
+    for (int period = 0; period < 2; period++)
+    {
+        for (auto& [time, point_value]: in.wave->points)
+        {
+            long at = base + time;
+            if (at > offset && point_value != value)
+            {
+                in.next_edge = start + milliseconds(at);
+                in.next_value = point_value;
+                return;
+            }
+            if (at > offset)
+                value = point_value;
+        }
+        if (in.wave->repeat <= 0)
+            return;
+        base += in.wave->repeat;
+        // a new period starts over from the initial level
+        if (in.wave->initial != value)
+        {
+            in.next_edge = start + milliseconds(base);
+            in.next_value = in.wave->initial;
+            return;
+        }
+    }
+}
+
+bool SimBackend::NextStep(step& next)
+{
+    if (!offline)
+        return false;
+
+    // the earliest of the next poll tick and any pending edge
+    next.kind = step::Tick;
+    next.input = -1;
+    next.time = next_tick;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        auto& in = inputs[i];
+        if (in.events && in.next_edge < next.time)
+        {
+            next.kind = step::Edge;
+            next.input = i;
+            next.time = in.next_edge;
+        }
+    }
+
+    if (next.time > end_time)
+        return false;
+
+    now_time = next.time;
+    if (next.kind == step::Tick)
+        next_tick += tick;
+    return true;
+}
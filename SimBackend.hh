@@ -0,0 +1,76 @@
+#ifndef _SIMBACKEND_HH
+#define _SIMBACKEND_HH
+
+#include <string>
+#include <vector>
+#include <utility>
+#include "GpioBackend.hh"
+
+namespace dooragent
+{
+    // Simulated GPIO driven by a script of sensor waveforms. Live, the
+    // virtual clock follows the real one and inputs are polled; offline it
+    // is stepped from one tick or edge to the next until the script ends.
+    //
+    // {
+    //   "tick": 250, "duration": 600000,
+    //   "inputs": [ { "chip": "gpiochip0", "line": 17, "initial": 1,
+    //                 "waveform": [[5000, 0], [5020, 1], [5040, 0]],
+    //                 "repeat": 60000 } ]
+    // }
+    //
+    // Waveform points are [ms, value] from the start (of each repeat).
+    class SimBackend : public GpioBackend
+    {
+    public:
+        SimBackend(bool offline);
+
+        bool LoadScript(const std::string& path);
+
+        int AddInput(const std::string& chip, int line, bool events) override;
+        int AddOutput(const std::string& chip, int line, bool level, const std::string& consumer) override;
+        void RequestInputs() override;
+        void ReadInputs(bool with_events = true) override;
+
+        int GetInputValue(int input) const override { return inputs[input].value; }
+        int GetInputFd(int) const override { return -1; }
+        bool ReadInputEvent(int input, edge& event) override;
+        void SetOutput(int output, bool value) override;
+
+        clock::time_point Now() const override;
+        bool NextStep(step& next) override;
+
+    protected:
+        struct waveform
+        {
+            std::string chip;
+            int line;
+            int initial;
+            std::vector<std::pair<int, int>> points;
+            int repeat;
+        };
+
+        struct input
+        {
+            const waveform *wave;
+            bool events;
+            int value;
+            // offline only: the next transition of an event input
+            clock::time_point next_edge;
+            int next_value;
+        };
+
+        int ValueAt(const waveform *wave, clock::duration offset) const;
+        void FindNextEdge(input& in, clock::time_point after) const;
+
+        bool offline;
+        std::vector<waveform> waveforms;
+        std::vector<input> inputs;
+        std::vector<std::string> outputs;
+
+        clock::time_point start, now_time, next_tick, end_time;
+        std::chrono::milliseconds tick;
+    };
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _SPSCQUEUE_HH
+#define _SPSCQUEUE_HH
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+
+namespace dooragent
+{
+    // Bounded single-producer/single-consumer ring. Push and Pop never
+    // block or allocate; Push fails when the ring is full.
+    template<typename T, size_t N>
+    class SpscQueue
+    {
+        static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+    public:
+        bool Push(const T& item)
+            {
+                size_t tail = tail_pos.load(std::memory_order_relaxed);
+                if (tail - head_pos.load(std::memory_order_acquire) == N)
+                    return false;
+                items[tail & (N - 1)] = item;
+                tail_pos.store(tail + 1, std::memory_order_release);
+                return true;
+            }
+
+        bool Pop(T& item)
+            {
+                size_t head = head_pos.load(std::memory_order_relaxed);
+                if (head == tail_pos.load(std::memory_order_acquire))
+                    return false;
+                item = items[head & (N - 1)];
+                head_pos.store(head + 1, std::memory_order_release);
+                return true;
+            }
+
+        bool Empty() const
+            {
+                return head_pos.load(std::memory_order_acquire) == tail_pos.load(std::memory_order_acquire);
+            }
+
+    protected:
+        std::array<T, N> items;
+        alignas(64) std::atomic<size_t> head_pos{0};
+        alignas(64) std::atomic<size_t> tail_pos{0};
+    };
+};
+
+#endif
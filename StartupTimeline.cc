@@ -0,0 +1,102 @@
+#include "StartupTimeline.hh"
+#include "Metrics.hh"
+#include <json/json.h>
+
+using namespace dooragent;
+using namespace std;
+
+// constructed with the other globals, close enough to process start
+StartupTimeline::StartupTimeline()
+    :start(clock::now()), pending(0), complete(false),
+     first_state(Metrics::Get().AddHistogram("startup_first_state_ms", "Time from process start until a door's first state is published"))
+{
+
+}
+
+long StartupTimeline::Offset() const
+{
+    return chrono::duration_cast<chrono::milliseconds>(clock::now() - start).count();
+}
+
+void StartupTimeline::Mark(const string& phase)
+{
+    if (complete)
+        return;
+    for (auto& p: phases)
+    {
+        if (p.first == phase)
+            return;
+    }
+    phases.emplace_back(phase, Offset());
+}
+
+void StartupTimeline::Expect(const set<int>& indexes)
+{
+    for (int index: indexes)
+        doors.try_emplace(index);
+    pending = doors.size();
+}
+
+void StartupTimeline::DoorSensed(int index)
+{
+    auto door_iter = doors.find(index);
+    if (!complete && door_iter != doors.end() && door_iter->second.sensed < 0)
+        door_iter->second.sensed = Offset();
+}
+
+bool StartupTimeline::DoorPublished(int index)
+{
+    auto door_iter = doors.find(index);
+    if (complete || door_iter == doors.end() || door_iter->second.published >= 0)
+        return false;
+
+    door_iter->second.published = Offset();
+    first_state.Add(door_iter->second.published);
+    if (--pending > 0)
+        return false;
+    complete = true;
+    return true;
+}
+
+bool StartupTimeline::DoorRemoved(int index)
+{
+    auto door_iter = doors.find(index);
+    if (complete || door_iter == doors.end() || door_iter->second.published >= 0)
+        return false;
+
+    doors.erase(door_iter);
+    if (--pending > 0)
+        return false;
+    complete = true;
+    return true;
+}
+
+string StartupTimeline::Summary() const
+{
+    string summary;
+    for (auto& [phase, offset]: phases)
+        summary += phase + " " + to_string(offset) + " ms, ";
+    for (auto& [index, times]: doors)
+        summary += "door " + to_string(index) + " sensed " + to_string(times.sensed) +
+            " ms published " + to_string(times.published) + " ms, ";
+    if (!summary.empty())
+        summary.resize(summary.size() - 2);
+    return summary;
+}
+
+string StartupTimeline::Json() const
+{
+    Json::Value root(Json::objectValue);
+    for (auto& [phase, offset]: phases)
+        root["phases"][phase] = Json::Int64(offset);
+    for (auto& [index, times]: doors)
+    {
+        auto& door = root["doors"][to_string(index)];
+        door["sensed"] = Json::Int64(times.sensed);
+        door["published"] = Json::Int64(times.published);
+    }
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, root);
+}
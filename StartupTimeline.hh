@@ -0,0 +1,55 @@
+#ifndef _STARTUPTIMELINE_HH
+#define _STARTUPTIMELINE_HH
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include "Histogram.hh"
+
+namespace dooragent
+{
+    // Milestones of one startup as offsets from process start: the phases
+    // main goes through and, per door, when its first state was known and
+    // when it was first published. Complete once every door expected at
+    // startup is published. Main loop only.
+    class StartupTimeline
+    {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        StartupTimeline();
+
+        void Mark(const std::string& phase);
+        void Expect(const std::set<int>& indexes);
+        void DoorSensed(int index);
+        // true when this publish completes the timeline
+        bool DoorPublished(int index);
+        // a door removed before it was published isn't waited for; true
+        // when that completes the timeline
+        bool DoorRemoved(int index);
+
+        bool IsComplete() const { return complete; }
+        std::string Summary() const;
+        std::string Json() const;
+
+    protected:
+        struct door_times
+        {
+            long sensed = -1;
+            long published = -1;
+        };
+
+        long Offset() const;
+
+        clock::time_point start;
+        std::vector<std::pair<std::string, long>> phases;
+        std::map<int, door_times> doors;
+        size_t pending;
+        bool complete;
+        Histogram& first_state;
+    };
+};
+
+#endif
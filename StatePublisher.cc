@@ -0,0 +1,188 @@
+#include "StatePublisher.hh"
+#include "Log.hh"
+
+using namespace dooragent;
+using namespace std;
+
+StatePublisher::StatePublisher(MqttClient& client)
+    :client(client), flush_scheduled(false), snapshot_dirty(false),
+     published(Metrics::Get().AddCounter("state_updates_total", "Door state updates by outcome", "result=\"published\"")),
+     suppressed(Metrics::Get().AddCounter("state_updates_total", "Door state updates by outcome", "result=\"suppressed\"")),
+     coalesced(Metrics::Get().AddCounter("state_updates_total", "Door state updates by outcome", "result=\"coalesced\""))
+{
+
+}
+
+void StatePublisher::Attach(shared_ptr<uvw::Loop> loop)
+{
+    flush_check = loop->resource<uvw::CheckHandle>();
+    flush_check->on<uvw::CheckEvent>([this](uvw::CheckEvent&, uvw::CheckHandle&)
+        {
+            Flush();
+        });
+    // only there to make poll return immediately, the check handle flushes
+    flush_idle = loop->resource<uvw::IdleHandle>();
+    flush_idle->on<uvw::IdleEvent>([](uvw::IdleEvent&, uvw::IdleHandle&) {});
+}
+
+void StatePublisher::SetPrefix(const string& prefix)
+{
+    this->prefix = prefix;
+    for (auto& e: entries)
+        e.second.topic = prefix + to_string(e.first) + "/state";
+}
+
+void StatePublisher::SetSnapshotTopic(const string& topic)
+{
+    snapshot_topic = topic;
+}
+
+void StatePublisher::SetPublishHandler(publish_handler handler)
+{
+    on_publish = handler;
+}
+
+const char *StatePublisher::StatePayload(Door::State state)
+{
+    switch (state)
+    {
+    case Door::Open:
+        return "open";
+    case Door::Opening:
+    case Door::OpeningSensed:
+        return "opening";
+    case Door::Closed:
+    case Door::OpenStart:
+        return "closed";
+    case Door::Closing:
+        return "closing";
+    }
+    return nullptr;
+}
+
+void StatePublisher::Update(const Door& door)
+{
+    Update(door.GetIndex(), door.GetState());
+}
+
+void StatePublisher::Update(int index, Door::State state)
+{
+    const char *payload = StatePayload(state);
+    if (payload == nullptr)
+        return;
+
+    auto entry_iter = entries.find(index);
+    if (entry_iter == entries.end())
+    {
+        entry new_entry{prefix + to_string(index) + "/state", nullptr, nullptr, false};
+        entry_iter = entries.emplace(index, new_entry).first;
+    }
+    auto& e = entry_iter->second;
+
+    if (e.dirty)
+    {
+        coalesced.Add();
+    }
+    else if (payload == e.published)
+    {
+        // payloads are static strings, pointer equality is enough
+        suppressed.Add();
+        return;
+    }
+
+    e.pending = payload;
+    e.dirty = true;
+    Schedule();
+}
+
+// A door dropped by a config reload: clear its retained state and leave it
+// out of the snapshot.
+void StatePublisher::Remove(int index)
+{
+    auto entry_iter = entries.find(index);
+    if (entry_iter == entries.end())
+        return;
+
+    if (entry_iter->second.published != nullptr)
+    {
+        client.PublishTopic(entry_iter->second.topic, "", true, OutboundQueue::ClassState);
+        published.Add();
+    }
+    entries.erase(entry_iter);
+    snapshot_dirty = true;
+    Schedule();
+}
+
+// Forget what was published, e.g. after a reconnect when the broker may
+// have lost retained messages.
+void StatePublisher::Invalidate()
+{
+    for (auto& e: entries)
+    {
+        e.second.published = nullptr;
+        if (!e.second.dirty && e.second.pending != nullptr)
+        {
+            e.second.dirty = true;
+            Schedule();
+        }
+    }
+}
+
+void StatePublisher::Schedule()
+{
+    if (!flush_scheduled && flush_check)
+    {
+        flush_check->start();
+        flush_idle->start();
+        flush_scheduled = true;
+    }
+}
+
+void StatePublisher::Flush()
+{
+    for (auto& [index, e]: entries)
+    {
+        if (!e.dirty)
+            continue;
+        e.dirty = false;
+        if (e.pending == e.published)
+        {
+            // changed and changed back within one iteration
+            suppressed.Add();
+            continue;
+        }
+        client.PublishTopic(e.topic, e.pending, true, OutboundQueue::ClassState);
+        e.published = e.pending;
+        published.Add();
+        snapshot_dirty = true;
+        if (on_publish && client.IsConnected())
+            on_publish(index);
+    }
+
+    if (snapshot_dirty && !snapshot_topic.empty())
+    {
+        string snapshot{"{"};
+        for (auto& [index, e]: entries)
+        {
+            if (e.published == nullptr)
+                continue;
+            if (snapshot.size() > 1)
+                snapshot += ',';
+            snapshot += '"' + to_string(index) + "\":\"" + e.published + '"';
+        }
+        snapshot += '}';
+        client.PublishTopic(snapshot_topic, snapshot, true, OutboundQueue::ClassState);
+        published.Add();
+    }
+    snapshot_dirty = false;
+
+    Log::Trace("StatePublisher: published=", published.Get(), " suppressed=", suppressed.Get(),
+               " coalesced=", coalesced.Get());
+
+    if (flush_check)
+    {
+        flush_check->stop();
+        flush_idle->stop();
+    }
+    flush_scheduled = false;
+}
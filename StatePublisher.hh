@@ -0,0 +1,64 @@
+#ifndef _STATEPUBLISHER_HH
+#define _STATEPUBLISHER_HH
+
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+#include <uvw.hpp>
+#include "Door.hh"
+#include "MqttClient.hh"
+
+namespace dooragent
+{
+    // Outbound stage for door state. Updates only mark a door dirty, the
+    // actual publishes happen once per loop iteration from a check handle,
+    // so several changes in one iteration collapse into one message, and a
+    // payload identical to the last one published is dropped. An idle handle
+    // is active while a flush is pending so the loop does not block in poll
+    // with dirty entries.
+    class StatePublisher
+    {
+    public:
+        using publish_handler = std::function<void(int index)>;
+
+        StatePublisher(MqttClient& client);
+
+        void Attach(std::shared_ptr<uvw::Loop> loop);
+        void SetPrefix(const std::string& prefix);
+        void SetSnapshotTopic(const std::string& topic);
+        // called for every state that really went out to the broker
+        void SetPublishHandler(publish_handler handler);
+
+        void Update(const Door& door);
+        void Update(int index, Door::State state);
+        void Remove(int index);
+        void Invalidate();
+        void Flush();
+
+        static const char *StatePayload(Door::State state);
+
+    protected:
+        struct entry
+        {
+            std::string topic;
+            const char *pending;
+            const char *published;
+            bool dirty;
+        };
+
+        void Schedule();
+
+        MqttClient& client;
+        std::string prefix, snapshot_topic;
+        std::map<int, entry> entries;
+        std::shared_ptr<uvw::CheckHandle> flush_check;
+        std::shared_ptr<uvw::IdleHandle> flush_idle;
+        publish_handler on_publish;
+        bool flush_scheduled, snapshot_dirty;
+
+        Metrics::Counter &published, &suppressed, &coalesced;
+    };
+};
+
+#endif
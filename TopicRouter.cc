@@ -0,0 +1,144 @@
+#include "TopicRouter.hh"
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    // Splits off the topic level starting at pos, next is set to the start
+    // of the following level or npos if this was the last one.
+    string_view next_level(string_view topic, size_t pos, size_t& next)
+    {
+        size_t slash = topic.find('/', pos);
+        if (slash == string_view::npos)
+        {
+            next = string_view::npos;
+            return topic.substr(pos);
+        }
+        next = slash + 1;
+        return topic.substr(pos, slash - pos);
+    }
+};
+
+bool TopicRouter::IsFilter(string_view filter)
+{
+    return filter.find_first_of("+#") != string_view::npos;
+}
+
+void TopicRouter::Add(string_view filter, handler h)
+{
+    node *n = &root;
+    size_t pos = 0;
+    while (pos != string_view::npos)
+    {
+        size_t next;
+        auto level = next_level(filter, pos, next);
+        if (level == "#")
+        {
+            n->multi.push_back(h);
+            return;
+        }
+        else if (level == "+")
+        {
+            if (!n->single)
+                n->single = make_unique<node>();
+            n = n->single.get();
+        }
+        else
+        {
+            auto child = n->children.find(level);
+            if (child == n->children.end())
+                child = n->children.emplace(string{level}, make_unique<node>()).first;
+            n = child->second.get();
+        }
+        pos = next;
+    }
+    n->handlers.push_back(h);
+}
+
+void TopicRouter::Remove(string_view filter)
+{
+    node *n = &root;
+    size_t pos = 0;
+    while (pos != string_view::npos)
+    {
+        size_t next;
+        auto level = next_level(filter, pos, next);
+        if (level == "#")
+        {
+            n->multi.clear();
+            return;
+        }
+        else if (level == "+")
+        {
+            if (!n->single)
+                return;
+            n = n->single.get();
+        }
+        else
+        {
+            auto child = n->children.find(level);
+            if (child == n->children.end())
+                return;
+            n = child->second.get();
+        }
+        pos = next;
+    }
+    n->handlers.clear();
+}
+
+size_t TopicRouter::Dispatch(string_view topic, string_view payload) const
+{
+    captures caps;
+    return Match(root, topic, 0, caps, payload, topic);
+}
+
+size_t TopicRouter::Match(const node& n, string_view topic, size_t pos, captures& caps,
+                          string_view payload, string_view full_topic) const
+{
+    size_t matched = 0;
+
+    // wildcards at the first level never match $SYS style topics
+    bool wildcards = !(&n == &root && !topic.empty() && topic[0] == '$');
+
+    if (pos == string_view::npos)
+    {
+        for (auto& h: n.handlers)
+            h(full_topic, payload, caps);
+        matched += n.handlers.size();
+
+        // "a/#" also matches "a" itself
+        for (auto& h: n.multi)
+            h(full_topic, payload, caps);
+        return matched + n.multi.size();
+    }
+
+    if (wildcards && !n.multi.empty())
+    {
+        size_t count = caps.count;
+        if (caps.count < captures::max_captures)
+            caps.values[caps.count++] = topic.substr(pos);
+        for (auto& h: n.multi)
+            h(full_topic, payload, caps);
+        matched += n.multi.size();
+        caps.count = count;
+    }
+
+    size_t next;
+    auto level = next_level(topic, pos, next);
+
+    auto child = n.children.find(level);
+    if (child != n.children.end())
+        matched += Match(*child->second, topic, next, caps, payload, full_topic);
+
+    if (wildcards && n.single)
+    {
+        size_t count = caps.count;
+        if (caps.count < captures::max_captures)
+            caps.values[caps.count++] = level;
+        matched += Match(*n.single, topic, next, caps, payload, full_topic);
+        caps.count = count;
+    }
+
+    return matched;
+}
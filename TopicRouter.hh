@@ -0,0 +1,56 @@
+#ifndef _TOPICROUTER_HH
+#define _TOPICROUTER_HH
+
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <map>
+#include <memory>
+#include <functional>
+
+namespace dooragent
+{
+    // Matches MQTT topics against subscription filters with + and #
+    // wildcards using a trie of topic levels. Dispatch works on views of
+    // the incoming message and doesn't allocate; the levels matched by
+    // wildcards are handed to the handler as captures.
+    class TopicRouter
+    {
+    public:
+        struct captures
+        {
+            static constexpr size_t max_captures = 8;
+
+            std::array<std::string_view, max_captures> values;
+            size_t count = 0;
+
+            std::string_view operator[](size_t i) const { return i < count ? values[i] : std::string_view{}; }
+            size_t size() const { return count; }
+        };
+
+        using handler = std::function<void(std::string_view topic, std::string_view payload, const captures& caps)>;
+
+        void Add(std::string_view filter, handler h);
+        void Remove(std::string_view filter);
+        size_t Dispatch(std::string_view topic, std::string_view payload) const;
+
+        static bool IsFilter(std::string_view filter);
+
+    protected:
+        struct node
+        {
+            std::map<std::string, std::unique_ptr<node>, std::less<>> children;
+            std::unique_ptr<node> single;
+            std::vector<handler> handlers;
+            std::vector<handler> multi;
+        };
+
+        size_t Match(const node& n, std::string_view topic, size_t pos, captures& caps,
+                     std::string_view payload, std::string_view full_topic) const;
+
+        node root;
+    };
+};
+
+#endif
@@ -0,0 +1,94 @@
+#include "TravelEstimator.hh"
+#include <algorithm>
+#include <cmath>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    constexpr double alpha = 0.2;
+    // slack on top of the estimate before a slow cycle counts as a fault
+    constexpr double timeout_margin = 1.25;
+};
+
+TravelEstimator::TravelEstimator()
+    :mean(0), deviation(0), count(0), recent{}
+{
+
+}
+
+void TravelEstimator::Add(int ms)
+{
+    if (count == 0)
+    {
+        mean = ms;
+        deviation = 0;
+    }
+    else
+    {
+        deviation += alpha * (fabs(ms - mean) - deviation);
+        mean += alpha * (ms - mean);
+    }
+    recent[count % history] = ms;
+    count++;
+}
+
+int TravelEstimator::Percentile(double p) const
+{
+    size_t n = min<size_t>(count, history);
+    if (n == 0)
+        return 0;
+    array<int, history> sorted = recent;
+    size_t k = min(n - 1, size_t(p * n));
+    nth_element(sorted.begin(), sorted.begin() + k, sorted.begin() + n);
+    return sorted[k];
+}
+
+int TravelEstimator::Typical(int fallback, int min_ms, int max_ms) const
+{
+    if (count < min_samples)
+        return fallback;
+    return clamp(Percentile(0.95), min_ms, max_ms);
+}
+
+int TravelEstimator::Timeout(int fallback, int min_ms, int max_ms) const
+{
+    if (count < min_samples)
+        return fallback;
+    double limit = max<double>(Percentile(0.95), mean + 4 * deviation) * timeout_margin;
+    return clamp((int)limit, min_ms, max_ms);
+}
+
+Json::Value TravelEstimator::Save() const
+{
+    Json::Value saved(Json::objectValue);
+    saved["mean"] = mean;
+    saved["deviation"] = deviation;
+    saved["count"] = count;
+    Json::Value samples(Json::arrayValue);
+    // oldest first, so loading them in order rebuilds the same ring
+    size_t n = min<size_t>(count, history);
+    for (size_t i = count - n; i < count; i++)
+        samples.append(recent[i % history]);
+    saved["recent"] = samples;
+    return saved;
+}
+
+void TravelEstimator::Load(const Json::Value& saved)
+{
+    if (saved.type() != Json::objectValue)
+        return;
+
+    auto& samples = saved["recent"];
+    size_t total = samples.size();
+    size_t n = min<size_t>(total, history);
+    // Percentile() reads the first min(count, history) slots, so count
+    // can't claim more samples than were actually saved
+    count = n;
+    recent.fill(0);
+    for (size_t i = 0; i < n; i++)
+        recent[i] = samples[Json::ArrayIndex(total - n + i)].asInt();
+    mean = saved["mean"].asDouble();
+    deviation = saved["deviation"].asDouble();
+}
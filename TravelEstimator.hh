@@ -0,0 +1,41 @@
+#ifndef _TRAVELESTIMATOR_HH
+#define _TRAVELESTIMATOR_HH
+
+#include <array>
+#include <json/json.h>
+
+namespace dooragent
+{
+    // Running estimate of one door travel duration: an EWMA of the value
+    // and of its absolute deviation, plus the most recent samples for a
+    // percentile, which a single outlier can't drag around.
+    class TravelEstimator
+    {
+    public:
+        static constexpr size_t history = 32;
+        static constexpr unsigned min_samples = 3;
+
+        TravelEstimator();
+
+        void Add(int ms);
+        unsigned GetCount() const { return count; }
+        double GetMean() const { return mean; }
+        double GetDeviation() const { return deviation; }
+        int Percentile(double p) const;
+
+        // how long it usually takes, and a limit that nearly every real
+        // cycle stays under; both fall back until there are enough samples
+        int Typical(int fallback, int min_ms, int max_ms) const;
+        int Timeout(int fallback, int min_ms, int max_ms) const;
+
+        Json::Value Save() const;
+        void Load(const Json::Value& saved);
+
+    protected:
+        double mean, deviation;
+        unsigned count;
+        std::array<int, history> recent;
+    };
+};
+
+#endif
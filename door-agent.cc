@@ -1,4 +1,5 @@
 #include <iostream>
+#include <iomanip>
 #include <fstream>
 #include <chrono>
 #include <json/json.h>
@@ -6,11 +7,35 @@
 #include <signal.h>
 #include <sys/random.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <charconv>
+#include <algorithm>
+#include <list>
+#include <deque>
+#include <set>
+#include <map>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
 #include <uvw.hpp>
 
 #include "Log.hh"
 #include "Door.hh"
 #include "MqttClient.hh"
+#include "PulseScheduler.hh"
+#include "GpioRegistry.hh"
+#include "SimBackend.hh"
+#include "GpioTrace.hh"
+#include "StatePublisher.hh"
+#include "DeadlineScheduler.hh"
+#include "GpioThread.hh"
+#include "Histogram.hh"
+#include "Metrics.hh"
+#include "MetricsServer.hh"
+#include "StartupTimeline.hh"
+#include "EventHistory.hh"
+#include "SensorHealth.hh"
 
 using namespace dooragent;
 using namespace std;
@@ -18,124 +43,341 @@ using namespace std::chrono;
 namespace po = boost::program_options;
 
 std::string version{"0.1"};
+StartupTimeline startup_timeline;
 
-std::vector<Door> doors;
-std::string mqtt_broker, mqtt_prefix, mqtt_ha_prefix, mqtt_dev_prefix;
+DoorBank door_bank;
+// doors come and go on a config reload, a list keeps the rest in place
+std::list<Door> doors;
+std::vector<Door*> door_by_slot;
+std::string mqtt_prefix, mqtt_ha_prefix, mqtt_dev_prefix;
+// in order of preference, see MqttClient for failover
+std::vector<std::string> mqtt_brokers;
+// Home Assistant announces itself here when it (re)starts
+std::string mqtt_ha_status{"homeassistant/status"};
+// discovery payloads are only built when a door appears, every later
+// announcement sends the same buffer
+std::map<int, std::shared_ptr<const std::string>> discovery_payloads;
 MqttClient mqtt_client;
+StatePublisher state_publisher{mqtt_client};
+bool sensor_events = false;
+std::string fdr_dir;
+bool fdr_mqtt = false;
+std::atomic<bool> fdr_enabled{false};
+bool gpio_threaded = false;
+int gpio_priority = 0;
+int gpio_cpu = -1;
+std::unique_ptr<GpioThread> gpio_thread;
+std::shared_ptr<uvw::Loop> gpio_loop;
+std::unique_ptr<PulseScheduler> pulse_scheduler;
+std::unique_ptr<DeadlineScheduler> deadline_scheduler;
+std::map<int, std::shared_ptr<uvw::PollHandle>> sensor_polls;
 
 constexpr auto poll_time_fast = 250ms;
 constexpr auto poll_time_slow = 3s;
+// right after startup the sensors are sampled in a quick burst, so the
+// doors leave InitSensing as soon as their debounce window allows
+constexpr auto poll_time_burst = 5ms;
+constexpr auto burst_limit = 1s;
+constexpr auto stats_interval = 10min;
+// sensor health is checked over SensorHealth::buckets of these
+constexpr auto health_interval = 5s;
 
-void load_config(string config_file)
+std::shared_ptr<uvw::TimerHandle> loop_timer;
+bool fast_polling = true;
+bool burst_polling = true;
+steady_clock::time_point burst_start;
+milliseconds poll_interval{0};
+steady_clock::time_point last_poll;
+Histogram& poll_jitter_fast = Metrics::Get().AddHistogram("poll_jitter_us", "Poll timer deviation from its period", "rate=\"fast\"");
+Histogram& poll_jitter_slow = Metrics::Get().AddHistogram("poll_jitter_us", "Poll timer deviation from its period", "rate=\"slow\"");
+
+std::string metrics_address{"127.0.0.1"};
+int metrics_port = 0;
+int metrics_interval = 0;
+std::string calibration_file;
+int calibration_save_interval = 600;
+std::string history_dir;
+uint32_t history_records = 4096;
+constexpr size_t history_query_limit = 100;
+// simulations and replays leave the history files alone
+bool offline_run = false;
+
+// what the running doors were configured from, to diff a reload against
+std::string config_file;
+Json::Value running_config;
+std::map<int, Json::Value> door_configs;
+Json::Value door_calibration;
+// the main loop's view of the doors, in threaded mode the list belongs to
+// the GPIO thread
+std::set<int> door_indexes;
+// last sensor health reported for each door, republished on reconnect
+std::map<int, SensorHealth::Status> door_health;
+// handed to the GPIO thread along with a reload command
+std::shared_ptr<const Json::Value> reload_root;
+constexpr uint8_t CmdReload = 0xff;
+// asks the GPIO thread to report every door again after lost events
+constexpr uint8_t CmdResync = 0xfe;
+constexpr auto reload_delay = 500ms;
+// internal commands the GPIO thread's queue had no room for, retried in
+// order until they go through
+std::deque<GpioThread::command> pending_commands;
+std::shared_ptr<uvw::TimerHandle> command_retry_timer;
+constexpr auto command_retry_delay = 10ms;
+
+void post_gpio_command(const GpioThread::command& cmd)
 {
-    ifstream config_stream{config_file};
+    if (pending_commands.empty() && gpio_thread->PostCommand(cmd))
+        return;
+    pending_commands.push_back(cmd);
+    if (!command_retry_timer->active())
+        command_retry_timer->start(command_retry_delay, command_retry_delay);
+}
 
-    if (!config_stream.good())
+// Sections that are only read at startup, a reload that changes them
+// says so and leaves them alone
+const char *restart_sections[] = {"sensor_events", "gpio_thread", "metrics", "mqtt", "history"};
+
+void apply_settings(const Json::Value& conf_root, bool initial)
+{
+    auto conf_log = conf_root["log"];
+    if (conf_log.type() == Json::objectValue)
     {
-        throw system_error{};
+        // a reload only touches what changed, reopening the log file on
+        // every reload would lose the writer's place for nothing
+        const Json::Value& running = running_config;
+        auto& running_log = running["log"];
+        auto changed = [&](const char *key)
+            {
+                return conf_log.isMember(key) && (initial || conf_log[key] != running_log[key]);
+            };
+        if (changed("level") && !Log::SetLevel(conf_log["level"].asString()))
+            Log::Error("Unknown log level " + conf_log["level"].asString());
+        if (changed("stdout"))
+            Log::SetStdout(conf_log["stdout"].asBool());
+        if (changed("file") && !Log::SetFile(conf_log["file"].asString()))
+            Log::Error("Can't open log file " + conf_log["file"].asString());
+        if (changed("syslog"))
+            Log::SetSyslog(conf_log["syslog"].asBool());
     }
 
-    Json::Value conf_root;
-    config_stream >> conf_root;
+    auto conf_fdr = conf_root["flight_recorder"];
+    if (conf_fdr.type() == Json::objectValue)
+    {
+        fdr_dir = conf_fdr["dir"].asString();
+        fdr_mqtt = conf_fdr["mqtt"].asBool();
+    }
+    else
+    {
+        fdr_dir.clear();
+        fdr_mqtt = false;
+    }
+    fdr_enabled = !fdr_dir.empty() || fdr_mqtt;
 
-    auto conf_doors = conf_root["doors"];
-    if (conf_doors.type() == Json::arrayValue)
+    if (!initial)
     {
-        for (auto& conf_door: conf_doors)
+        const Json::Value& running = running_config;
+        for (auto section: restart_sections)
         {
-            if (conf_door.isMember("index"))
-            {
-                auto& new_door = doors.emplace_back(conf_door["index"].asInt());
-                if (conf_door.isMember("closed_sensor") && conf_door["closed_sensor"].type() == Json::arrayValue)
-                {
-                    auto& sensor = conf_door["closed_sensor"];
-                    new_door.SetClosedSensor(sensor[0].asString(),
-                                             sensor[1].asInt(),
-                                             sensor[2].asBool());
-                }
-                if (conf_door.isMember("open_btn") && conf_door["open_btn"].type() == Json::arrayValue)
-                {
-                    auto& btn = conf_door["open_btn"];
-                    new_door.SetOpenBtn(btn[0].asString(),
-                                        btn[1].asInt(),
-                                        btn[2].asBool());
-                }
-                if (conf_door.isMember("open_time"))
-                {
-                    new_door.SetOpenTime(conf_door["open_time"].asInt());
-                }
-                if (conf_door.isMember("close_time"))
-                {
-                    new_door.SetCloseTime(conf_door["close_time"].asInt());
-                }
-                if (conf_door.isMember("open_start_time"))
-                {
-                    new_door.SetOpenStartTime(conf_door["open_start_time"].asInt());
-                }
-            }
+            if (conf_root[section] != running[section])
+                Log::Warning("main: reload: ", section, " changed, restart to apply it");
         }
-    } else {
-        Log::Error("No doors defined in configuration");
+        auto& conf_cal = conf_root["calibration"];
+        auto& running_cal = running["calibration"];
+        if (conf_cal["file"] != running_cal["file"] || conf_cal["save_interval"] != running_cal["save_interval"])
+            Log::Warning("main: reload: calibration file changed, restart to apply it");
+        return;
+    }
+
+    if (conf_root.isMember("sensor_events"))
+    {
+        sensor_events = conf_root["sensor_events"].asBool();
+    }
+    auto conf_gpio = conf_root["gpio_thread"];
+    if (conf_gpio.type() == Json::objectValue)
+    {
+        gpio_threaded = conf_gpio["enabled"].asBool();
+        gpio_priority = conf_gpio.get("priority", 0).asInt();
+        gpio_cpu = conf_gpio.get("cpu", -1).asInt();
+    }
+    auto conf_cal = conf_root["calibration"];
+    if (conf_cal.type() == Json::objectValue)
+    {
+        calibration_file = conf_cal["file"].asString();
+        calibration_save_interval = conf_cal.get("save_interval", 600).asInt();
+    }
+    auto conf_history = conf_root["history"];
+    if (conf_history.type() == Json::objectValue)
+    {
+        history_dir = conf_history["dir"].asString();
+        history_records = conf_history.get("records", history_records).asUInt();
+    }
+    auto conf_metrics = conf_root["metrics"];
+    if (conf_metrics.type() == Json::objectValue)
+    {
+        metrics_address = conf_metrics.get("address", metrics_address).asString();
+        metrics_port = conf_metrics.get("port", 0).asInt();
+        metrics_interval = conf_metrics.get("interval", 0).asInt();
     }
     auto conf_mqtt = conf_root["mqtt"];
     if (conf_mqtt.type() == Json::objectValue)
     {
-        mqtt_broker = conf_mqtt["broker"].asString();
+        // "broker" for a single one, "brokers" for a list
+        mqtt_brokers.clear();
+        if (conf_mqtt["brokers"].type() == Json::arrayValue)
+        {
+            for (auto& broker: conf_mqtt["brokers"])
+                mqtt_brokers.push_back(broker.asString());
+        }
+        else
+        {
+            mqtt_brokers.push_back(conf_mqtt["broker"].asString());
+        }
+        mqtt_client.SetFailback(conf_mqtt.get("failback", true).asBool(),
+                                seconds(conf_mqtt.get("failback_delay", 30).asInt()));
+        mqtt_client.SetConnectTimeout(seconds(conf_mqtt.get("connect_timeout", 5).asInt()));
         mqtt_prefix = conf_mqtt["prefix"].asString();
         mqtt_ha_prefix = conf_mqtt["ha_prefix"].asString();
         mqtt_dev_prefix = conf_mqtt["device_prefix"].asString();
-    }
-}
+        mqtt_ha_status = conf_mqtt.get("ha_status_topic", mqtt_ha_status).asString();
+        state_publisher.SetPrefix(mqtt_prefix);
+        if (conf_mqtt.isMember("snapshot_topic"))
+            state_publisher.SetSnapshotTopic(conf_mqtt["snapshot_topic"].asString());
 
-shared_ptr<uvw::PollHandle> mqtt_start_poll(shared_ptr<uvw::Loop> uvloop, MqttClient *client)
-{
-    int s = client->GetSocket();
-    auto loop_mqtt_poll = uvloop->resource<uvw::PollHandle>(s);
-    loop_mqtt_poll->on<uvw::PollEvent>([client](uvw::PollEvent &event, uvw::PollHandle&)
+        // {"bytes": N, "inflight": N, "<class>": {"qos": N, "limit": N, "replace": bool}}
+        auto& conf_queue = conf_mqtt["queue"];
+        if (conf_queue.type() == Json::objectValue)
         {
-            if (event.flags & uvw::PollHandle::Event::READABLE)
+            auto& queue = mqtt_client.GetQueue();
+            queue.SetMaxBytes(conf_queue.get("bytes", 256 * 1024).asUInt());
+            mqtt_client.SetMaxInflight(conf_queue.get("inflight", 8).asUInt());
+            for (int cls = 0; cls < OutboundQueue::ClassCount; cls++)
             {
-                client->Poll();
-                Log::Message("mqtt poll done");
+                auto& conf_class = conf_queue[OutboundQueue::ClassStr((OutboundQueue::Class)cls)];
+                if (conf_class.type() != Json::objectValue)
+                    continue;
+                auto c = (OutboundQueue::Class)cls;
+                queue.SetClass(c,
+                               conf_class.get("qos", queue.GetQos(c)).asInt(),
+                               conf_class.get("limit", (Json::UInt64)queue.GetLimit(c)).asUInt64(),
+                               conf_class.get("replace", queue.GetReplace(c)).asBool());
             }
-            if (event.flags & uvw::PollHandle::Event::DISCONNECT)
-            {
-                Log::Message("mqtt: disconnect event");
-            }
-        });
-    loop_mqtt_poll->start(uvw::Flags(uvw::PollHandle::Event::READABLE) | uvw::Flags(uvw::PollHandle::Event::DISCONNECT));
-    Log::Message("Started polling mqtt socket " + to_string(s));
-
-    return loop_mqtt_poll;
+        }
+    }
 }
 
-void publish_state(Door& door)
+// Everything except the sensors, which decide whether a door can be
+// updated in place. Missing keys fall back to the defaults, so removing a
+// setting on a reload undoes it.
+void configure_door(Door& door, const Json::Value& conf_door, const Json::Value& conf_cal)
 {
-    string state_str;
-    switch (door.GetState())
+    if (conf_door.isMember("open_btn") && conf_door["open_btn"].type() == Json::arrayValue)
     {
-    case Door::Open:
-        state_str = "open";
-        break;
-    case Door::Opening:
-    case Door::OpeningSensed:
-        state_str = "opening";
-        break;
-    case Door::Closed:
-    case Door::OpenStart:
-        state_str = "closed";
-        break;
-    case Door::Closing:
-        state_str = "closing";
-        break;
+        auto& btn = conf_door["open_btn"];
+        door.SetOpenBtn(btn[0].asString(),
+                        btn[1].asInt(),
+                        btn[2].asBool());
+    }
+    else
+    {
+        door.ClearOpenBtn();
     }
-    mqtt_client.PublishTopic(mqtt_prefix + to_string(door.GetIndex()) + "/state", state_str, true);
+    if (conf_door.isMember("close_btn") && conf_door["close_btn"].type() == Json::arrayValue)
+    {
+        auto& btn = conf_door["close_btn"];
+        door.SetCloseBtn(btn[0].asString(),
+                         btn[1].asInt(),
+                         btn[2].asBool());
+    }
+    else
+    {
+        door.ClearCloseBtn();
+    }
+    door.SetOpenTime(conf_door.get("open_time", 10000).asInt());
+    door.SetCloseTime(conf_door.get("close_time", 10000).asInt());
+    door.SetOpenStartTime(conf_door.get("open_start_time", 4000).asInt());
+    door.SetPulseTime(conf_door.get("pulse_time", 300).asInt());
+    door.SetIntentExpiry(conf_door.get("intent_expiry", 30000).asInt());
+    door.SetHealthLimits(conf_door.get("chatter_changes", 20).asInt(),
+                         conf_door.get("stuck_after", 2).asInt());
+    int debounce_ms = conf_door.get("debounce_ms", 0).asInt();
+    door.SetDebounce(debounce_ms,
+                     conf_door.get("stable_ms", 50).asInt(),
+                     conf_door.get("glitch_ms", 10).asInt());
+    if (conf_door.isMember("open_limit"))
+    {
+        door.SetDebounce(debounce_ms,
+                         conf_door.get("open_limit_stable_ms", 50).asInt(),
+                         conf_door.get("open_limit_glitch_ms", 10).asInt(),
+                         DoorBank::ChOpenLimit);
+    }
+    if (conf_door.isMember("obstruction"))
+    {
+        door.SetDebounce(debounce_ms,
+                         conf_door.get("obstruction_stable_ms", 50).asInt(),
+                         conf_door.get("obstruction_glitch_ms", 10).asInt(),
+                         DoorBank::ChObstruction);
+    }
+    if (conf_cal.type() == Json::objectValue)
+    {
+        door.SetCalibration(conf_cal.get("enabled", true).asBool(),
+                            conf_cal.get("min_factor", 0.25).asDouble(),
+                            conf_cal.get("max_factor", 2.0).asDouble());
+    }
+    else
+    {
+        door.SetCalibration(false, 0.25, 2.0);
+    }
+}
+
+// main loop side of a state change
+void report_state(int index, Door::State state)
+{
+    if (state != Door::InitSensing)
+        startup_timeline.DoorSensed(index);
+    state_publisher.Update(index, state);
+}
+
+void publish_state(Door& door)
+{
+    report_state(door.GetIndex(), door.GetState());
+}
+
+// Called from the GPIO side. In threaded mode the main loop owns MQTT, so
+// the change is queued for it instead of published directly.
+void notify_state(Door& door)
+{
+    Log::Message("main: state changed!");
+    if (gpio_thread)
+        gpio_thread->PostEvent({door.GetIndex(), GpioThread::event::StateChange, (uint8_t)door.GetState(), 0, nullptr});
+    else
+        publish_state(door);
+}
+
+// main loop side, retained so a subscriber sees a faulty door right away
+void report_health(int index, SensorHealth::Status status)
+{
+    door_health[index] = status;
+    mqtt_client.PublishTopic(mqtt_prefix + to_string(index) + "/fault", SensorHealth::StatusStr(status), true, OutboundQueue::ClassState);
+}
+
+void notify_health(Door& door)
+{
+    auto status = door.GetHealth().GetStatus();
+    if (gpio_thread)
+        gpio_thread->PostEvent({door.GetIndex(), GpioThread::event::Health, (uint8_t)status, 0, nullptr});
+    else
+        report_health(door.GetIndex(), status);
+}
+
+string availability_topic()
+{
+    return mqtt_prefix + "availability";
 }
 
-void publish_discovery(Door& door)
+shared_ptr<const string> build_discovery(int door_index)
 {
     Json::Value disc(Json::objectValue);
-    string index = to_string(door.GetIndex());
+    string index = to_string(door_index);
 
     disc["name"] = mqtt_dev_prefix + index;
     disc["unique_id"] = mqtt_dev_prefix + index;
@@ -143,11 +385,593 @@ void publish_discovery(Door& door)
     disc["command_topic"] = mqtt_prefix + index + "/command";
     disc["payload_open"] = "open";
     disc["payload_close"] = "close";
+    disc["availability_topic"] = availability_topic();
+    disc["payload_available"] = "online";
+    disc["payload_not_available"] = "offline";
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return make_shared<const string>(Json::writeString(builder, disc));
+}
+
+void publish_discovery(int door_index)
+{
+    auto& payload = discovery_payloads[door_index];
+    if (!payload)
+        payload = build_discovery(door_index);
+    mqtt_client.PublishTopic(mqtt_ha_prefix + mqtt_dev_prefix + to_string(door_index) + "/config", *payload, true, OutboundQueue::ClassDiscovery);
+}
+
+// everything retained that describes the agent and its doors, on every
+// connect and whenever Home Assistant comes back
+void announce_doors()
+{
+    mqtt_client.PublishTopic(availability_topic(), "online", true, OutboundQueue::ClassState);
+    for (int index: door_indexes)
+    {
+        publish_discovery(index);
+        // doors that never reported are healthy
+        mqtt_client.PublishTopic(mqtt_prefix + to_string(index) + "/fault",
+                                 SensorHealth::StatusStr(door_health[index]), true, OutboundQueue::ClassState);
+    }
+}
+
+// an empty retained config makes Home Assistant drop the entity
+void clear_discovery(int door_index)
+{
+    discovery_payloads.erase(door_index);
+    mqtt_client.PublishTopic(mqtt_ha_prefix + mqtt_dev_prefix + to_string(door_index) + "/config", "", true, OutboundQueue::ClassDiscovery);
+}
+
+Door *find_door(int door_index)
+{
+    for (auto& door: doors)
+    {
+        if (door.GetIndex() == door_index)
+            return &door;
+    }
+    return nullptr;
+}
+
+// main loop side, checks against door_indexes since the door list may
+// belong to the GPIO thread
+bool parse_door_index(string_view index, int& door_index)
+{
+    auto result = from_chars(index.data(), index.data() + index.size(), door_index);
+    if (result.ec != errc{} || result.ptr != index.data() + index.size())
+        return false;
+    return door_indexes.count(door_index) > 0;
+}
+
+// main loop side of a flight recorder dump
+void write_flight_dump(int door_index, const string& dump)
+{
+    string index = to_string(door_index);
+    if (!fdr_dir.empty())
+    {
+        auto stamp = duration_cast<seconds>(system_clock::now().time_since_epoch()).count();
+        string path = fdr_dir + "/door" + index + "-" + to_string(stamp) + ".fdr";
+        ofstream out{path, ios::binary | ios::trunc};
+        out.write(dump.data(), dump.size());
+        if (out.good())
+            Log::Message("main: flight recorder for door " + index + " dumped to " + path);
+        else
+            Log::Error("main: can't write flight recorder dump " + path);
+    }
+    if (fdr_mqtt)
+    {
+        mqtt_client.PublishTopic(mqtt_prefix + index + "/flight", dump, false, OutboundQueue::ClassLog);
+    }
+}
+
+string history_path(int door_index)
+{
+    return history_dir + "/door" + to_string(door_index) + ".hist";
+}
+
+void open_history(Door& door)
+{
+    if (history_dir.empty() || offline_run)
+        return;
+    auto history = make_unique<EventHistory>();
+    if (history->Open(history_path(door.GetIndex()), door.GetIndex(), history_records))
+        door.SetHistory(move(history));
+}
+
+// JSON array of the transitions in [from, to), oldest first
+string history_json(const EventHistory& history, uint64_t from, uint64_t to, size_t limit)
+{
+    Json::Value result(Json::arrayValue);
+    history.Query(from, to, limit, [&result](const EventHistory::record& r)
+        {
+            Json::Value ev(Json::objectValue);
+            ev["time"] = Json::UInt64(r.time);
+            ev["from"] = Door::StateStr((Door::State)r.from);
+            ev["to"] = Door::StateStr((Door::State)r.to);
+            ev["duration"] = r.duration;
+            result.append(ev);
+        });
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    return Json::writeString(builder, result);
+}
+
+const char *travel_names[] = {"open_start", "open", "close"};
+
+void load_calibration()
+{
+    if (calibration_file.empty())
+        return;
+
+    ifstream cal_stream{calibration_file};
+    if (!cal_stream.good())
+        return;
+
+    Json::Value cal_root;
+    Json::CharReaderBuilder builder;
+    string errors;
+    if (!Json::parseFromStream(builder, cal_stream, &cal_root, &errors))
+    {
+        Log::Warning("main: ignoring broken calibration file " + calibration_file);
+        return;
+    }
+
+    for (auto& door: doors)
+    {
+        auto& saved = cal_root[to_string(door.GetIndex())];
+        for (int travel = Door::TravelOpenStart; travel <= Door::TravelClose; travel++)
+            door.GetEstimator((Door::Travel)travel).Load(saved[travel_names[travel]]);
+        door.UpdateTimeouts();
+    }
+    Log::Message("main: loaded calibration from " + calibration_file);
+}
+
+// main loop side, written next to the old file and renamed over it so a
+// crash never leaves half a file behind
+void write_calibration(const string& data)
+{
+    string tmp_path = calibration_file + ".tmp";
+    ofstream out{tmp_path, ios::trunc};
+    out << data;
+    out.close();
+    if (!out.good() || rename(tmp_path.c_str(), calibration_file.c_str()) != 0)
+        Log::Error("main: can't write calibration file " + calibration_file);
+}
+
+// GPIO side, runs from a timer and only writes when something was learned
+void save_calibration()
+{
+    bool dirty = false;
+    for (auto& door: doors)
+        dirty |= door.TakeCalibrationDirty();
+    if (!dirty || calibration_file.empty())
+        return;
+
+    Json::Value cal_root(Json::objectValue);
+    for (auto& door: doors)
+    {
+        auto& saved = cal_root[to_string(door.GetIndex())];
+        for (int travel = Door::TravelOpenStart; travel <= Door::TravelClose; travel++)
+            saved[travel_names[travel]] = door.GetEstimator((Door::Travel)travel).Save();
+    }
+    string data = cal_root.toStyledString();
+
+    if (gpio_thread)
+        gpio_thread->PostEvent({0, GpioThread::event::Calibration, 0, 0, new string{move(data)}});
+    else
+        write_calibration(data);
+}
+
+void dump_flight_recorder(Door& door, FlightRecorder::FaultType reason)
+{
+    if (!fdr_enabled)
+        return;
+    string dump = door.GetRecorder().Serialize(GpioBackend::Get().Now(), door.GetIndex(), reason);
+    if (gpio_thread)
+        gpio_thread->PostEvent({door.GetIndex(), GpioThread::event::Dump, 0, (uint8_t)reason, new string{move(dump)}});
+    else
+        write_flight_dump(door.GetIndex(), dump);
+}
+
+// sensor edges and commands switch to fast polling right away instead of
+// waiting for the next slow tick
+void start_fast_poll()
+{
+    if (!fast_polling)
+    {
+        loop_timer->start(poll_time_fast, poll_time_fast);
+        fast_polling = true;
+        poll_interval = poll_time_fast;
+        last_poll = {};
+        Log::Message("main: start fast polling");
+    }
+}
+
+void publish_command_result(int door_index, const string& payload)
+{
+    mqtt_client.PublishTopic(mqtt_prefix + to_string(door_index) + "/command/result", payload);
+}
+
+// GPIO side, a command ran, was queued or its intent ended
+void report_command_result(Door& door, FlightRecorder::CommandType cmd, Door::CommandResult result, int waited_ms)
+{
+    Json::Value res(Json::objectValue);
+    res["command"] = cmd == FlightRecorder::CmdOpen ? "open" : "close";
+    res["result"] = Door::ResultStr(result);
+    const char *state = StatePublisher::StatePayload(door.GetState());
+    res["state"] = state != nullptr ? state : "sensing";
+    res["waited"] = waited_ms;
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    string payload = Json::writeString(builder, res);
+    if (gpio_thread)
+        gpio_thread->PostEvent({door.GetIndex(), GpioThread::event::CommandResult, 0, (uint8_t)result, new string{move(payload)}});
+    else
+        publish_command_result(door.GetIndex(), payload);
+}
+
+void run_command(Door& door, FlightRecorder::CommandType cmd)
+{
+    switch (cmd)
+    {
+    case FlightRecorder::CmdOpen:
+    case FlightRecorder::CmdClose:
+        door.Request(cmd);
+        break;
+    case FlightRecorder::CmdDump:
+        door.GetRecorder().Record(GpioBackend::Get().Now(), FlightRecorder::Command, FlightRecorder::CmdDump);
+        dump_flight_recorder(door, FlightRecorder::FaultRequested);
+        break;
+    default:
+        door.GetRecorder().Record(GpioBackend::Get().Now(), FlightRecorder::Command, FlightRecorder::CmdUnknown);
+        break;
+    }
+    start_fast_poll();
+    notify_state(door);
+}
+
+// Feeds the steps of an offline backend (a simulation script or a
+// recorded trace) through the door logic on its virtual clock, as fast as
+// it goes. State changes are printed with their offset from the start, so
+// two runs can be diffed.
+int run_offline()
+{
+    auto& backend = GpioBackend::Get();
+    backend.RequestInputs();
+    door_by_slot.resize(door_bank.Size());
+    for (auto& door: doors)
+        door_by_slot[door.GetSlot()] = &door;
+
+    auto start = backend.Now();
+    auto started = steady_clock::now();
+    unsigned long ticks = 0, edges = 0, changes = 0;
+    auto print_change = [&start, &changes](Door& door, steady_clock::time_point time)
+        {
+            auto offset = duration_cast<milliseconds>(time - start).count();
+            cout << offset / 1000 << "." << setw(3) << setfill('0') << offset % 1000 << setfill(' ')
+                 << " door " << door.GetIndex() << " " << Door::StateStr(door.GetState()) << endl;
+            changes++;
+        };
+
+    GpioBackend::step next;
+    while (backend.NextStep(next))
+    {
+        if (next.kind == GpioBackend::step::Tick)
+        {
+            ticks++;
+            backend.ReadInputs();
+            for (auto& door: doors)
+                door.Sample(next.time);
+            auto& changed = door_bank.Update(next.time, [&next](size_t slot)
+                {
+                    return door_by_slot[slot]->Evaluate(next.time);
+                });
+            for (size_t word = 0; word < changed.size(); word++)
+            {
+                for (uint64_t bits = changed[word]; bits != 0; bits &= bits - 1)
+                    print_change(*door_by_slot[word * 64 + __builtin_ctzll(bits)], next.time);
+            }
+        }
+        else
+        {
+            edges++;
+            for (auto& door: doors)
+            {
+                if (door.GetSensorInput() == next.input && door.HandleSensorEvent())
+                    print_change(door, next.time);
+            }
+        }
+    }
+
+    auto simulated = duration_cast<seconds>(backend.Now() - start).count();
+    auto took = duration_cast<milliseconds>(steady_clock::now() - started).count();
+    cerr << ticks << " ticks, " << edges << " edges, " << changes << " state changes; "
+         << simulated << " s simulated in " << took << " ms" << endl;
+    return 0;
+}
+
+shared_ptr<uvw::PollHandle> sensor_start_poll(shared_ptr<uvw::Loop> uvloop, Door *door, function<void()> on_edge)
+{
+    int fd = door->GetSensorFd();
+    auto sensor_poll = uvloop->resource<uvw::PollHandle>(fd);
+    sensor_poll->on<uvw::PollEvent>([door, on_edge](uvw::PollEvent &event, uvw::PollHandle&)
+        {
+            if (event.flags & uvw::PollHandle::Event::READABLE)
+            {
+                if (door->HandleSensorEvent())
+                    notify_state(*door);
+                // a chattering sensor would keep everything in fast polling
+                if (!door->GetFault())
+                    on_edge();
+            }
+        });
+    sensor_poll->start(uvw::PollHandle::Event::READABLE);
+    Log::Message("Started polling sensor events for door " + to_string(door->GetIndex()) + " on fd " + to_string(fd));
+
+    return sensor_poll;
+}
+
+// GPIO side, hooks a door up to the schedulers once its lines are requested
+void attach_door(Door& door)
+{
+    Door *doorp = &door;
+    if (door_by_slot.size() < door_bank.Size())
+        door_by_slot.resize(door_bank.Size());
+    door_by_slot[door.GetSlot()] = doorp;
+    door.SetPulseScheduler(pulse_scheduler.get());
+    door.SetFaultHandler(dump_flight_recorder);
+    door.SetResultHandler(report_command_result);
+    door.SetHealthHandler(notify_health);
+    door.SetDeadlineScheduler(deadline_scheduler.get(), [doorp]()
+        {
+            if (doorp->HandleDeadline())
+                notify_state(*doorp);
+        });
+    if (sensor_events && door.GetSensorFd() >= 0)
+        sensor_polls[door.GetIndex()] = sensor_start_poll(gpio_loop, doorp, start_fast_poll);
+}
+
+void publish_startup()
+{
+    Log::Message("main: startup: ", startup_timeline.Summary());
+    mqtt_client.PublishTopic(mqtt_prefix + "startup", startup_timeline.Json(), true, OutboundQueue::ClassMetrics);
+}
+
+void detach_door(Door& door)
+{
+    if (startup_timeline.DoorRemoved(door.GetIndex()))
+        publish_startup();
+    // the poll goes first, releasing the line closes its fd
+    auto poll_iter = sensor_polls.find(door.GetIndex());
+    if (poll_iter != sensor_polls.end())
+    {
+        poll_iter->second->close();
+        sensor_polls.erase(poll_iter);
+    }
+    if (door.GetSlot() < door_by_slot.size())
+        door_by_slot[door.GetSlot()] = nullptr;
+    door.Release();
+}
+
+// the inputs are fixed for the life of a Door, changing one means a new one
+bool sensors_changed(const Json::Value& conf_door, const Json::Value& applied)
+{
+    for (auto key: {"closed_sensor", "open_limit", "obstruction"})
+    {
+        if (conf_door[key] != applied[key])
+            return true;
+    }
+    return false;
+}
+
+// GPIO side. Brings the doors in line with the doors section: a door whose
+// entry is unchanged is not touched at all, a new sensor line means the
+// door is sensed from scratch (keeping its calibration), anything else is
+// updated in place and keeps its state and debounce history.
+void apply_doors(const Json::Value& conf_root)
+{
+    auto& conf_doors = conf_root["doors"];
+    auto& conf_cal = conf_root["calibration"];
+    if (conf_doors.type() != Json::arrayValue)
+        Log::Error("No doors defined in configuration");
+
+    map<int, const Json::Value*> wanted;
+    for (auto& conf_door: conf_doors)
+    {
+        if (conf_door.isMember("index"))
+            wanted[conf_door["index"].asInt()] = &conf_door;
+    }
 
-    ostringstream ss;
-    ss << disc;
+    bool running = deadline_scheduler != nullptr;
+    bool cal_changed = conf_cal != door_calibration;
+    map<int, array<TravelEstimator, 3>> kept_estimators;
+    for (auto iter = doors.begin(); iter != doors.end();)
+    {
+        int index = iter->GetIndex();
+        auto want = wanted.find(index);
+        const Json::Value& applied = door_configs[index];
+        if (want == wanted.end() || sensors_changed(*want->second, applied))
+        {
+            if (want == wanted.end())
+            {
+                Log::Message("main: reload: removing door ", index);
+            }
+            else
+            {
+                Log::Message("main: reload: sensors of door ", index, " changed, sensing it again");
+                for (int travel = Door::TravelOpenStart; travel <= Door::TravelClose; travel++)
+                    kept_estimators[index][travel] = iter->GetEstimator((Door::Travel)travel);
+            }
+            detach_door(*iter);
+            iter = doors.erase(iter);
+            door_configs.erase(index);
+            continue;
+        }
+        if (*want->second != applied || cal_changed)
+        {
+            if (running)
+                Log::Message("main: reload: updating door ", index);
+            configure_door(*iter, *want->second, conf_cal);
+            door_configs[index] = *want->second;
+        }
+        wanted.erase(want);
+        iter++;
+    }
 
-    mqtt_client.PublishTopic(mqtt_ha_prefix + mqtt_dev_prefix + index + "/config", ss.str(), true);
+    vector<Door*> added;
+    for (auto& [index, conf_door]: wanted)
+    {
+        if (running)
+            Log::Message("main: reload: adding door ", index);
+        auto& new_door = doors.emplace_back(index, door_bank);
+        if (conf_door->isMember("closed_sensor") && (*conf_door)["closed_sensor"].type() == Json::arrayValue)
+        {
+            auto& sensor = (*conf_door)["closed_sensor"];
+            new_door.SetClosedSensor(sensor[0].asString(),
+                                     sensor[1].asInt(),
+                                     sensor[2].asBool(),
+                                     sensor_events);
+        }
+        if (conf_door->isMember("open_limit") && (*conf_door)["open_limit"].type() == Json::arrayValue)
+        {
+            auto& sensor = (*conf_door)["open_limit"];
+            new_door.SetOpenSensor(sensor[0].asString(),
+                                   sensor[1].asInt(),
+                                   sensor[2].asBool());
+        }
+        if (conf_door->isMember("obstruction") && (*conf_door)["obstruction"].type() == Json::arrayValue)
+        {
+            auto& sensor = (*conf_door)["obstruction"];
+            new_door.SetObstructionSensor(sensor[0].asString(),
+                                          sensor[1].asInt(),
+                                          sensor[2].asBool());
+        }
+        configure_door(new_door, *conf_door, conf_cal);
+        open_history(new_door);
+        auto kept = kept_estimators.find(index);
+        if (kept != kept_estimators.end())
+        {
+            for (int travel = Door::TravelOpenStart; travel <= Door::TravelClose; travel++)
+                new_door.GetEstimator((Door::Travel)travel) = kept->second[travel];
+            new_door.UpdateTimeouts();
+        }
+        door_configs[index] = *conf_door;
+        added.push_back(&new_door);
+    }
+    door_calibration = conf_cal;
+
+    // at startup main requests the lines and attaches the doors itself
+    if (running && !added.empty())
+    {
+        GpioBackend::Get().RequestInputs();
+        for (auto doorp: added)
+            attach_door(*doorp);
+        start_fast_poll();
+    }
+}
+
+set<int> config_door_indexes(const Json::Value& conf_root)
+{
+    set<int> indexes;
+    for (auto& conf_door: conf_root["doors"])
+    {
+        if (conf_door.isMember("index"))
+            indexes.insert(conf_door["index"].asInt());
+    }
+    return indexes;
+}
+
+void load_config(string config_file)
+{
+    ifstream config_stream{config_file};
+
+    if (!config_stream.good())
+    {
+        throw system_error{};
+    }
+
+    Json::Value conf_root;
+    config_stream >> conf_root;
+
+    apply_settings(conf_root, true);
+    apply_doors(conf_root);
+    door_indexes = config_door_indexes(conf_root);
+    running_config = conf_root;
+}
+
+// Main loop side of a reload, the GPIO side applies the door changes from
+// its own loop. Discovery follows the door set right away.
+void apply_reload(shared_ptr<const Json::Value> conf_root)
+{
+    apply_settings(*conf_root, false);
+
+    auto new_indexes = config_door_indexes(*conf_root);
+    for (int index: door_indexes)
+    {
+        if (new_indexes.count(index) == 0)
+        {
+            clear_discovery(index);
+            state_publisher.Remove(index);
+            door_health.erase(index);
+            mqtt_client.PublishTopic(mqtt_prefix + to_string(index) + "/fault", "", true, OutboundQueue::ClassState);
+        }
+    }
+    for (int index: new_indexes)
+    {
+        if (door_indexes.count(index) == 0)
+            publish_discovery(index);
+    }
+    door_indexes = new_indexes;
+
+    if (gpio_thread)
+    {
+        atomic_store(&reload_root, conf_root);
+        post_gpio_command({-1, CmdReload});
+    }
+    else
+    {
+        apply_doors(*conf_root);
+    }
+    running_config = *conf_root;
+    Log::Message("main: reloaded " + config_file);
+}
+
+// Reading and parsing happen on the libuv thread pool, away from both
+// loops; a file that doesn't parse leaves everything as it was.
+void reload_config()
+{
+    if (config_file.empty())
+        return;
+
+    auto conf_root = make_shared<Json::Value>();
+    auto errors = make_shared<string>();
+    auto work = uvw::Loop::getDefault()->resource<uvw::WorkReq>([conf_root, errors]()
+        {
+            ifstream config_stream{config_file};
+            Json::CharReaderBuilder builder;
+            if (!config_stream.good())
+                *errors = "can't open file";
+            else if (!Json::parseFromStream(builder, config_stream, conf_root.get(), errors.get()) && errors->empty())
+                *errors = "parse error";
+        });
+    work->on<uvw::WorkEvent>([conf_root, errors](uvw::WorkEvent&, uvw::WorkReq&)
+        {
+            if (!errors->empty())
+            {
+                Log::Error("main: not reloading " + config_file + ": " + *errors);
+                return;
+            }
+            if (*conf_root == running_config)
+                return;
+            apply_reload(conf_root);
+        });
+    work->on<uvw::ErrorEvent>([](uvw::ErrorEvent& err, uvw::WorkReq&)
+        {
+            Log::Error("main: config reload failed: ", err.what());
+        });
+    work->queue();
 }
 
 int main(int argc, char **argv)
@@ -163,6 +987,13 @@ int main(int argc, char **argv)
         ("help", "Show help message")
         ("version", "Show version information")
         ("config", po::value<string>(), "Main configuration file")
+        ("decode", po::value<string>(), "Decode a flight recorder dump and exit")
+        ("simulate", po::value<string>(), "Use simulated GPIO driven by a waveform script")
+        ("offline", "With --simulate, run the script on a virtual clock and exit")
+        ("record", po::value<string>(), "Record the GPIO input streams to a trace file")
+        ("replay", po::value<string>(), "Replay a GPIO trace through the door logic and exit")
+        ("history", po::value<string>(), "Print the state changes in a door history file and exit")
+        ("limit", po::value<size_t>(), "With --history, only the newest N state changes")
         ;
 
     po::variables_map vm;
@@ -181,77 +1012,482 @@ int main(int argc, char **argv)
         return 0;
     }
 
+    if (vm.count("decode"))
+    {
+        ifstream dump_stream{vm["decode"].as<string>(), ios::binary};
+        string dump{istreambuf_iterator<char>(dump_stream), istreambuf_iterator<char>()};
+        if (!FlightRecorder::Decode(dump, cout))
+        {
+            cerr << "not a valid flight recorder dump" << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (vm.count("history"))
+    {
+        EventHistory history;
+        if (!history.OpenRead(vm["history"].as<string>()))
+        {
+            cerr << "not a valid history file" << endl;
+            return 1;
+        }
+        size_t limit = vm.count("limit") ? vm["limit"].as<size_t>() : history.GetCapacity();
+        history.Query(0, UINT64_MAX, limit, [](const EventHistory::record& r)
+            {
+                time_t secs = r.time / 1000;
+                char stamp[32];
+                strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+                cout << stamp << "." << setw(3) << setfill('0') << r.time % 1000 << setfill(' ') << " "
+                     << Door::StateStr((Door::State)r.from) << " -> " << Door::StateStr((Door::State)r.to)
+                     << " after " << r.duration << " ms" << endl;
+            });
+        return 0;
+    }
+
+    // the backend has to be in place before the doors add their lines
+    bool offline = false;
+    if (vm.count("replay"))
+    {
+        auto replay = make_unique<GpioTraceReplay>();
+        if (!replay->Load(vm["replay"].as<string>()))
+        {
+            cerr << "not a valid GPIO trace" << endl;
+            return 1;
+        }
+        GpioBackend::Set(move(replay));
+        offline = true;
+        offline_run = true;
+    }
+    else if (vm.count("simulate"))
+    {
+        offline = vm.count("offline") > 0;
+        offline_run = offline;
+        auto sim = make_unique<SimBackend>(offline);
+        if (!sim->LoadScript(vm["simulate"].as<string>()))
+        {
+            cerr << "can't load simulation script" << endl;
+            return 1;
+        }
+        GpioBackend::Set(move(sim));
+    }
+    else if (vm.count("record"))
+    {
+        auto recorder = make_unique<GpioTraceRecorder>(make_unique<GpioRegistry>(), vm["record"].as<string>());
+        if (!recorder->IsOpen())
+        {
+            cerr << "can't open trace file" << endl;
+            return 1;
+        }
+        GpioBackend::Set(move(recorder));
+    }
+
     if (vm.count("config"))
     {
-        Log::Message("main: loading " + vm["config"].as<string>());
-        load_config(vm["config"].as<string>());
+        config_file = vm["config"].as<string>();
+        Log::Message("main: loading " + config_file);
+        load_config(config_file);
     }
+    startup_timeline.Mark("config");
 
+    // log output is configured now, hand formatting and writes off to
+    // the background thread
+    Log::Start();
+
+    if (offline)
+    {
+        int result = run_offline();
+        Log::Stop();
+        return result;
+    }
+
+    // start connecting first, the handshake with the broker goes on while
+    // the GPIO side is set up and the doors are sensed
     auto uvloop = uvw::Loop::getDefault();
-    auto loop_timer = uvloop->resource<uvw::TimerHandle>();
-    loop_timer->start(1s, poll_time_fast);
-    shared_ptr<uvw::PollHandle> loop_mqtt_poll;
-    bool fast_polling = true;
+    mqtt_client.Attach(uvloop);
+    state_publisher.Attach(uvloop);
+    // the broker marks everything unavailable if the agent goes away
+    mqtt_client.SetWill(availability_topic(), "offline");
+    mqtt_client.Connect(mqtt_brokers);
+    startup_timeline.Mark("mqtt_connecting");
+
+    GpioBackend::Get().RequestInputs();
+    load_calibration();
+    startup_timeline.Mark("gpio");
+    startup_timeline.Expect(door_indexes);
+
+    // in threaded mode everything touching GPIO lives on a second loop,
+    // the default loop keeps MQTT and publishing
+    gpio_loop = gpio_threaded ? uvw::Loop::create() : uvloop;
+    if (gpio_threaded)
+    {
+        gpio_thread = make_unique<GpioThread>(uvloop, gpio_loop);
+        gpio_thread->SetPriority(gpio_priority);
+        gpio_thread->SetCpu(gpio_cpu);
+        gpio_thread->SetCommandHandler([](const GpioThread::command& cmd)
+            {
+                if (cmd.action == CmdReload)
+                {
+                    apply_doors(*atomic_load(&reload_root));
+                    return;
+                }
+                if (cmd.action == CmdResync)
+                {
+                    for (auto& door: doors)
+                    {
+                        notify_state(door);
+                        notify_health(door);
+                    }
+                    return;
+                }
+                Door *doorp = find_door(cmd.index);
+                if (doorp != nullptr)
+                    run_command(*doorp, (FlightRecorder::CommandType)cmd.action);
+            });
+        gpio_thread->SetEventHandler([](GpioThread::event& ev)
+            {
+                if (ev.kind == GpioThread::event::StateChange)
+                {
+                    // may still be in flight for a door a reload removed
+                    if (door_indexes.count(ev.index) > 0)
+                        report_state(ev.index, (Door::State)ev.state);
+                }
+                else if (ev.kind == GpioThread::event::Dump)
+                {
+                    write_flight_dump(ev.index, *ev.dump);
+                    delete ev.dump;
+                }
+                else if (ev.kind == GpioThread::event::Calibration)
+                {
+                    write_calibration(*ev.dump);
+                    delete ev.dump;
+                }
+                else if (ev.kind == GpioThread::event::CommandResult)
+                {
+                    publish_command_result(ev.index, *ev.dump);
+                    delete ev.dump;
+                }
+                else if (ev.kind == GpioThread::event::Health)
+                {
+                    if (door_indexes.count(ev.index) > 0)
+                        report_health(ev.index, (SensorHealth::Status)ev.state);
+                }
+            });
+        command_retry_timer = uvloop->resource<uvw::TimerHandle>();
+        command_retry_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle& timer)
+            {
+                while (!pending_commands.empty() && gpio_thread->PostCommand(pending_commands.front()))
+                    pending_commands.pop_front();
+                if (pending_commands.empty())
+                    timer.stop();
+            });
+        // a dropped state change would leave a stale state retained
+        gpio_thread->SetOverflowHandler([]()
+            {
+                Log::Warning("main: GPIO event queue overflowed, resyncing all doors");
+                post_gpio_command({-1, CmdResync});
+            });
+    }
 
-    loop_timer->on<uvw::TimerEvent>([&uvloop, &fast_polling, &loop_timer](uvw::TimerEvent&, uvw::TimerHandle&)
+    pulse_scheduler = make_unique<PulseScheduler>(gpio_loop);
+    deadline_scheduler = make_unique<DeadlineScheduler>(gpio_loop);
+    for (auto& door: doors)
+        attach_door(door);
+
+    loop_timer = gpio_loop->resource<uvw::TimerHandle>();
+    loop_timer->start(0ms, poll_time_burst);
+    poll_interval = poll_time_burst;
+
+    loop_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
         {
             Log::Trace("Poll timer");
-            bool fast_poll_new = false;
+            // edge inputs are kept up to date by their events
+            GpioBackend::Get().ReadInputs(false);
+            auto time_now = steady_clock::now();
+
+            // how late (or early) this sample is against the timer period,
+            // the startup burst is too fast to say anything about that
+            if (last_poll != steady_clock::time_point{} && !burst_polling)
+            {
+                auto jitter = duration_cast<microseconds>(time_now - last_poll - poll_interval).count();
+                (poll_interval == poll_time_fast ? poll_jitter_fast : poll_jitter_slow).Add(jitter < 0 ? -jitter : jitter);
+            }
+            last_poll = time_now;
+
             for (auto& door: doors)
             {
-                if (door.UpdateState())
+                door.Sample(time_now);
+            }
+
+            // the bank shifts every debounce register at once and only runs
+            // the state machine of doors that could change
+            auto& changed = door_bank.Update(time_now, [&time_now](size_t slot)
                 {
-                    Log::Message("main: state changed!");
-                    publish_state(door);
-                }
-                if (door.NeedFastPoll())
+                    return door_by_slot[slot]->Evaluate(time_now);
+                });
+            for (size_t word = 0; word < changed.size(); word++)
+            {
+                for (uint64_t bits = changed[word]; bits != 0; bits &= bits - 1)
                 {
-                    fast_poll_new = true;
+                    notify_state(*door_by_slot[word * 64 + __builtin_ctzll(bits)]);
                 }
             }
-            mqtt_client.Poll();
+
+            if (burst_polling)
+            {
+                if (burst_start == steady_clock::time_point{})
+                    burst_start = time_now;
+                bool sensing = any_of(doors.begin(), doors.end(), [](const Door& door)
+                    {
+                        return door.GetState() == Door::InitSensing;
+                    });
+                if (sensing && time_now - burst_start < burst_limit)
+                    return;
+
+                burst_polling = false;
+                loop_timer->repeat(poll_time_fast);
+                poll_interval = poll_time_fast;
+                last_poll = {};
+                Log::Message("main: initial sensing took ", duration_cast<milliseconds>(time_now - burst_start).count(), " ms",
+                             sensing ? ", some doors are still sensing" : "");
+            }
+
+            bool fast_poll_new = door_bank.AnyFastPoll();
             if (fast_poll_new != fast_polling)
             {
                 if (fast_poll_new)
                 {
                     loop_timer->repeat(poll_time_fast);
+                    poll_interval = poll_time_fast;
                     Log::Message("main: start fast polling");
+                } else if (sensor_events && none_of(doors.begin(), doors.end(), [](const Door& door)
+                    {
+                        return door.HasPolledInputs();
+                    }))
+                {
+                    // edges wake us up, nothing to do until then
+                    loop_timer->stop();
+                    last_poll = {};
+                    Log::Message("main: sensors idle, stop polling");
                 } else
                 {
                     loop_timer->repeat(poll_time_slow);
+                    poll_interval = poll_time_slow;
                     Log::Message("main: start slow polling");
                 }
                 fast_polling = fast_poll_new;
             }
         });
 
-    if (mqtt_client.Connect(mqtt_broker))
-    {
-        Log::Message("main: MQTT connected to " + mqtt_broker);
-        Log::Message("main: MQTT socket: " + std::to_string(mqtt_client.socket()));
-        loop_mqtt_poll = mqtt_start_poll(uvloop, &mqtt_client);
+    // timing statistics, to compare threaded and single loop mode
+    auto stats_timer = uvloop->resource<uvw::TimerHandle>();
+    stats_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            const char *mode = gpio_thread ? "threaded" : "single loop";
+            Log::Message("main: ", mode, " poll jitter us: ", poll_jitter_fast.Summary());
+            Log::Message("main: ", mode, " pulse error us: ", pulse_scheduler->GetErrorHistogram().Summary());
+        });
+    stats_timer->start(stats_interval, stats_interval);
+
+    auto calibration_timer = gpio_loop->resource<uvw::TimerHandle>();
+    calibration_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            save_calibration();
+        });
+    if (!calibration_file.empty() && calibration_save_interval > 0)
+        calibration_timer->start(calibration_save_interval * 1s, calibration_save_interval * 1s);
 
-        for (auto& door: doors)
+    auto health_timer = gpio_loop->resource<uvw::TimerHandle>();
+    health_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
         {
-            Door *doorp = &door;
-            mqtt_client.SubscribeTopic(mqtt_prefix + to_string(door.GetIndex()) + "/command", [doorp](string topic, string payload)
+            for (auto& door: doors)
+                door.CheckHealth();
+        });
+    health_timer->start(health_interval, health_interval);
+
+    MetricsServer metrics_server{uvloop};
+    if (metrics_port > 0)
+        metrics_server.Listen(metrics_address, metrics_port);
+
+    auto metrics_timer = uvloop->resource<uvw::TimerHandle>();
+    metrics_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            mqtt_client.PublishTopic(mqtt_prefix + "metrics", Metrics::Get().Json(), false, OutboundQueue::ClassMetrics);
+        });
+    if (metrics_interval > 0)
+        metrics_timer->start(metrics_interval * 1s, metrics_interval * 1s);
+
+    state_publisher.SetPublishHandler([](int index)
+        {
+            if (startup_timeline.DoorPublished(index))
+                publish_startup();
+        });
+
+    // runs on the first connection and again after every reconnect, the
+    // broker may have lost retained state in between
+    mqtt_client.SetConnectHandler([]()
+        {
+            Log::Message("main: MQTT connected to " + mqtt_client.GetBrokerHost());
+            startup_timeline.Mark("mqtt_connected");
+            state_publisher.Invalidate();
+            announce_doors();
+            // in threaded mode the publisher already holds the last state
+            // reported by the GPIO thread
+            if (!gpio_thread)
+            {
+                for (auto& door: doors)
+                    publish_state(door);
+            }
+            // states known before the session was up go out right away
+            state_publisher.Flush();
+        });
+
+    // After a Home Assistant restart its entities are gone until discovery
+    // is sent again. Retained states are still on the broker, but they go
+    // out again too in case the broker was restarted with it.
+    mqtt_client.SubscribeTopic(mqtt_ha_status, [](string_view, string_view payload, const TopicRouter::captures&)
+        {
+            if (payload != "online")
+                return;
+            Log::Message("main: Home Assistant is online, announcing ", door_indexes.size(), " doors");
+            announce_doors();
+            state_publisher.Invalidate();
+        });
+
+    // one subscription covers the commands for every door, the door index
+    // comes from the wildcard level
+    // history queries read the file through a mapping of their own, the
+    // door may be appending from the GPIO thread meanwhile
+    mqtt_client.SubscribeTopic(mqtt_prefix + "+/history", [](string_view, string_view payload, const TopicRouter::captures& caps)
+        {
+            int door_index;
+            if (!parse_door_index(caps[0], door_index) || history_dir.empty())
+                return;
+
+            Json::Value request;
+            if (!payload.empty())
+            {
+                Json::CharReaderBuilder builder;
+                unique_ptr<Json::CharReader> reader{builder.newCharReader()};
+                string errors;
+                if (!reader->parse(payload.data(), payload.data() + payload.size(), &request, &errors) || !request.isObject())
                 {
-                    Log::Message("MQTT command: " + payload);
-                    if (payload == "open")
-                    {
-                        doorp->DoOpen();
-                    }
-                    else if (payload == "close")
-                    {
-                        doorp->DoClose();
-                    }
-                    publish_state(*doorp);
+                    Log::Warning("MQTT history request for door ", door_index, " is not a JSON object");
+                    return;
+                }
+            }
+            auto field = [&request](const char *name, uint64_t fallback)
+                {
+                    auto& value = request[name];
+                    return value.isUInt64() ? value.asUInt64() : fallback;
+                };
+
+            EventHistory history;
+            if (!history.OpenRead(history_path(door_index)))
+                return;
+            string result = history_json(history, field("from", 0), field("to", UINT64_MAX), field("limit", history_query_limit));
+            mqtt_client.PublishTopic(mqtt_prefix + to_string(door_index) + "/history/result", result);
+        });
+
+    mqtt_client.SubscribeTopic(mqtt_prefix + "+/command", [](string_view, string_view payload, const TopicRouter::captures& caps)
+        {
+            int door_index;
+            if (!parse_door_index(caps[0], door_index))
+            {
+                Log::Warning("MQTT command for unknown door ", caps[0]);
+                return;
+            }
+            Log::Message("MQTT command: ", payload);
+            FlightRecorder::CommandType cmd = FlightRecorder::CmdUnknown;
+            if (payload == "open")
+                cmd = FlightRecorder::CmdOpen;
+            else if (payload == "close")
+                cmd = FlightRecorder::CmdClose;
+            else if (payload == "dump")
+                cmd = FlightRecorder::CmdDump;
+
+            if (gpio_thread)
+                post_gpio_command({door_index, (uint8_t)cmd});
+            else
+                run_command(*find_door(door_index), cmd);
+        });
+
+    // live config reload, on SIGHUP or when the file changes. The directory
+    // is watched since editors usually replace the file, and a burst of
+    // events is collapsed into one reload.
+    auto reload_timer = uvloop->resource<uvw::TimerHandle>();
+    reload_timer->on<uvw::TimerEvent>([](uvw::TimerEvent&, uvw::TimerHandle&)
+        {
+            reload_config();
+        });
+    auto hup_signal = uvloop->resource<uvw::SignalHandle>();
+    hup_signal->on<uvw::SignalEvent>([](uvw::SignalEvent&, uvw::SignalHandle&)
+        {
+            Log::Message("main: SIGHUP, reloading configuration");
+            reload_config();
+        });
+    hup_signal->start(SIGHUP);
+
+    // SIGTERM and SIGINT end the run with the GPIO thread stopped and every
+    // handle closed, so calibration, history and the log get flushed below
+    auto shutdown = [uvloop](uvw::SignalEvent& event, uvw::SignalHandle&)
+        {
+            Log::Message("main: signal ", event.signum, ", shutting down");
+            if (gpio_thread)
+                gpio_thread->Stop();
+            uvloop->walk([](uvw::BaseHandle& handle)
+                {
+                    if (!handle.closing())
+                        handle.close();
                 });
-            publish_discovery(door);
-        }
+            uvloop->stop();
+        };
+    auto term_signal = uvloop->resource<uvw::SignalHandle>();
+    term_signal->on<uvw::SignalEvent>(shutdown);
+    term_signal->start(SIGTERM);
+    auto int_signal = uvloop->resource<uvw::SignalHandle>();
+    int_signal->on<uvw::SignalEvent>(shutdown);
+    int_signal->start(SIGINT);
+    auto config_watch = uvloop->resource<uvw::FsEventHandle>();
+    if (!config_file.empty())
+    {
+        auto slash = config_file.rfind('/');
+        string config_dir = slash == string::npos ? "." : config_file.substr(0, slash + 1);
+        string config_name = slash == string::npos ? config_file : config_file.substr(slash + 1);
+        config_watch->on<uvw::FsEventEvent>([reload_timer, config_name](uvw::FsEventEvent& event, uvw::FsEventHandle&)
+            {
+                if (event.filename != nullptr && config_name == event.filename)
+                    reload_timer->start(reload_delay, 0ms);
+            });
+        config_watch->on<uvw::ErrorEvent>([](uvw::ErrorEvent& err, uvw::FsEventHandle&)
+            {
+                Log::Warning("main: can't watch the config file: ", err.what());
+            });
+        config_watch->start(config_dir);
+    }
+
+    if (gpio_thread)
+    {
+        // keep the GPIO thread from page faulting in the middle of a pulse
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+            Log::Warning("main: mlockall failed: ", strerror(errno));
+        gpio_thread->Start();
     }
 
     uvloop->run();
-    
+
+    if (gpio_thread)
+        gpio_thread->Stop();
+    gpio_thread.reset();
+    save_calibration();
+    for (auto& door: doors)
+    {
+        if (door.GetHistory() != nullptr)
+            door.GetHistory()->Sync();
+    }
+    sensor_polls.clear();
+    pulse_scheduler.reset();
+    deadline_scheduler.reset();
+    Log::Stop();
     return 0;
 }
@@ -0,0 +1,41 @@
+#ifndef _CHECK_HH
+#define _CHECK_HH
+
+#include <iostream>
+
+// Just enough for the unit tests: a failed check prints where and what,
+// and the test's main() returns CheckResult() so ctest sees the failure.
+namespace dooragent
+{
+    inline int check_failures = 0;
+
+    inline int CheckResult()
+    {
+        if (check_failures > 0)
+            std::cerr << check_failures << " checks failed" << std::endl;
+        return check_failures > 0 ? 1 : 0;
+    }
+};
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+            dooragent::check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        auto check_a = (a); \
+        auto check_b = (b); \
+        if (!(check_a == check_b)) \
+        { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b ") failed: " \
+                      << check_a << " != " << check_b << std::endl; \
+            dooragent::check_failures++; \
+        } \
+    } while (0)
+
+#endif
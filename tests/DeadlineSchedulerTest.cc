@@ -0,0 +1,136 @@
+#include "DeadlineScheduler.hh"
+#include "Check.hh"
+#include <vector>
+#include <memory>
+
+using namespace dooragent;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    // without a loop the scheduler only runs what RunExpired() is given
+    using time_point = DeadlineScheduler::time_point;
+    const time_point t0 = time_point{} + 1h;
+
+    void test_order()
+    {
+        DeadlineScheduler scheduler{nullptr};
+        vector<int> fired;
+        DeadlineScheduler::Timer a, b, c;
+        a.callback = [&]() { fired.push_back(1); };
+        b.callback = [&]() { fired.push_back(2); };
+        c.callback = [&]() { fired.push_back(3); };
+        scheduler.Arm(c, t0 + 30ms);
+        scheduler.Arm(a, t0 + 10ms);
+        scheduler.Arm(b, t0 + 20ms);
+        CHECK_EQ(scheduler.GetArmedCount(), 3u);
+
+        CHECK_EQ(scheduler.RunExpired(t0 + 5ms), 0u);
+        CHECK_EQ(scheduler.RunExpired(t0 + 20ms), 2u);
+        CHECK(fired == (vector<int>{1, 2}));
+        CHECK(!a.armed && !b.armed && c.armed);
+        CHECK_EQ(scheduler.RunExpired(t0 + 1s), 1u);
+        CHECK(fired == (vector<int>{1, 2, 3}));
+        CHECK_EQ(scheduler.GetArmedCount(), 0u);
+    }
+
+    void test_cancel_and_rearm()
+    {
+        DeadlineScheduler scheduler{nullptr};
+        int hits = 0;
+        DeadlineScheduler::Timer timer;
+        timer.callback = [&]() { hits++; };
+
+        scheduler.Arm(timer, t0 + 10ms);
+        scheduler.Cancel(timer);
+        CHECK_EQ(scheduler.GetArmedCount(), 0u);
+        CHECK_EQ(scheduler.RunExpired(t0 + 1s), 0u);
+        CHECK_EQ(hits, 0);
+
+        // arming again moves the deadline, the stale entry is skipped
+        scheduler.Arm(timer, t0 + 10ms);
+        scheduler.Arm(timer, t0 + 50ms);
+        CHECK_EQ(scheduler.GetArmedCount(), 1u);
+        CHECK_EQ(scheduler.RunExpired(t0 + 20ms), 0u);
+        CHECK_EQ(scheduler.RunExpired(t0 + 50ms), 1u);
+        CHECK_EQ(hits, 1);
+
+        // cancelling an idle timer is harmless
+        scheduler.Cancel(timer);
+        CHECK_EQ(scheduler.GetArmedCount(), 0u);
+    }
+
+    void test_rearm_from_callback()
+    {
+        DeadlineScheduler scheduler{nullptr};
+        int hits = 0;
+        DeadlineScheduler::Timer timer;
+        time_point next = t0;
+        timer.callback = [&]()
+            {
+                hits++;
+                next += 10ms;
+                if (hits < 3)
+                    scheduler.Arm(timer, next);
+            };
+        next += 10ms;
+        scheduler.Arm(timer, next);
+        // re-armed inside the callback for a time already past, runs again
+        CHECK_EQ(scheduler.RunExpired(t0 + 1s), 3u);
+        CHECK_EQ(hits, 3);
+        CHECK(!timer.armed);
+    }
+
+    // a removed timer can go away with entries still in the heap
+    void test_remove()
+    {
+        DeadlineScheduler scheduler{nullptr};
+        int hits = 0;
+        auto timer = make_unique<DeadlineScheduler::Timer>();
+        DeadlineScheduler::Timer other;
+        timer->callback = [&]() { hits++; };
+        other.callback = [&]() { hits += 10; };
+        scheduler.Arm(*timer, t0 + 10ms);
+        scheduler.Arm(*timer, t0 + 20ms);
+        scheduler.Arm(other, t0 + 15ms);
+        scheduler.Remove(*timer);
+        CHECK_EQ(scheduler.GetArmedCount(), 1u);
+        timer.reset();
+
+        CHECK_EQ(scheduler.RunExpired(t0 + 1s), 1u);
+        CHECK_EQ(hits, 10);
+    }
+
+    void test_many()
+    {
+        DeadlineScheduler scheduler{nullptr};
+        vector<DeadlineScheduler::Timer> timers(200);
+        vector<int> fired;
+        for (size_t i = 0; i < timers.size(); i++)
+        {
+            timers[i].callback = [&fired, i]() { fired.push_back(i); };
+            // scrambled order, every third one cancelled
+            scheduler.Arm(timers[i], t0 + milliseconds((i * 37) % timers.size()));
+        }
+        for (size_t i = 0; i < timers.size(); i += 3)
+            scheduler.Cancel(timers[i]);
+
+        scheduler.RunExpired(t0 + 1s);
+        CHECK_EQ(fired.size(), timers.size() - (timers.size() + 2) / 3);
+        for (size_t i = 1; i < fired.size(); i++)
+            CHECK((fired[i - 1] * 37) % timers.size() <= (fired[i] * 37) % timers.size());
+        for (int i: fired)
+            CHECK(i % 3 != 0);
+    }
+};
+
+int main()
+{
+    test_order();
+    test_cancel_and_rearm();
+    test_rearm_from_callback();
+    test_remove();
+    test_many();
+    return CheckResult();
+}
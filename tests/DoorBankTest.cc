@@ -0,0 +1,215 @@
+#include "DoorBank.hh"
+#include "Check.hh"
+#include <vector>
+
+using namespace dooragent;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    using time_point = DoorBank::time_point;
+    const time_point t0 = time_point{} + 1h;
+
+    // state 0 senses, state 1 reacts to a stable true level, state 2 is
+    // moving and state 3 reacts to nothing
+    constexpr uint32_t StSensing = 0, StReactTrue = 1, StMoving = 2, StIdle = 3;
+
+    void set_masks()
+    {
+        DoorBank::SetStateMasks(1u << StSensing, 1u << StMoving, 1u << StSensing | 1u << StReactTrue, 1u << StSensing);
+    }
+
+    void test_debounce()
+    {
+        DoorBank bank;
+        size_t slot = bank.Add(StIdle);
+        bank.SetDebounce(slot, 50, 10);
+        CHECK(!bank.StableTrue(slot) && !bank.StableFalse(slot));
+
+        // the first sample has to hold for the window too
+        bank.FilterOne(slot, 1, t0);
+        CHECK(!bank.Settled(slot));
+        CHECK(bank.GetSettleTime(slot, t0 + 20ms) == t0 + 50ms);
+        bank.FilterOne(slot, 1, t0 + 49ms);
+        CHECK(!bank.StableTrue(slot));
+        CHECK_EQ(bank.FilterOne(slot, 1, t0 + 50ms), 50u);
+        CHECK(bank.StableTrue(slot));
+        CHECK(bank.Settled(slot));
+
+        // a change reverting within the glitch width is dropped and the
+        // level before it keeps its start time
+        bank.FilterOne(slot, 0, t0 + 100ms);
+        bank.FilterOne(slot, 1, t0 + 105ms);
+        CHECK(bank.StableTrue(slot));
+        CHECK_EQ(bank.GetHeld(slot, t0 + 105ms), 105u);
+
+        // a real change becomes stable after the window
+        bank.FilterOne(slot, 0, t0 + 200ms);
+        bank.FilterOne(slot, 0, t0 + 249ms);
+        CHECK(bank.StableTrue(slot));
+        bank.Refresh(slot, t0 + 250ms);
+        CHECK(bank.StableFalse(slot));
+
+        uint32_t changes, glitches;
+        bank.TakeCounts(slot, changes, glitches);
+        CHECK_EQ(changes, 4u);
+        CHECK_EQ(glitches, 1u);
+        bank.TakeCounts(slot, changes, glitches);
+        CHECK_EQ(changes, 0u);
+        CHECK_EQ(glitches, 0u);
+    }
+
+    void test_wrap()
+    {
+        // the millisecond clock wraps at 2^32, only differences count
+        const time_point tw = time_point{} + milliseconds((uint64_t{1} << 32) - 20);
+        DoorBank bank;
+        size_t slot = bank.Add(StIdle);
+        bank.SetDebounce(slot, 50, 10);
+        bank.FilterOne(slot, 1, tw);
+        bank.FilterOne(slot, 1, tw + 40ms);
+        CHECK(!bank.StableTrue(slot));
+        bank.FilterOne(slot, 1, tw + 50ms);
+        CHECK(bank.StableTrue(slot));
+        CHECK_EQ(bank.GetHeld(slot, tw + 70ms), 70u);
+    }
+
+    // the vector filter has to agree with FilterOne, across lane groups
+    void test_vector_matches_scalar()
+    {
+        set_masks();
+        DoorBank bank, reference;
+        const size_t doors = DoorBank::lanes * 2 + 1;
+        vector<size_t> slots;
+        for (size_t i = 0; i < doors; i++)
+        {
+            slots.push_back(bank.Add(StIdle));
+            reference.Add(StIdle);
+            bank.SetDebounce(i, 20 + i * 5, 5);
+            reference.SetDebounce(i, 20 + i * 5, 5);
+        }
+
+        uint32_t seed = 1;
+        for (int step = 0; step < 400; step++)
+        {
+            auto time_now = t0 + milliseconds(step * 3);
+            for (size_t i = 0; i < doors; i++)
+            {
+                seed = seed * 1103515245 + 12345;
+                // mostly steady with the odd bounce
+                int value = ((step / (10 + i)) + ((seed >> 16) % 17 == 0)) & 1;
+                bank.SetSample(i, value);
+                reference.FilterOne(i, value, time_now);
+            }
+            bank.Update(time_now, [](size_t) { return false; });
+            for (size_t i = 0; i < doors; i++)
+            {
+                CHECK_EQ(bank.StableTrue(i), reference.StableTrue(i));
+                CHECK_EQ(bank.StableFalse(i), reference.StableFalse(i));
+                CHECK_EQ(bank.GetHeld(i, time_now), reference.GetHeld(i, time_now));
+            }
+        }
+    }
+
+    void test_update_evaluates_reacting_slots()
+    {
+        set_masks();
+        DoorBank bank;
+        size_t sensing = bank.Add(StSensing);
+        size_t react = bank.Add(StReactTrue);
+        size_t idle = bank.Add(StIdle);
+        size_t moving = bank.Add(StMoving);
+        size_t removed = bank.Add(StSensing);
+        bank.SetMovingPoll(moving, true);
+        bank.Remove(removed);
+
+        for (size_t slot: {sensing, react, idle, moving})
+            bank.SetSample(slot, 1);
+        bank.Update(t0, [](size_t) { return false; });
+
+        vector<size_t> evaluated;
+        auto& changed = bank.Update(t0 + 100ms, [&](size_t slot)
+            {
+                evaluated.push_back(slot);
+                return slot == react;
+            });
+        CHECK(evaluated == (vector<size_t>{sensing, react, moving}));
+        CHECK_EQ(changed[0], uint64_t{1} << react);
+
+        // a removed slot is handed out again
+        CHECK_EQ(bank.Add(StIdle), removed);
+    }
+
+    void test_fast_poll()
+    {
+        set_masks();
+        DoorBank bank;
+        size_t a = bank.Add(StIdle);
+        size_t b = bank.Add(StSensing);
+        CHECK(bank.NeedFastPoll(b));
+        CHECK(bank.AnyFastPoll());
+
+        bank.SetState(b, StIdle, t0);
+        // nothing sampled yet, there is no level that could be unsettled
+        CHECK(!bank.NeedFastPoll(a));
+        bank.FilterOne(a, 0, t0);
+        CHECK(bank.NeedFastPoll(a));
+        bank.FilterOne(b, 0, t0);
+        bank.Refresh(a, t0 + 1s);
+        bank.Refresh(b, t0 + 1s);
+        CHECK(!bank.NeedFastPoll(a));
+        CHECK(!bank.AnyFastPoll());
+
+        bank.FilterOne(a, 1, t0 + 2s);
+        CHECK(bank.NeedFastPoll(a));
+        CHECK(bank.AnyFastPoll());
+        bank.SetQuarantine(a, true);
+        CHECK(!bank.NeedFastPoll(a));
+        CHECK(!bank.AnyFastPoll());
+
+        bank.SetState(b, StMoving, t0 + 2s);
+        CHECK(!bank.AnyFastPoll());
+        bank.SetMovingPoll(b, true);
+        CHECK(bank.AnyFastPoll());
+    }
+
+    void test_channels()
+    {
+        set_masks();
+        DoorBank bank;
+        size_t slot = bank.Add(StIdle);
+        bank.FilterOne(slot, 0, t0);
+        bank.Refresh(slot, t0 + 1s);
+
+        // an unused channel is settled at 0 and never triggers
+        vector<size_t> evaluated;
+        bank.SetSample(slot, 0);
+        bank.Update(t0 + 2s, [&](size_t s) { evaluated.push_back(s); return false; });
+        CHECK(evaluated.empty());
+
+        // a stable change on another input always runs the state machine
+        bank.EnableChannel(slot, DoorBank::ChOpenLimit);
+        bank.SetDebounce(slot, 30, 5, DoorBank::ChOpenLimit);
+        bank.SetSample(slot, 1, DoorBank::ChOpenLimit);
+        bank.Update(t0 + 3s, [&](size_t s) { evaluated.push_back(s); return false; });
+        bank.SetSample(slot, 1, DoorBank::ChOpenLimit);
+        bank.Update(t0 + 3s + 10ms, [&](size_t s) { evaluated.push_back(s); return false; });
+        CHECK(evaluated.empty());
+        bank.SetSample(slot, 1, DoorBank::ChOpenLimit);
+        bank.Update(t0 + 3s + 30ms, [&](size_t s) { evaluated.push_back(s); return false; });
+        CHECK_EQ(evaluated.size(), 1u);
+        CHECK(bank.StableTrue(slot, DoorBank::ChOpenLimit));
+    }
+};
+
+int main()
+{
+    test_debounce();
+    test_wrap();
+    test_vector_matches_scalar();
+    test_update_evaluates_reacting_slots();
+    test_fast_poll();
+    test_channels();
+    return CheckResult();
+}
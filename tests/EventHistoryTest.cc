@@ -0,0 +1,167 @@
+#include "EventHistory.hh"
+#include "Log.hh"
+#include "Check.hh"
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    const char *path = "EventHistoryTest.hist";
+    constexpr uint64_t all_time = UINT64_MAX;
+
+    // durations of the records a query returns, oldest first
+    vector<uint32_t> durations(const EventHistory& history, size_t limit = 1000)
+    {
+        vector<uint32_t> result;
+        history.Query(0, all_time, limit, [&](const EventHistory::record& r)
+            {
+                result.push_back(r.duration);
+            });
+        return result;
+    }
+
+    vector<uint32_t> range(uint32_t first, uint32_t last)
+    {
+        vector<uint32_t> result;
+        for (uint32_t i = first; i <= last; i++)
+            result.push_back(i);
+        return result;
+    }
+
+    void test_append_and_query()
+    {
+        remove(path);
+        EventHistory history;
+        CHECK(history.Open(path, 3, 8));
+        CHECK_EQ(history.GetCapacity(), 8u);
+        CHECK_EQ(history.GetDoor(), 3);
+        CHECK(durations(history).empty());
+
+        for (uint32_t i = 1; i <= 5; i++)
+            history.Append(i, i + 1, i);
+        CHECK(durations(history) == range(1, 5));
+
+        vector<EventHistory::record> records;
+        history.Query(0, all_time, 10, [&](const EventHistory::record& r) { records.push_back(r); });
+        CHECK_EQ(records.size(), 5u);
+        CHECK_EQ(records[0].from, 1);
+        CHECK_EQ(records[0].to, 2);
+        CHECK(records[0].time > 0 && records[0].time <= records[4].time);
+
+        // the limit keeps the newest, still handed out oldest first
+        CHECK(durations(history, 2) == range(4, 5));
+        CHECK(durations(history, 0).empty());
+        // nothing before the epoch
+        CHECK_EQ(history.Query(0, 1, 10, [](const EventHistory::record&) {}), 0u);
+    }
+
+    void test_wrap()
+    {
+        remove(path);
+        EventHistory history;
+        CHECK(history.Open(path, 1, 8));
+        for (uint32_t i = 1; i <= 21; i++)
+            history.Append(0, 1, i);
+        // the ring holds the newest 8
+        CHECK(durations(history) == range(14, 21));
+        CHECK(durations(history, 3) == range(19, 21));
+    }
+
+    void test_reopen()
+    {
+        remove(path);
+        {
+            EventHistory history;
+            CHECK(history.Open(path, 1, 8));
+            for (uint32_t i = 1; i <= 11; i++)
+                history.Append(0, 1, i);
+            history.Sync();
+        }
+
+        // same capacity: appending continues after the newest record
+        EventHistory history;
+        CHECK(history.Open(path, 2, 8));
+        CHECK_EQ(history.GetDoor(), 2);
+        CHECK(durations(history) == range(4, 11));
+        history.Append(0, 1, 12);
+        CHECK(durations(history) == range(5, 12));
+
+        // a reader sees what the writer appends
+        EventHistory reader;
+        CHECK(reader.OpenRead(path));
+        CHECK(durations(reader) == range(5, 12));
+        history.Append(0, 1, 13);
+        CHECK(durations(reader) == range(6, 13));
+        reader.Close();
+        history.Close();
+
+        // shrinking keeps the newest records, growing keeps them all
+        CHECK(history.Open(path, 2, 4));
+        CHECK(durations(history) == range(10, 13));
+        CHECK(history.Open(path, 2, 16));
+        CHECK(durations(history) == range(10, 13));
+        history.Append(0, 1, 14);
+        CHECK(durations(history) == range(10, 14));
+    }
+
+    // a torn record (checksum mismatch) is skipped, the rest still read
+    void test_corrupt_record()
+    {
+        remove(path);
+        {
+            EventHistory history;
+            CHECK(history.Open(path, 1, 8));
+            for (uint32_t i = 1; i <= 4; i++)
+                history.Append(0, 1, i);
+        }
+
+        // seq 2 lives in slot 2, right after the 64 byte header
+        fstream file{path, ios::in | ios::out | ios::binary};
+        file.seekp(64 + 2 * sizeof(EventHistory::record) + offsetof(EventHistory::record, duration));
+        uint32_t bad = 99;
+        file.write((const char*)&bad, sizeof(bad));
+        file.close();
+
+        EventHistory history;
+        CHECK(history.Open(path, 1, 8));
+        CHECK(durations(history) == (vector<uint32_t>{1, 3, 4}));
+    }
+
+    void test_not_a_history_file()
+    {
+        {
+            ofstream junk{path, ios::trunc};
+            for (int i = 0; i < 100; i++)
+                junk << "not a history file\n";
+        }
+        EventHistory reader;
+        CHECK(!reader.OpenRead(path));
+
+        EventHistory history;
+        CHECK(history.Open(path, 1, 8));
+        CHECK(durations(history).empty());
+        history.Append(0, 1, 7);
+        CHECK(durations(history) == (vector<uint32_t>{7}));
+
+        CHECK(!history.Open(path, 1, 0));
+        CHECK(!history.IsOpen());
+    }
+};
+
+int main()
+{
+    Log::SetStdout(false);
+    test_append_and_query();
+    test_wrap();
+    test_reopen();
+    test_corrupt_record();
+    test_not_a_history_file();
+    remove(path);
+    return CheckResult();
+}
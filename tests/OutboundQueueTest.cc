@@ -0,0 +1,175 @@
+#include "OutboundQueue.hh"
+#include "Log.hh"
+#include "Check.hh"
+#include <string>
+#include <vector>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    vector<string> drain(OutboundQueue& queue)
+    {
+        vector<string> topics;
+        OutboundQueue::message msg;
+        while (queue.Pop(msg))
+            topics.push_back(msg.topic);
+        return topics;
+    }
+
+    void test_priority()
+    {
+        OutboundQueue queue;
+        queue.Push(OutboundQueue::ClassLog, "log", "l", false);
+        queue.Push(OutboundQueue::ClassMetrics, "metrics", "m", false);
+        queue.Push(OutboundQueue::ClassEvent, "event/1", "e", false);
+        queue.Push(OutboundQueue::ClassState, "state/1", "open", true);
+        queue.Push(OutboundQueue::ClassEvent, "event/2", "e", false);
+        queue.Push(OutboundQueue::ClassDiscovery, "config/1", "{}", true);
+        queue.Push(OutboundQueue::ClassState, "state/2", "closed", true);
+        CHECK_EQ(queue.Size(), 7u);
+
+        // highest class first, oldest first within a class
+        CHECK(drain(queue) == (vector<string>{"state/1", "state/2", "config/1", "event/1", "event/2", "metrics", "log"}));
+        CHECK(queue.Empty());
+        CHECK_EQ(queue.GetBytes(), 0u);
+    }
+
+    void test_replace()
+    {
+        OutboundQueue queue;
+        queue.Push(OutboundQueue::ClassState, "state/1", "opening", true);
+        queue.Push(OutboundQueue::ClassState, "state/2", "closed", true);
+        queue.Push(OutboundQueue::ClassState, "state/1", "open", false);
+        CHECK_EQ(queue.Size(), 2u);
+        CHECK_EQ(queue.GetBytes(), 10u);
+
+        // the newer payload keeps the queued message's place
+        OutboundQueue::message msg;
+        CHECK(queue.Pop(msg));
+        CHECK(msg.topic == "state/1");
+        CHECK(msg.payload == "open");
+        CHECK(!msg.retain);
+        CHECK(msg.cls == OutboundQueue::ClassState);
+
+        // once sent, the topic queues anew
+        queue.Push(OutboundQueue::ClassState, "state/1", "closing", true);
+        CHECK(drain(queue) == (vector<string>{"state/2", "state/1"}));
+
+        // events are never merged
+        queue.Push(OutboundQueue::ClassEvent, "event", "a", false);
+        queue.Push(OutboundQueue::ClassEvent, "event", "b", false);
+        CHECK_EQ(queue.Size(), 2u);
+    }
+
+    void test_class_limit()
+    {
+        OutboundQueue queue;
+        queue.SetClass(OutboundQueue::ClassEvent, 1, 3, false);
+        CHECK_EQ(queue.GetLimit(OutboundQueue::ClassEvent), 3u);
+        CHECK_EQ(queue.GetQos(OutboundQueue::ClassEvent), 1);
+        CHECK(!queue.GetReplace(OutboundQueue::ClassEvent));
+        for (int i = 1; i <= 5; i++)
+            queue.Push(OutboundQueue::ClassEvent, "event/" + to_string(i), "e", false);
+        // the oldest go
+        CHECK(drain(queue) == (vector<string>{"event/3", "event/4", "event/5"}));
+
+        // a class with no room at all takes nothing
+        queue.SetClass(OutboundQueue::ClassLog, 0, 0, false);
+        queue.Push(OutboundQueue::ClassLog, "log", "l", false);
+        CHECK(queue.Empty());
+    }
+
+    void test_byte_limit()
+    {
+        OutboundQueue queue;
+        queue.SetMaxBytes(100);
+        queue.Push(OutboundQueue::ClassMetrics, "metrics", string(40, 'm'), false);
+        queue.Push(OutboundQueue::ClassEvent, "event", string(10, 'e'), false);
+        queue.Push(OutboundQueue::ClassState, "state/1", string(30, 's'), true);
+        CHECK_EQ(queue.GetBytes(), 80u);
+
+        // over the limit the lowest class makes room
+        queue.Push(OutboundQueue::ClassState, "state/2", string(50, 's'), true);
+        CHECK_EQ(queue.GetBytes(), 90u);
+        CHECK_EQ(queue.Size(), 3u);
+
+        // but nothing is dropped for a less important message
+        queue.Push(OutboundQueue::ClassLog, "log", string(30, 'l'), false);
+        CHECK_EQ(queue.Size(), 3u);
+        // nor for one that could never fit
+        queue.Push(OutboundQueue::ClassState, "state/3", string(101, 's'), true);
+        CHECK_EQ(queue.Size(), 3u);
+
+        // replacing adjusts the byte count
+        queue.Push(OutboundQueue::ClassState, "state/2", string(5, 's'), true);
+        CHECK_EQ(queue.GetBytes(), 45u);
+        CHECK(drain(queue) == (vector<string>{"state/1", "state/2", "event"}));
+        CHECK_EQ(queue.GetBytes(), 0u);
+    }
+
+    // making room can take more than one lower message, and stops at
+    // messages of the same class
+    void test_byte_limit_order()
+    {
+        OutboundQueue queue;
+        queue.SetMaxBytes(60);
+        queue.Push(OutboundQueue::ClassEvent, "event/1", string(20, 'e'), false);
+        queue.Push(OutboundQueue::ClassLog, "log/1", string(10, 'l'), false);
+        queue.Push(OutboundQueue::ClassLog, "log/2", string(10, 'l'), false);
+        queue.Push(OutboundQueue::ClassMetrics, "metrics", string(10, 'm'), false);
+        queue.Push(OutboundQueue::ClassEvent, "event/2", string(35, 'e'), false);
+        CHECK(drain(queue) == (vector<string>{"event/1", "event/2"}));
+
+        queue.Push(OutboundQueue::ClassEvent, "event/3", string(30, 'e'), false);
+        queue.Push(OutboundQueue::ClassEvent, "event/4", string(30, 'e'), false);
+        // an event over the limit goes in place of the oldest event
+        queue.Push(OutboundQueue::ClassEvent, "event/5", string(30, 'e'), false);
+        CHECK(drain(queue) == (vector<string>{"event/4", "event/5"}));
+    }
+
+    // a message that couldn't be published goes back in front of its
+    // class, unless a newer one for the topic turned up meanwhile
+    void test_requeue()
+    {
+        OutboundQueue queue;
+        queue.Push(OutboundQueue::ClassEvent, "event/1", "e1", false);
+        queue.Push(OutboundQueue::ClassEvent, "event/2", "e2", false);
+        queue.Push(OutboundQueue::ClassState, "state/1", "open", true);
+
+        OutboundQueue::message msg;
+        CHECK(queue.Pop(msg));
+        queue.Requeue(move(msg));
+        CHECK(queue.Pop(msg));
+        CHECK_EQ(msg.topic, "state/1");
+        CHECK(queue.Pop(msg));
+        CHECK_EQ(msg.topic, "event/1");
+        queue.Requeue(move(msg));
+        CHECK_EQ(queue.Size(), 2u);
+        CHECK_EQ(queue.GetBytes(), 4u);
+        CHECK(drain(queue) == (vector<string>{"event/1", "event/2"}));
+
+        queue.Push(OutboundQueue::ClassState, "state/1", "open", true);
+        CHECK(queue.Pop(msg));
+        queue.Push(OutboundQueue::ClassState, "state/1", "closed", true);
+        queue.Requeue(move(msg));
+        CHECK_EQ(queue.Size(), 1u);
+        CHECK(queue.Pop(msg));
+        CHECK_EQ(msg.payload, "closed");
+        CHECK(queue.Empty());
+        CHECK_EQ(queue.GetBytes(), 0u);
+    }
+};
+
+int main()
+{
+    Log::SetStdout(false);
+    test_priority();
+    test_replace();
+    test_class_limit();
+    test_byte_limit();
+    test_byte_limit_order();
+    test_requeue();
+    return CheckResult();
+}
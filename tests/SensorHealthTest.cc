@@ -0,0 +1,97 @@
+#include "SensorHealth.hh"
+#include "Check.hh"
+#include <string>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    void test_chatter()
+    {
+        SensorHealth health;
+        health.SetLimits(20, 2);
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+
+        // a door cycling every few intervals stays well under the limit
+        for (size_t i = 0; i < SensorHealth::buckets * 2; i++)
+            CHECK(!health.AddCounts(i % 3 == 0 ? 2 : 0, 0));
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+
+        // the window sums up, one bucket alone needn't cross the limit
+        CHECK(!health.AddCounts(9, 4));
+        CHECK(health.AddCounts(9, 4));
+        CHECK(health.GetStatus() == SensorHealth::Chatter);
+        CHECK(string{SensorHealth::StatusStr(health.GetStatus())} == "chatter");
+
+        // only clears once the noisy buckets have left the window
+        for (size_t i = 0; i < SensorHealth::buckets - 1; i++)
+            CHECK(!health.AddCounts(0, 0));
+        CHECK(health.GetStatus() == SensorHealth::Chatter);
+        CHECK(health.AddCounts(0, 0));
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+        CHECK_EQ(health.GetChanges(), 0u);
+        CHECK_EQ(health.GetGlitches(), 0u);
+    }
+
+    // between the limit and quiet the status doesn't flap
+    void test_hysteresis()
+    {
+        SensorHealth health;
+        health.SetLimits(20, 0);
+        health.AddCounts(25, 0);
+        CHECK(health.GetStatus() == SensorHealth::Chatter);
+        for (size_t i = 0; i < SensorHealth::buckets; i++)
+            health.AddCounts(1, 1);
+        CHECK_EQ(health.GetChanges(), (uint32_t)SensorHealth::buckets);
+        CHECK(health.GetStatus() == SensorHealth::Chatter);
+        for (size_t i = 0; i < SensorHealth::buckets; i++)
+            health.AddCounts(0, 0);
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+    }
+
+    void test_stuck()
+    {
+        SensorHealth health;
+        health.SetLimits(20, 2);
+        CHECK(!health.CommandTimedOut());
+        CHECK(health.CommandTimedOut());
+        CHECK(health.GetStatus() == SensorHealth::Stuck);
+        CHECK(!health.CommandTimedOut());
+        CHECK(health.SensorMoved());
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+
+        // a move in between starts the count over
+        CHECK(!health.CommandTimedOut());
+        CHECK(!health.SensorMoved());
+        CHECK(!health.CommandTimedOut());
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+    }
+
+    void test_chatter_wins_and_off()
+    {
+        SensorHealth health;
+        health.SetLimits(5, 1);
+        health.CommandTimedOut();
+        health.AddCounts(6, 0);
+        CHECK(health.GetStatus() == SensorHealth::Chatter);
+
+        // turning a check off clears what it set
+        health.SetLimits(0, 1);
+        CHECK(health.GetStatus() == SensorHealth::Stuck);
+        health.AddCounts(100, 0);
+        CHECK(health.GetStatus() == SensorHealth::Stuck);
+        health.SetLimits(0, 0);
+        CHECK(health.GetStatus() == SensorHealth::Ok);
+        CHECK(!health.CommandTimedOut());
+    }
+};
+
+int main()
+{
+    test_chatter();
+    test_hysteresis();
+    test_stuck();
+    test_chatter_wins_and_off();
+    return CheckResult();
+}
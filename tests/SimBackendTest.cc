@@ -0,0 +1,165 @@
+#include "SimBackend.hh"
+#include "GpioTrace.hh"
+#include "Log.hh"
+#include "Check.hh"
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <cstdio>
+
+using namespace dooragent;
+using namespace std;
+using namespace std::chrono;
+
+namespace
+{
+    const char *script_path = "SimBackendTest.json";
+    const char *trace_path = "SimBackendTest.trace";
+
+    // an edge input that bounces twice a second, repeating every second,
+    // and a polled one that goes high once
+    void write_script()
+    {
+        ofstream script{script_path};
+        script << R"({
+            "tick": 100, "duration": 2000,
+            "inputs": [
+                { "chip": "gpiochip0", "line": 17, "initial": 1,
+                  "waveform": [[250, 0], [260, 1], [700, 0]], "repeat": 1000 },
+                { "chip": "gpiochip0", "line": 18, "initial": 0,
+                  "waveform": [[450, 1]] }
+            ]
+        })";
+    }
+
+    struct record
+    {
+        GpioBackend::step::Kind kind;
+        long ms;
+        int value;
+
+        bool operator==(const record& other) const
+            {
+                return kind == other.kind && ms == other.ms && value == other.value;
+            }
+    };
+
+    // What the main loop does offline: poll on ticks, read edges as they
+    // come. Ticks record the polled input, edges the edge value.
+    vector<record> run(GpioBackend& backend, int edge_input, int polled_input)
+    {
+        vector<record> records;
+        auto start = backend.Now();
+        GpioBackend::step next;
+        while (backend.NextStep(next))
+        {
+            long ms = duration_cast<milliseconds>(next.time - start).count();
+            if (next.kind == GpioBackend::step::Tick)
+            {
+                backend.ReadInputs(false);
+                records.push_back({next.kind, ms, backend.GetInputValue(polled_input)});
+            }
+            else
+            {
+                CHECK_EQ(next.input, edge_input);
+                GpioBackend::edge event;
+                CHECK(backend.ReadInputEvent(next.input, event));
+                CHECK(event.time == next.time);
+                records.push_back({next.kind, ms, event.value ? 1 : 0});
+                // one step, one edge
+                CHECK(!backend.ReadInputEvent(next.input, event));
+            }
+        }
+        return records;
+    }
+
+    vector<record> edges_of(const vector<record>& records)
+    {
+        vector<record> edges;
+        for (auto& r: records)
+        {
+            if (r.kind == GpioBackend::step::Edge)
+                edges.push_back(r);
+        }
+        return edges;
+    }
+
+    void test_offline_steps()
+    {
+        SimBackend sim{true};
+        CHECK(sim.LoadScript(script_path));
+        int edge_input = sim.AddInput("gpiochip0", 17, true);
+        int polled_input = sim.AddInput("gpiochip0", 18, false);
+        sim.RequestInputs();
+        CHECK_EQ(sim.GetInputValue(edge_input), 1);
+        CHECK_EQ(sim.GetInputValue(polled_input), 0);
+
+        auto records = run(sim, edge_input, polled_input);
+
+        auto E = GpioBackend::step::Edge;
+        vector<record> expected_edges = {
+            {E, 250, 0}, {E, 260, 1}, {E, 700, 0},
+            // the next period starts over from the initial level
+            {E, 1000, 1}, {E, 1250, 0}, {E, 1260, 1}, {E, 1700, 0}, {E, 2000, 1}
+        };
+        CHECK(edges_of(records) == expected_edges);
+
+        size_t ticks = 0;
+        for (auto& r: records)
+        {
+            if (r.kind != GpioBackend::step::Tick)
+                continue;
+            CHECK_EQ(r.ms % 100, 0);
+            CHECK_EQ(r.value, r.ms >= 450 ? 1 : 0);
+            ticks++;
+        }
+        // 0 to 2000 ms inclusive
+        CHECK_EQ(ticks, 21u);
+    }
+
+    // a recording of the simulation replays to the same steps
+    void test_record_replay()
+    {
+        vector<record> recorded;
+        {
+            auto sim = make_unique<SimBackend>(true);
+            CHECK(sim->LoadScript(script_path));
+            GpioTraceRecorder recorder{move(sim), trace_path};
+            CHECK(recorder.IsOpen());
+            int edge_input = recorder.AddInput("gpiochip0", 17, true);
+            int polled_input = recorder.AddInput("gpiochip0", 18, false);
+            recorder.RequestInputs();
+            recorded = run(recorder, edge_input, polled_input);
+        }
+
+        GpioTraceReplay replay;
+        CHECK(replay.Load(trace_path));
+        // the door side may ask in another order, or for lines the trace
+        // doesn't have
+        int missing = replay.AddInput("gpiochip1", 3, false);
+        int polled_input = replay.AddInput("gpiochip0", 18, false);
+        int edge_input = replay.AddInput("gpiochip0", 17, true);
+        auto replayed = run(replay, edge_input, polled_input);
+
+        CHECK_EQ(recorded.size(), replayed.size());
+        CHECK(recorded == replayed);
+        CHECK_EQ(replay.GetInputValue(missing), 0);
+
+        ofstream broken{trace_path, ios::trunc};
+        broken << "nope";
+        broken.close();
+        GpioTraceReplay bad;
+        CHECK(!bad.Load(trace_path));
+    }
+};
+
+int main()
+{
+    Log::SetStdout(false);
+    write_script();
+    test_offline_steps();
+    test_record_replay();
+    remove(script_path);
+    remove(trace_path);
+    return CheckResult();
+}
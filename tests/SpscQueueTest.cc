@@ -0,0 +1,79 @@
+#include "SpscQueue.hh"
+#include "Check.hh"
+#include <thread>
+#include <cstdint>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    void test_fifo_and_full()
+    {
+        SpscQueue<int, 4> queue;
+        int item = -1;
+        CHECK(queue.Empty());
+        CHECK(!queue.Pop(item));
+
+        for (int i = 0; i < 4; i++)
+            CHECK(queue.Push(i));
+        CHECK(!queue.Push(4));
+        CHECK(!queue.Empty());
+
+        CHECK(queue.Pop(item));
+        CHECK_EQ(item, 0);
+        // room for one again, and the order holds across the wrap
+        CHECK(queue.Push(4));
+        for (int i = 1; i <= 4; i++)
+        {
+            CHECK(queue.Pop(item));
+            CHECK_EQ(item, i);
+        }
+        CHECK(queue.Empty());
+        CHECK(!queue.Pop(item));
+    }
+
+    // one producer and one consumer thread, every item arrives once and
+    // in order
+    void test_threads()
+    {
+        constexpr uint64_t items = 1000000;
+        SpscQueue<uint64_t, 256> queue;
+        uint64_t sum = 0, expected = 0;
+        bool ordered = true;
+
+        thread consumer([&]()
+            {
+                uint64_t item;
+                while (expected < items)
+                {
+                    if (!queue.Pop(item))
+                    {
+                        this_thread::yield();
+                        continue;
+                    }
+                    ordered = ordered && item == expected;
+                    sum += item;
+                    expected++;
+                }
+            });
+
+        for (uint64_t i = 0; i < items; i++)
+        {
+            while (!queue.Push(i))
+                this_thread::yield();
+        }
+        consumer.join();
+
+        CHECK(ordered);
+        CHECK_EQ(sum, items * (items - 1) / 2);
+        CHECK(queue.Empty());
+    }
+};
+
+int main()
+{
+    test_fifo_and_full();
+    test_threads();
+    return CheckResult();
+}
@@ -0,0 +1,120 @@
+#include "TopicRouter.hh"
+#include "Check.hh"
+#include <string>
+#include <vector>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    void test_exact()
+    {
+        TopicRouter router;
+        int hits = 0;
+        router.Add("door/1/cmd", [&](string_view topic, string_view payload, const TopicRouter::captures& caps)
+            {
+                CHECK(topic == "door/1/cmd");
+                CHECK(payload == "open");
+                CHECK_EQ(caps.size(), 0u);
+                hits++;
+            });
+        CHECK_EQ(router.Dispatch("door/1/cmd", "open"), 1u);
+        CHECK_EQ(router.Dispatch("door/2/cmd", "open"), 0u);
+        CHECK_EQ(router.Dispatch("door/1", "open"), 0u);
+        CHECK_EQ(router.Dispatch("door/1/cmd/x", "open"), 0u);
+        CHECK_EQ(hits, 1);
+    }
+
+    void test_single_level()
+    {
+        TopicRouter router;
+        vector<string> seen;
+        router.Add("door/+/cmd", [&](string_view, string_view, const TopicRouter::captures& caps)
+            {
+                CHECK_EQ(caps.size(), 1u);
+                seen.emplace_back(caps[0]);
+            });
+        CHECK_EQ(router.Dispatch("door/7/cmd", ""), 1u);
+        CHECK_EQ(router.Dispatch("door/12/cmd", ""), 1u);
+        CHECK_EQ(router.Dispatch("door/7/state", ""), 0u);
+        CHECK_EQ(router.Dispatch("door/7/x/cmd", ""), 0u);
+        CHECK_EQ(seen.size(), 2u);
+        CHECK(seen.size() == 2 && seen[0] == "7" && seen[1] == "12");
+    }
+
+    void test_multi_level()
+    {
+        TopicRouter router;
+        string rest;
+        router.Add("door/#", [&](string_view, string_view, const TopicRouter::captures& caps)
+            {
+                rest = string{caps[0]};
+            });
+        CHECK_EQ(router.Dispatch("door/1/history/get", ""), 1u);
+        CHECK(rest == "1/history/get");
+        // "a/#" matches its parent level too
+        CHECK_EQ(router.Dispatch("door", ""), 1u);
+        CHECK_EQ(router.Dispatch("other/1", ""), 0u);
+    }
+
+    void test_overlapping()
+    {
+        TopicRouter router;
+        int exact = 0, wild = 0, multi = 0;
+        router.Add("door/1/cmd", [&](string_view, string_view, const TopicRouter::captures&) { exact++; });
+        router.Add("door/+/cmd", [&](string_view, string_view, const TopicRouter::captures&) { wild++; });
+        router.Add("#", [&](string_view, string_view, const TopicRouter::captures&) { multi++; });
+        CHECK_EQ(router.Dispatch("door/1/cmd", ""), 3u);
+        CHECK_EQ(router.Dispatch("door/2/cmd", ""), 2u);
+        CHECK_EQ(exact, 1);
+        CHECK_EQ(wild, 2);
+        CHECK_EQ(multi, 2);
+    }
+
+    void test_sys_topics()
+    {
+        TopicRouter router;
+        int hits = 0;
+        router.Add("#", [&](string_view, string_view, const TopicRouter::captures&) { hits++; });
+        router.Add("+/broker/uptime", [&](string_view, string_view, const TopicRouter::captures&) { hits++; });
+        CHECK_EQ(router.Dispatch("$SYS/broker/uptime", ""), 0u);
+        router.Add("$SYS/broker/uptime", [&](string_view, string_view, const TopicRouter::captures&) { hits++; });
+        CHECK_EQ(router.Dispatch("$SYS/broker/uptime", ""), 1u);
+        CHECK_EQ(hits, 1);
+    }
+
+    void test_remove()
+    {
+        TopicRouter router;
+        int hits = 0;
+        router.Add("door/+/cmd", [&](string_view, string_view, const TopicRouter::captures&) { hits++; });
+        router.Add("door/#", [&](string_view, string_view, const TopicRouter::captures&) { hits++; });
+        router.Remove("door/+/cmd");
+        CHECK_EQ(router.Dispatch("door/1/cmd", ""), 1u);
+        router.Remove("door/#");
+        CHECK_EQ(router.Dispatch("door/1/cmd", ""), 0u);
+        // unknown filters are ignored
+        router.Remove("nothing/+/here");
+        CHECK_EQ(hits, 1);
+    }
+
+    void test_is_filter()
+    {
+        CHECK(TopicRouter::IsFilter("door/+/cmd"));
+        CHECK(TopicRouter::IsFilter("door/#"));
+        CHECK(!TopicRouter::IsFilter("door/1/cmd"));
+    }
+};
+
+int main()
+{
+    test_exact();
+    test_single_level();
+    test_multi_level();
+    test_overlapping();
+    test_sys_topics();
+    test_remove();
+    test_is_filter();
+    return CheckResult();
+}
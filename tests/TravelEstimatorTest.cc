@@ -0,0 +1,101 @@
+#include "TravelEstimator.hh"
+#include "Check.hh"
+#include <cmath>
+
+using namespace dooragent;
+using namespace std;
+
+namespace
+{
+    void test_fallback()
+    {
+        TravelEstimator est;
+        CHECK_EQ(est.GetCount(), 0u);
+        CHECK_EQ(est.Percentile(0.5), 0);
+        est.Add(9000);
+        est.Add(9100);
+        // not enough samples yet
+        CHECK_EQ(est.Typical(10000, 1000, 60000), 10000);
+        CHECK_EQ(est.Timeout(12000, 1000, 60000), 12000);
+        est.Add(9200);
+        CHECK(est.Typical(10000, 1000, 60000) != 10000);
+    }
+
+    void test_estimates()
+    {
+        TravelEstimator est;
+        for (int i = 0; i < 40; i++)
+            est.Add(10000 + (i % 5) * 100);
+        CHECK(fabs(est.GetMean() - 10200) < 150);
+        CHECK(est.GetDeviation() < 200);
+        CHECK_EQ(est.Percentile(0.0), 10000);
+        CHECK_EQ(est.Percentile(1.0), 10400);
+        CHECK_EQ(est.Typical(0, 1000, 60000), 10400);
+
+        // the timeout stays above what a normal cycle takes, and clamped
+        int timeout = est.Timeout(0, 1000, 60000);
+        CHECK(timeout > 10400);
+        CHECK(timeout < 15000);
+        CHECK_EQ(est.Timeout(0, 1000, 12000), 12000);
+        CHECK_EQ(est.Typical(0, 11000, 60000), 11000);
+
+        // one outlier doesn't move the percentile
+        est.Add(50000);
+        CHECK_EQ(est.Typical(0, 1000, 60000), 10400);
+    }
+
+    void test_save_load()
+    {
+        TravelEstimator est;
+        for (int i = 0; i < 50; i++)
+            est.Add(5000 + i * 10);
+        auto saved = est.Save();
+        CHECK_EQ(saved["recent"].size(), TravelEstimator::history);
+
+        TravelEstimator loaded;
+        loaded.Load(saved);
+        CHECK_EQ(loaded.GetCount(), (unsigned)TravelEstimator::history);
+        CHECK_EQ(loaded.GetMean(), est.GetMean());
+        CHECK_EQ(loaded.GetDeviation(), est.GetDeviation());
+        for (double p: {0.0, 0.5, 0.95, 1.0})
+            CHECK_EQ(loaded.Percentile(p), est.Percentile(p));
+
+        // new samples replace the oldest loaded ones first
+        loaded.Add(4000);
+        CHECK_EQ(loaded.Percentile(0.0), 4000);
+        CHECK_EQ(loaded.Percentile(1.0), est.Percentile(1.0));
+        est.Add(4000);
+        CHECK_EQ(loaded.Percentile(0.5), est.Percentile(0.5));
+    }
+
+    // a count larger than the samples that came back can't pull
+    // unset slots into the percentile
+    void test_load_short()
+    {
+        Json::Value saved(Json::objectValue);
+        saved["mean"] = 7000.0;
+        saved["deviation"] = 50.0;
+        saved["count"] = 500;
+        saved["recent"].append(7000);
+        saved["recent"].append(7100);
+        saved["recent"].append(6900);
+
+        TravelEstimator est;
+        est.Load(saved);
+        CHECK_EQ(est.GetCount(), 3u);
+        CHECK_EQ(est.Percentile(0.0), 6900);
+        CHECK_EQ(est.Percentile(1.0), 7100);
+
+        est.Load(Json::Value("garbage"));
+        CHECK_EQ(est.GetCount(), 3u);
+    }
+};
+
+int main()
+{
+    test_fallback();
+    test_estimates();
+    test_save_load();
+    test_load_short();
+    return CheckResult();
+}